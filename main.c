@@ -1,27 +1,196 @@
+#define _GNU_SOURCE // open file description locks
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 
 #define LENGTH_OF_ACCOUNT_NUMBER 10
 #define LENGTH_OF_NAME 16
 #define LENGTH_OF_SURNAME 16
 #define LENGTH_OF_ADDRESS 32
 #define LENGTH_OF_NATIONAL_ID 11
-#define LENGTH_OF_BALANCE 10
-#define LENGTH_OF_LOAN_BALANCE 10
+#define LENGTH_OF_BALANCE 16      // "9999999999999.99", MAX_ACCOUNT_VALUE in full
+#define LENGTH_OF_LOAN_BALANCE 16
 #define LENGTH_OF_INTEREST_RATE 7
+#define LENGTH_OF_MONEY_TEXT 24   // any money_t with sign, point and terminator
+
+#define MONEY_SCALE 100           // money is held in minor units, amounts are read and shown with MONEY_DECIMALS decimals
+#define MONEY_DECIMALS 2
+#define RATE_SCALE 10000000       // interest rates in units of 10^-LENGTH_OF_INTEREST_RATE, the precision they are shown with
 
 #define FULL_VIEW 1
 #define SHORT_VIEW 2
 
+#define TABLE_OUTPUT 0
+#define CSV_OUTPUT 1
+#define JSON_OUTPUT 2
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define MAX_RENDERED_ROW 512 // upper bound of one rendered row in any output format
+
 #define RECORD_FILE "records.txt"
 #define WELCOME_SCREEN_FILE "welcome_screen.txt"
+#define JOURNAL_FILE "journal.txt"
+#define SNAPSHOT_FILE "records.snapshot"
+#define SNAPSHOT_JOURNAL_FILE "journal.txt.prev" // journal segment the unfinished snapshot's predecessor still needs
+#define STATS_FILE "stats.json"
+#define LEDGER_FILE "ledger.txt"
+#define LEDGER_INDEX_FILE "ledger_index.txt"
+#define STANDING_ORDERS_FILE "standing_orders.txt"
+
+#define STORE_MAGIC "BANKSTOR"
+#define STORE_FORMAT_VERSION 4
+#define STORE_PAGE_SIZE 4096
+#define STORE_HEADER_SIZE (1 << 20)   // header page, then the block checksum table
+#define STORE_MAX_BLOCKS ((STORE_HEADER_SIZE - STORE_PAGE_SIZE) / sizeof(uint32_t))
+#define STORE_V2_HEADER_SIZE 4096     // format v2 had the header page only
+#define STORE_V3_BLOCK_SIZE (STORE_BLOCK_SLOTS * (sizeof(hot_v3_t) + sizeof(cold_t))) // v2 and v3 blocks
+#define STORE_BLOCK_SLOTS 512    // accounts per block: their hot columns first, then their identity strings
+#define STORE_GROWTH_BLOCKS 8    // record file is grown (and remapped) by this many blocks at once
+#define STORE_SHARD_BLOCKS 256   // blocks per shard file of a new record file, 131072 accounts
+#define STORE_MAX_SHARDS (STORE_MAX_BLOCKS / STORE_SHARD_BLOCKS + 1)
+#define STORE_PATH_LENGTH 256
+#define INDEX_GROWTH 1024
+#define TRIGRAM_SYMBOLS 38 // start of field, a-z, 0-9 and one for anything else
+#define N_OF_TRIGRAMS (TRIGRAM_SYMBOLS * TRIGRAM_SYMBOLS * TRIGRAM_SYMBOLS)
+#define LENGTH_OF_NORMALIZED LENGTH_OF_ADDRESS // folding never lengthens a field
+#define FUZZY_MAX_DISTANCE 2 // edits a long name, surname or address query may be away from its match
+#define TRIGRAM_VERIFY_COST 16 // list entries read in the time one listed account is checked against a query
+#define ID_INDEX_MIN_BUCKETS 1024
+#define ID_FILTER_MIN_BITS (1u << 20)
+#define ID_FILTER_BITS_PER_ACCOUNT 16 // with 8 probes about one false positive in 1700 lookups
+#define ID_FILTER_PROBES 8
+#define ORDER_PAGE_KEYS 256 // keys per leaf page of the balance and loan indexes
+#define LIST_PAGE_SIZE 50   // accounts per page of an ordered list
+#define DEFAULT_TOP_COUNT 10
+
+#define JOURNAL_MAGIC 0x4C4E524Au     // "JRNL"
+#define JOURNAL_MAX_ACCOUNTS 2         // after-images per journal record, larger operations span several records
+#define JOURNAL_CONTINUES 1u           // record flag: more records of the same operation follow
+#define JOURNAL_LEDGER 2u              // record flag: the record carries ledger entries instead of after-images
+#define JOURNAL_WRITE_CHUNK 256        // records gathered into one write() for multi-record operations
+#define JOURNAL_GROUP_COMMIT 64        // journal records written per fsync
+#define JOURNAL_CHECKPOINT_RECORDS 8192 // journal is folded into the record file after this many records
+#define IMPORT_CHUNK 4096         // imported accounts per journaled operation
+#define IMPORT_FIELDS 8           // columns of an exported row
+#define IMPORT_MAX_REPORTED 10    // rejected lines printed before the rest are only counted
+#define STANDING_ORDERS_MAGIC "BANKSORD"
+#define STANDING_ORDER_MAX_PERIOD 1000 // days or months
+#define LENGTH_OF_DATE 10              // "YYYY-MM-DD"
+#define SNAPSHOT_INTERVAL_RECORDS (1 << 16) // journal records kept before a new snapshot lets them go
+#define REPLAY_PARALLEL_MIN 4096        // after-images per replay thread
+
+#define LEDGER_MAGIC 0x3244474Cu        // "LGD2", entries with 64-bit money
+#define LEDGER_V3_MAGIC 0x5244474Cu     // "LGDR", entries with 32-bit whole units
+#define LEDGER_INDEX_MAGIC "BANKLIDX"
+#define LEDGER_INDEX_HEADER_SIZE 64
+#define LEDGER_INDEX_GROWTH (1 << 16)  // account heads the index file is grown by at once
+#define LEDGER_WRITE_CHUNK 256         // entries gathered into one write()
+#define LEDGER_DEPOSIT 1
+#define LEDGER_WITHDRAW 2
+#define LEDGER_TRANSFER_OUT 3
+#define LEDGER_TRANSFER_IN 4
+#define LEDGER_LOAN 5
+#define LEDGER_REPAYMENT 6
+#define LEDGER_INTEREST 7
+#define LEDGER_SETTLEMENT 8            // net change of the bank's sub-balances over a parallel batch
+#define LEDGER_OPEN 9                  // carries the opening balance and loan, so the balance before it is zero
+#define LEDGER_CLOSE 10
+#define LENGTH_OF_LEDGER_TIME 26       // "YYYY-MM-DD HH:MM:SS.uuuuuu"
+#define LENGTH_OF_LEDGER_OPERATION 12
+
+#define SERVER_MAX_CLIENTS 1024
+#define SERVER_EVENTS 64
+#define SERVER_INPUT_SIZE (1 << 16)         // request bytes buffered per connection
+#define SERVER_OUTPUT_HIGH_WATER (1 << 20)  // a client is not read while this much of its output is unsent
+#define SERVER_MAX_QUERY 64
+#define SERVER_OP_GET 1
+#define SERVER_OP_DEPOSIT 2
+#define SERVER_OP_WITHDRAW 3
+#define SERVER_OP_TRANSFER 4
+#define SERVER_OP_BORROW 5
+#define SERVER_OP_REPAY 6
+#define SERVER_OP_SEARCH 7
+#define SERVER_OK 0
+#define SERVER_REJECTED 1
+#define SERVER_NOT_FOUND 2
+#define SERVER_MALFORMED 3
+
+#define STATS_SUB_BITS 4             // histogram buckets per power of two: 2^STATS_SUB_BITS, about 6% resolution
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_PROBE_GET_ACCOUNT (N_OF_COMMANDS + 0)  // timed sections below command level
+#define STATS_PROBE_COMMIT (N_OF_COMMANDS + 1)
+#define STATS_PROBE_JOURNAL_FLUSH (N_OF_COMMANDS + 2)
+#define STATS_PROBE_VALIDATE (N_OF_COMMANDS + 3)
+#define N_OF_STATS_PROBES (N_OF_COMMANDS + 4)
+#define STATS_SAMPLE_MASK 15          // probes below command level time one call in 16 and only count the rest
+#define STATS_JOURNAL_WRITES 0
+#define STATS_JOURNAL_BYTES 1
+#define STATS_LEDGER_WRITES 2
+#define STATS_LEDGER_BYTES_WRITTEN 3
+#define STATS_LEDGER_READS 4
+#define STATS_LEDGER_BYTES_READ 5
+#define STATS_FSYNCS 6
+#define STATS_MSYNCS 7
+#define STATS_SLOT_READS 8
+#define STATS_SLOT_WRITES 9
+#define STATS_OUTPUT_WRITES 10
+#define STATS_OUTPUT_BYTES 11
+#define STATS_SOCKET_READS 12
+#define STATS_SOCKET_BYTES_IN 13
+#define STATS_SOCKET_SENDS 14
+#define STATS_SOCKET_BYTES_OUT 15
+#define N_OF_STATS_COUNTERS 16
+#define STATS_DEFAULT_DUMP_INTERVAL 10 // seconds between rewrites of STATS_FILE
+
+#define ACCOUNT_CACHE_DEFAULT_CAPACITY 4096
+#define ACCOUNT_CACHE_MAX_CAPACITY (1u << 24)
 
-#define MAX_COMMAND_LENGTH 64
-#define N_OF_COMMANDS 15
+#define MAX_BATCH_LINE_LENGTH 128
+#define WORKING_SET_MIN_BUCKETS 1024
+#define BATCH_CHUNK_LINES 1024   // lines handed to a worker at once, applied in file order
+#define BATCH_QUEUE_CHUNKS 64
+#define MAX_WORKER_THREADS 256
+#define LOCK_STRIPES 256         // account n is guarded by lock n % LOCK_STRIPES
+#define BANK_SHARDS 16           // sub-balances the root bank account is split into while workers run
+#define SWEEP_BLOCK 1024         // accounts gathered into column arrays at a time by the interest sweep
+
+#define BENCHMARK_MIN_ACCOUNTS 1000
+#define BENCHMARK_MAX_ACCOUNTS 100000000
+#define BENCHMARK_DEFAULT_ACCOUNTS 100000
+#define BENCHMARK_DEFAULT_OPS 100000
+#define BENCHMARK_SEARCH_SHARE 100 // each search option runs ops/BENCHMARK_SEARCH_SHARE queries
+#define BENCHMARK_HOT_ACCOUNTS 64   // origins of the hot-set transfer workload
+#define BENCHMARK_SWEEPS 3         // runs of the whole-book workloads (list, interest)
+#define BENCHMARK_ID_SPACE (1u << 27) // generated PESELs are a permutation of this many (birth day, serial) pairs
+
+#define N_OF_TEXT_INDEXES 3 // trigram_indexes, one per searchable identity field
+#define NAME_INDEX 0
+#define SURNAME_INDEX 1
+#define ADDRESS_INDEX 2
+
+#define MAX_COMMAND_LENGTH 96
+#define N_OF_COMMANDS 31
+
+#define N_OF_ORDER_INDEXES 2
+#define BALANCE_COLUMN 0
+#define LOAN_COLUMN 1
+#define REPORT_BUCKETS 17 // zero, under one unit, then one per decade of whole units up to MAX_ACCOUNT_VALUE
 
 const char* COMMANDS[] = {
         "list",
@@ -38,51 +207,760 @@ const char* COMMANDS[] = {
         "collect_interest",
         "help",
         "paste",
-        "populate"
+        "populate",
+        "format",
+        "verify",
+        "cache",
+        "history",
+        "balance_at",
+        "snapshot",
+        "stats",
+        "close",
+        "compact",
+        "report",
+        "top",
+        "import",
+        "export",
+        "dedupe_report",
+        "standing_order",
+        "run_due"
+};
+
+// command whose statistics a server op is counted under, indexed by SERVER_OP_*
+const int SERVER_OP_COMMANDS[] = {0, 8, 2, 3, 6, 4, 5, 7};
+const char* STATS_PROBE_NAMES[] = {"get_account", "commit_accounts", "journal_flush", "verify_account_validity"};
+const char* STATS_COUNTER_NAMES[] = {
+        "journal_writes", "journal_bytes", "ledger_writes", "ledger_bytes_written", "ledger_reads", "ledger_bytes_read",
+        "fsyncs", "msyncs", "slot_reads", "slot_writes", "output_writes", "output_bytes",
+        "socket_reads", "socket_bytes_in", "socket_sends", "socket_bytes_out"
+};
+
+const char* LEDGER_OPERATIONS[] = {
+        "", "deposit", "withdraw", "transfer out", "transfer in", "loan", "repayment", "interest", "settlement", "open", "close"
 };
 
+typedef int64_t money_t; // fixed point, MONEY_SCALE minor units to the unit
+typedef int64_t rate_t;  // fixed point, RATE_SCALE to 1 (a rate of 100%)
+
 typedef struct Account{
     uint32_t account_number; // specifications call for 'unlimited' number of accounts
     char name[LENGTH_OF_NAME+1];           // but just 2^32 records will not fit on any even remotely reasonable storage (as of 2024)
     char surname[LENGTH_OF_SURNAME+1];
     char address[LENGTH_OF_ADDRESS+1];
     char national_id[LENGTH_OF_NATIONAL_ID+1]; // PESEL
+    money_t curr_balance;
+    money_t loan_balance;
+    rate_t interest_rate;
+} acc_t;
+
+// account layout up to format v3 and in the original raw file: whole units in 32 bits and a double rate
+typedef struct AccountV3{
+    uint32_t account_number;
+    char name[LENGTH_OF_NAME+1];
+    char surname[LENGTH_OF_SURNAME+1];
+    char address[LENGTH_OF_ADDRESS+1];
+    char national_id[LENGTH_OF_NATIONAL_ID+1];
     int32_t curr_balance;
     int32_t loan_balance;
     double interest_rate;
-} acc_t;
+} acc_v3_t;
 
 
-#define MAX_DEPOSIT 100000
-#define MAX_WITHDRAW 10000
-#define MAX_BORROW 1000000
+#define MAX_DEPOSIT (100000 * (money_t)MONEY_SCALE)
+#define MAX_WITHDRAW (10000 * (money_t)MONEY_SCALE)
+#define MAX_BORROW (1000000 * (money_t)MONEY_SCALE)
 #define MAX_TRANSFER MAX_DEPOSIT
-#define MAX_ACCOUNT_VALUE (INT32_MAX - MAX_DEPOSIT)
-#define MAX_LOAN_VALUE (INT32_MAX - MAX_BORROW)
+#define MAX_ACCOUNT_VALUE (1000000000000000ll - 1) // the widest amount LENGTH_OF_BALANCE shows
+#define MAX_LOAN_VALUE MAX_ACCOUNT_VALUE
 
 const acc_t NULL_ACCOUNT = {0, "", "", "", "", 0, 0, 0};
-const acc_t ROOT_BANK_ACCOUNT = {1, "Bank", "Bank", "ul. Bankowa 1 00-001 Warszawa", "00000000000", INT32_MAX/2, 0, 0};
+const acc_t ROOT_BANK_ACCOUNT = {1, "Bank", "Bank", "ul. Bankowa 1 00-001 Warszawa", "00000000000", INT32_MAX/2 * (money_t)MONEY_SCALE, 0, 0};
 
 const acc_t PRESET_ACCOUNTS[] = {
-        1, "Jan", "Kowalski", "ul. Kowalska 1 00-001 Warszawa", "12345678901", 1000, 0, 0.1,
-        2, "Anna", "Nowak", "ul. Nowa 1 00-001 Warszawa", "12345678902", 2000, 0, 0.2,
-        3, "Piotr", "Kowalczyk", "ul. Kolczykowa 1 00-001 Warszawa", "12345678903", 3000, 0, 0.3,
-        4, "Agnieszka", "Kowalska", "ul. Kowalska 2 00-001 Warszawa", "12345678904", 4000, 0, 0.4,
-        5, "Janusz", "Nowak", "ul. Nowa 2 00-001 Warszawa", "12345678905", 5000, 0, 0.5,
-        6, "Krzysztof", "Kowalczyk", "ul. Kolczowa 2 00-001 Warszawa", "12345678906", 6000, 0, 0.6,
-        7, "Alicja", "Kowalska", "ul. Kowalska 3 00-001 Warszawa", "12345678907", 7000, 0, 0.7,
-        8, "Jan", "Nowak", "ul. Nowa 3 00-001 Warszawa", "12345678908", 8000, 0, 0.8,
-        9, "Anna", "Kowalczyk", "ul. Kowalkowa 3 00-001 Warszawa", "12345678909", 9000, 0, 0.9,
-        10, "Piotr", "Kowalski", "ul. Kowalska 4 00-001 Warszawa", "12345678910", 10000, 0, 0.1
+        1, "Jan", "Kowalski", "ul. Kowalska 1 00-001 Warszawa", "12345678901", 1000 * MONEY_SCALE, 0, 1 * RATE_SCALE / 10,
+        2, "Anna", "Nowak", "ul. Nowa 1 00-001 Warszawa", "12345678902", 2000 * MONEY_SCALE, 0, 2 * RATE_SCALE / 10,
+        3, "Piotr", "Kowalczyk", "ul. Kolczykowa 1 00-001 Warszawa", "12345678903", 3000 * MONEY_SCALE, 0, 3 * RATE_SCALE / 10,
+        4, "Agnieszka", "Kowalska", "ul. Kowalska 2 00-001 Warszawa", "12345678904", 4000 * MONEY_SCALE, 0, 4 * RATE_SCALE / 10,
+        5, "Janusz", "Nowak", "ul. Nowa 2 00-001 Warszawa", "12345678905", 5000 * MONEY_SCALE, 0, 5 * RATE_SCALE / 10,
+        6, "Krzysztof", "Kowalczyk", "ul. Kolczowa 2 00-001 Warszawa", "12345678906", 6000 * MONEY_SCALE, 0, 6 * RATE_SCALE / 10,
+        7, "Alicja", "Kowalska", "ul. Kowalska 3 00-001 Warszawa", "12345678907", 7000 * MONEY_SCALE, 0, 7 * RATE_SCALE / 10,
+        8, "Jan", "Nowak", "ul. Nowa 3 00-001 Warszawa", "12345678908", 8000 * MONEY_SCALE, 0, 8 * RATE_SCALE / 10,
+        9, "Anna", "Kowalczyk", "ul. Kowalkowa 3 00-001 Warszawa", "12345678909", 9000 * MONEY_SCALE, 0, 9 * RATE_SCALE / 10,
+        10, "Piotr", "Kowalski", "ul. Kowalska 4 00-001 Warszawa", "12345678910", 10000 * MONEY_SCALE, 0, 1 * RATE_SCALE / 10
 };
 
+// on-disk layout (format v4): a header page and checksum table, then blocks of STORE_BLOCK_SLOTS accounts;
+// each block holds the hot columns of all its accounts followed by their cold identity strings,
+// so balance-only scans never pull names and addresses into the cache
+typedef struct AccountHot{
+    uint32_t account_number;
+    uint32_t next_free;   // of a closed slot: the next slot on the free list, 0 at its end
+    money_t curr_balance;
+    money_t loan_balance;
+    rate_t interest_rate;
+} hot_t;
+
+typedef struct AccountHotV3{
+    uint32_t account_number;
+    int32_t curr_balance;
+    int32_t loan_balance;
+    uint32_t next_free;
+    double interest_rate;
+} hot_v3_t;
+
+typedef struct AccountCold{
+    char name[LENGTH_OF_NAME+1];
+    char surname[LENGTH_OF_SURNAME+1];
+    char address[LENGTH_OF_ADDRESS+1];
+    char national_id[LENGTH_OF_NATIONAL_ID+1];
+    char reserved;
+} cold_t;
+
+// running sums over every slot of the file; closed and empty slots hold nothing and add nothing
+typedef struct StoreTotals{
+    money_t balance;
+    money_t loans;
+    uint32_t n_of_accounts;  // open accounts, the bank included
+    uint32_t n_of_loans;     // open accounts with an outstanding loan
+} store_totals_t;
+
+typedef struct StoreHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_slots;
+    uint32_t n_of_slots;
+    uint32_t clean;       // set while every block checksum matches its block on disk
+    uint64_t journal_sequence; // first journaled operation the blocks may not hold yet
+    uint64_t journal_offset;   // where the journal stood at the last checkpoint
+    uint32_t free_head;        // first closed slot waiting for reuse, linked through hot_t.next_free
+    uint32_t n_of_free;
+    uint32_t totals_kept;      // totals have been maintained since the file was created or last recounted
+    uint32_t shard_blocks;     // blocks per shard file, 0 when every block is in the main file
+    store_totals_t totals;     // kept current by every slot write
+} store_header_t;
+
+#define STORE_BLOCK_SIZE (STORE_BLOCK_SLOTS * (sizeof(hot_t) + sizeof(cold_t)))
+
+typedef struct AccountStore{
+    int fd;
+    char* mapping;          // header page followed by n_of_blocks blocks, shard files mapped side by side
+    store_header_t* header;
+    uint32_t* checksums;    // per block, the sum of the slot hashes of its used slots
+    uint32_t n_of_slots;    // slots holding records, including NULL_ACCOUNT at slot 0 (mirrored in the header)
+    uint32_t n_of_blocks;   // blocks backed by the files, slots past n_of_slots are zeroed padding
+    const char* path;       // main file, shard n is "<path>.<n>"
+    uint32_t shard_blocks;  // mirrored from the header
+    bool checksums_trusted; // false after an unclean shutdown until every block has been rehashed
+    bool free_list_trusted; // false when the header's free list may have missed closes, rebuilt by a scan on next use
+    bool totals_trusted;    // false after an unclean shutdown, the totals are recounted on next use
+    uint64_t verified[STORE_MAX_BLOCKS / 64 + 1]; // blocks checked since the file was opened
+    uint64_t dirty_shards[STORE_MAX_SHARDS / 64 + 1]; // shards written since the last sync
+} store_t;
+
+typedef struct TrigramList{
+    uint32_t* accounts; // in the order they were listed, an account stays listed under its old value until the next build
+    uint32_t count;
+    uint32_t capacity;
+} trigram_list_t;
+
+// an identity field folded to lower-case ASCII, with each of its trigrams listing the accounts that have it
+typedef struct TrigramIndex{
+    size_t field_offset;
+    size_t field_length;
+    trigram_list_t* lists; // N_OF_TRIGRAMS of them, allocated by the first build
+} trigram_index_t;
+
+// per-account list counts of a candidate search, kept from one search to the next; a count only
+// holds for the search whose stamp is next to it, so nothing is cleared per query
+typedef struct TrigramCounts{
+    uint32_t* stamps;
+    uint8_t* counts;
+    uint32_t capacity;
+    uint32_t stamp;
+} trigram_counts_t;
+
+typedef struct NationalIdIndex{
+    uint32_t* buckets;   // first account of each hash chain, 0 (the null slot) ends a chain
+    uint32_t* next;      // next account in the same chain, indexed by account number
+    uint32_t n_of_buckets;
+    uint32_t next_capacity;
+    uint32_t count;
+} id_index_t;
+
+// Bloom filter over the national IDs in the file: a miss proves an ID is new without building
+// the search indexes, a hit is confirmed through id_index
+typedef struct NationalIdFilter{
+    uint64_t* bits;
+    uint64_t n_of_bits; // power of two, sized for twice the slots when built
+    uint32_t count;     // IDs added since built
+} id_filter_t;
+
+typedef struct OrderKey{
+    money_t value;
+    uint32_t account_number; // orders accounts with equal values
+} order_key_t;
+
+typedef struct OrderPage{
+    uint32_t count;
+    order_key_t keys[ORDER_PAGE_KEYS];
+} order_page_t;
+
+// two-level B+tree: sorted leaf pages under one array of page pointers in key order, so an update
+// moves at most one page of keys and a range is read by walking the pages in sequence
+typedef struct OrderIndex{
+    order_page_t** pages;
+    uint32_t n_of_pages;
+    uint32_t capacity;
+    uint32_t count;
+} order_index_t;
+
+// one balance change of one account; entries of an account are chained newest to oldest through
+// previous, and skip reaches back O(log n) entries at once (see ledger_skip_height)
+typedef struct LedgerEntry{
+    uint32_t magic;
+    uint32_t account_number;
+    uint64_t timestamp;      // microseconds since the epoch, never decreasing along the ledger
+    uint64_t previous;       // entry number + 1 of the account's previous entry, 0 for its first
+    uint64_t skip;           // entry number + 1 of the account's entry at ledger_skip_height(height)
+    uint32_t height;         // entries of the account before this one
+    uint32_t counterparty;   // other side of a transfer, the bank for loans and repayments
+    money_t balance_change;
+    money_t loan_change;
+    money_t curr_balance;    // after the operation
+    money_t loan_balance;
+    uint8_t operation;
+    uint8_t reserved[3];
+    uint32_t checksum;
+} ledger_entry_t;
+
+// an operation is journaled as its after-images followed by its ledger entries, so the ledger can be
+// completed on replay when the process died between the two writes
+typedef struct JournalRecord{
+    uint32_t magic;
+    uint32_t n_of_accounts;  // after-images, or ledger entries in a JOURNAL_LEDGER record
+    uint64_t sequence;
+    union {
+        acc_t accounts[JOURNAL_MAX_ACCOUNTS]; // after-images, replayed in order
+        struct {
+            uint64_t ledger_position; // entry number the first entry takes in the ledger
+            ledger_entry_t entries[JOURNAL_MAX_ACCOUNTS]; // stamped but not linked
+        };
+    };
+    uint32_t flags;
+    uint32_t checksum;
+} journal_record_t;
+
+typedef struct JournalRecordV3{
+    uint32_t magic;
+    uint32_t n_of_accounts;
+    uint64_t sequence;
+    acc_v3_t accounts[JOURNAL_MAX_ACCOUNTS];
+    uint32_t flags;
+    uint32_t checksum;
+} journal_record_v3_t;
+
+typedef struct Journal{
+    int fd;
+    uint64_t next_sequence;
+    uint64_t synced_sequence; // operations before it are on disk
+    uint32_t n_of_unsynced;  // records written but not yet fsynced
+    uint32_t n_of_records;   // records since the last checkpoint
+    uint32_t n_of_retained;  // records kept since the last snapshot, for recovery from it
+} journal_t;
+
+typedef struct Replay{
+    acc_t* images;           // after-images of the operations to redo, in journal order
+    uint32_t n_of_images;
+    uint32_t capacity;
+    ledger_entry_t* entries; // journaled ledger entries the ledger file does not hold, in ledger order
+    uint32_t n_of_entries;
+    uint32_t entries_capacity;
+    uint32_t n_of_operations;
+    uint64_t next_sequence;
+} replay_t;
+
+typedef struct ReplayWorker{
+    pthread_t thread;
+    const replay_t* replay;
+    uint32_t id;
+    uint32_t n_of_workers;   // worker id redoes the blocks whose number is id modulo n_of_workers
+} replay_worker_t;
+
+typedef struct LedgerEntryV3{
+    uint32_t magic;
+    uint32_t account_number;
+    uint64_t timestamp;
+    uint64_t previous;
+    uint64_t skip;
+    uint32_t height;
+    uint32_t counterparty;
+    int32_t balance_change;
+    int32_t loan_change;
+    int32_t curr_balance;
+    int32_t loan_balance;
+    uint8_t operation;
+    uint8_t reserved[3];
+    uint32_t checksum;
+} ledger_entry_v3_t;
+
+typedef struct LedgerIndexHeader{
+    char magic[8];
+    uint64_t n_of_entries;   // ledger entries the heads account for
+} ledger_index_header_t;
+
+typedef struct Ledger{
+    int fd;
+    int index_fd;
+    char* index_mapping;
+    ledger_index_header_t* header;
+    uint64_t* heads;         // per account, entry number + 1 of its latest entry
+    uint32_t n_of_heads;     // accounts the index file has room for
+    uint64_t n_of_entries;   // entries written to the ledger file
+    uint64_t last_timestamp;
+    uint32_t n_of_unsynced;
+    ledger_entry_t chunk[LEDGER_WRITE_CHUNK]; // linked entries not yet written, numbered from n_of_entries
+    uint32_t n_of_chunk;
+    ledger_entry_t* pending; // recorded during a batch, linked and written with its write-back
+    uint32_t n_of_pending;
+    uint32_t pending_capacity;
+    pthread_mutex_t lock;    // guards pending while batch workers run
+} ledger_t;
+
+typedef struct CacheEntry{
+    acc_t account;
+    uint64_t sequence;   // journaled operation that made the entry dirty
+    bool dirty;          // newer than the record file, already journaled
+    bool referenced;     // second chance bit for the CLOCK hand
+} cache_entry_t;
+
+typedef struct AccountCache{
+    uint32_t* buckets;   // open addressing on account number, value is position in entries + 1
+    cache_entry_t* entries;
+    uint32_t n_of_buckets;
+    uint32_t count;
+    uint32_t capacity;   // 0 turns the cache off
+    uint32_t hand;
+    uint64_t n_of_hits;
+    uint64_t n_of_misses;
+    uint64_t n_of_evictions;
+    uint64_t n_of_write_backs;
+} account_cache_t; // balance changes stay here until eviction, checkpoint or quit; identity changes write through
+
+typedef struct WorkingSet{
+    uint32_t* buckets;   // open addressing on account number, value is position in accounts + 1
+    acc_t* accounts;     // dirty accounts in first-touch order
+    uint32_t n_of_buckets;
+    uint32_t count;
+    uint32_t capacity;
+} working_set_t; // one per lock stripe, so a worker holding an account's lock owns its partition
+
+typedef struct BankShard{
+    _Alignas(64) pthread_mutex_t lock; // one cache line per shard
+    money_t balance;
+} bank_shard_t;
+
+typedef struct BatchChunk{
+    uint32_t n_of_lines;
+    unsigned long line_numbers[BATCH_CHUNK_LINES];
+    char lines[BATCH_CHUNK_LINES][MAX_BATCH_LINE_LENGTH];
+} batch_chunk_t;
+
+typedef struct BatchQueue{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    batch_chunk_t* chunks[BATCH_QUEUE_CHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool closed;
+} batch_queue_t;
+
+typedef struct BatchWorker{
+    pthread_t thread;
+    uint32_t id;
+    unsigned long n_of_applied;
+    unsigned long n_of_rejected;
+} batch_worker_t;
+
+typedef struct InterestSweep{
+    pthread_t thread;
+    uint32_t first_slot;
+    uint32_t end_slot;
+    acc_t* charged;            // after-images of accounts whose loan grew, in slot order
+    uint32_t n_of_charged;
+    uint32_t n_of_capped;      // accounts left unchanged because the interest would pass MAX_LOAN_VALUE
+    money_t interest_total;
+    int error;
+} interest_sweep_t;
+
+typedef struct ReportScan{
+    pthread_t thread;
+    uint32_t first_slot;
+    uint32_t end_slot;
+    int column;                // BALANCE_COLUMN or LOAN_COLUMN
+    money_t min;               // accounts whose column lies in [min, max] are aggregated
+    money_t max;
+    uint32_t count;
+    money_t sum;
+    money_t smallest;
+    money_t largest;
+    uint32_t histogram[REPORT_BUCKETS];
+} report_scan_t;
+
+typedef struct ServerRequest{
+    uint32_t id;            // echoed in the response, pipelined requests are answered in order
+    uint8_t op;
+    uint8_t search_option;
+    uint16_t query_length;  // search query bytes following the request
+    uint32_t account;
+    uint32_t other_account; // transfer destination
+    money_t value;          // minor units
+} server_request_t;
+
+typedef struct ServerResponse{
+    uint32_t id;
+    uint32_t n_of_accounts; // acc_t records following the response
+    uint8_t status;
+    uint8_t reserved[3];
+} server_response_t;
+
+typedef struct ServerClient{
+    int fd;
+    uint32_t slot;          // position in server_clients
+    uint32_t events;        // events registered with epoll
+    bool closing;
+    char* input;            // SERVER_INPUT_SIZE bytes, a partial request stays at the front
+    size_t input_length;
+    char* output;
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+} server_client_t;
+
+// log-linear latency histogram in nanoseconds; updated with relaxed atomics so batch workers can share it
+typedef struct LatencyHistogram{
+    uint64_t count;
+    uint64_t n_of_samples;             // calls that were timed, the buckets add up to this
+    uint64_t n_of_errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} latency_histogram_t;
+
+typedef struct OutputBuffer{
+    char data[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    int fd;      // the terminal, or the file of an export
+    bool failed; // a write to fd failed since this was last cleared
+} output_buffer_t;
+
+typedef struct ImportId{
+    char national_id[LENGTH_OF_NATIONAL_ID+1];
+    uint32_t line;
+} import_id_t;
+
+typedef struct CsvField{
+    const char* start; // inside the mapped input, quotes left in place
+    size_t length;
+} csv_field_t;
+
+typedef struct StandingOrder{
+    uint32_t id;
+    uint32_t source;
+    uint32_t destination;
+    int32_t next_due;      // days since 1970-01-01
+    money_t amount;
+    uint16_t period;       // days or months between payments
+    char period_unit;      // 'd' or 'm'
+    uint8_t day_of_month;  // of the first payment, monthly orders return to it after shorter months
+    uint8_t cancelled;     // kept until the file is next rewritten
+    uint8_t reserved[3];
+    // national IDs of the two customers when the order was made, a number handed on since is not paid
+    char source_id[LENGTH_OF_NATIONAL_ID];
+    char destination_id[LENGTH_OF_NATIONAL_ID];
+} standing_order_t;
+
+typedef struct StandingOrdersHeader{
+    char magic[8];
+    uint32_t n_of_orders;
+    uint32_t next_id;
+    // in the new file of a run, the first ledger entry its write-back appends: where it goes, its stamp
+    // (0 when the run paid nothing) and its two sides
+    uint64_t ledger_position;
+    uint64_t ledger_timestamp;
+    uint32_t ledger_account;
+    uint32_t ledger_counterparty;
+} standing_orders_header_t;
+
+// the orders file is read whole on first use; additions and cancellations are written in place,
+// a run rewrites it without the cancelled orders
+typedef struct StandingOrders{
+    int fd;                         // -1 until loaded
+    standing_orders_header_t header;
+    standing_order_t* orders;       // in id order
+    uint32_t* heap;                 // positions in orders, earliest due first and ties by id
+    uint32_t n_of_heap;
+    uint32_t capacity;
+} standing_orders_t;
+
 bool REQUIRE_CONFIRMATION_ON_EDIT = true;
+bool REPORT_SUCCESS = true;
 int global_view_mode = FULL_VIEW;
+int global_output_format = TABLE_OUTPUT;
+output_buffer_t output_buffer = {{0}, 0, STDOUT_FILENO, false};
 uint32_t number_of_accounts = 0;
+store_t store = {-1, NULL, NULL, NULL, 0, 0, NULL, 0, false, false, false, {0}, {0}};
+bool indexes_built = false; // search indexes are built on first use, not at startup
+trigram_index_t trigram_indexes[N_OF_TEXT_INDEXES] = {
+        {offsetof(cold_t, name), LENGTH_OF_NAME, NULL},
+        {offsetof(cold_t, surname), LENGTH_OF_SURNAME, NULL},
+        {offsetof(cold_t, address), LENGTH_OF_ADDRESS, NULL}
+};
+trigram_counts_t trigram_counts = {NULL, NULL, 0, 0};
+uint32_t n_of_stale_accounts = 0; // accounts the trigram lists still hold under a value they no longer have
+id_index_t id_index = {NULL, NULL, 0, 0, 0};
+id_filter_t id_filter = {NULL, 0, 0}; // built on the first add or import
+standing_orders_t standing_orders = {-1, {{0}, 0, 0, 0, 0, 0, 0}, NULL, NULL, 0, 0};
+bool order_indexes_built = false; // balance and loan orders are built on first use like the search indexes
+order_index_t order_indexes[N_OF_ORDER_INDEXES] = {{NULL, 0, 0, 0}, {NULL, 0, 0, 0}};
+journal_t journal = {-1, 0, 0, 0, 0, 0};
+bool journal_group_commit = false; // set by the server: a commit leaves the fsync to the journal_flush ending its round
+pid_t snapshot_pid = 0; // child writing the snapshot in progress
+ledger_t ledger = {-1, -1, NULL, NULL, NULL, 0, 0, 0, 0, {{0}}, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+account_cache_t account_cache = {NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+bool working_set_active = false; // while set, account reads and commits stay in memory until write-back
+working_set_t working_sets[LOCK_STRIPES];
+bool engine_running = false;
+bool bank_sharded = false;
+money_t bank_opening_balance = 0; // bank balance when the shards were spread, for the batch's settlement entry
+pthread_mutex_t account_locks[LOCK_STRIPES];
+bank_shard_t bank_shards[BANK_SHARDS];
+batch_queue_t batch_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, {NULL}, 0, 0, false};
+__thread uint32_t worker_id = 0;
+server_client_t* server_clients[SERVER_MAX_CLIENTS];
+latency_histogram_t stats_histograms[N_OF_STATS_PROBES];
+uint64_t stats_counters[N_OF_STATS_COUNTERS];
+uint64_t stats_started_ns = 0;        // when the counters were last reset
+uint64_t stats_dumped_ns = 0;
+uint32_t stats_dump_interval = STATS_DEFAULT_DUMP_INTERVAL; // 0 disables the dump file
+__thread uint32_t stats_tick = 0;
+volatile sig_atomic_t server_stopping = 0;
+
+uint64_t stats_clock(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// start time for a sampled probe, 0 when this call is only counted
+uint64_t stats_sample(){
+    return (++stats_tick & STATS_SAMPLE_MASK) == 0 ? stats_clock() : 0;
+}
+
+void stats_count(uint32_t counter, uint64_t value){
+    __atomic_fetch_add(&stats_counters[counter], value, __ATOMIC_RELAXED);
+}
+
+// values below 2^STATS_SUB_BITS get a bucket each, every power of two above is split into 2^STATS_SUB_BITS
+uint32_t stats_bucket(uint64_t value){
+    if (value < (1u << STATS_SUB_BITS))
+        return value;
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t sub_bucket = (value >> (exponent - STATS_SUB_BITS)) - (1u << STATS_SUB_BITS);
+    return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub_bucket;
+}
+
+// largest value that falls into the bucket
+uint64_t stats_bucket_limit(uint32_t bucket){
+    if (bucket < (1u << STATS_SUB_BITS))
+        return bucket;
+    uint32_t exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub_bucket = bucket & ((1u << STATS_SUB_BITS) - 1);
+    return (((1ull << STATS_SUB_BITS) + sub_bucket + 1) << (exponent - STATS_SUB_BITS)) - 1;
+}
+
+void stats_record(uint32_t probe, uint64_t started_ns, int result){
+    latency_histogram_t* histogram = &stats_histograms[probe];
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    if (result != 0)
+        __atomic_fetch_add(&histogram->n_of_errors, 1, __ATOMIC_RELAXED);
+    if (started_ns == 0)
+        return;
+    uint64_t elapsed = stats_clock() - started_ns;
+    __atomic_fetch_add(&histogram->n_of_samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[stats_bucket(elapsed)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, elapsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// upper bound of the quantile, never above the largest value seen
+uint64_t stats_quantile(const latency_histogram_t* histogram, double quantile){
+    uint64_t rank = (uint64_t)(quantile * histogram->n_of_samples + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (uint32_t i = 0; i < STATS_BUCKETS; i++){
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return stats_bucket_limit(i) < histogram->max_ns ? stats_bucket_limit(i) : histogram->max_ns;
+    }
+    return histogram->max_ns;
+}
+
+const char* stats_probe_name(uint32_t probe){
+    return probe < N_OF_COMMANDS ? COMMANDS[probe] : STATS_PROBE_NAMES[probe - N_OF_COMMANDS];
+}
+
+void stats_reset(){
+    memset(stats_histograms, 0, sizeof(stats_histograms));
+    memset(stats_counters, 0, sizeof(stats_counters));
+    stats_started_ns = stats_clock();
+}
+
+void print_stats(){
+    printf("Statistics over %.1f s\n", (stats_clock() - stats_started_ns) / 1e9);
+    printf("%-24s %10s %8s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "errors", "mean us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (uint32_t i = 0; i < N_OF_STATS_PROBES; i++){
+        const latency_histogram_t* histogram = &stats_histograms[i];
+        if (histogram->n_of_samples == 0)
+            continue;
+        printf("%-24s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", stats_probe_name(i),
+               (unsigned long long)histogram->count, (unsigned long long)histogram->n_of_errors,
+               histogram->total_ns / 1e3 / histogram->n_of_samples, stats_quantile(histogram, 0.5) / 1e3,
+               stats_quantile(histogram, 0.9) / 1e3, stats_quantile(histogram, 0.99) / 1e3,
+               stats_quantile(histogram, 0.999) / 1e3, histogram->max_ns / 1e3);
+    }
+    for (uint32_t i = 0; i < N_OF_STATS_COUNTERS; i++)
+        printf("%-24s %10llu\n", STATS_COUNTER_NAMES[i], (unsigned long long)stats_counters[i]);
+}
+
+// rewrites STATS_FILE as one JSON object; written aside and renamed so readers never see half of it
+int stats_dump(){
+    if (stats_dump_interval == 0)
+        return 0;
+    stats_dumped_ns = stats_clock();
+    FILE* file = fopen(STATS_FILE ".tmp", "w");
+    if (file == NULL){
+        printf("Error writing statistics\n");
+        return 1;
+    }
+    fprintf(file, "{\"time\":%lld,\"seconds\":%.3f,\"operations\":{", (long long)time(NULL), (stats_dumped_ns - stats_started_ns) / 1e9);
+    bool first = true;
+    for (uint32_t i = 0; i < N_OF_STATS_PROBES; i++){
+        const latency_histogram_t* histogram = &stats_histograms[i];
+        if (histogram->n_of_samples == 0)
+            continue;
+        fprintf(file, "%s\"%s\":{\"count\":%llu,\"samples\":%llu,\"errors\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+                      "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}", first ? "" : ",", stats_probe_name(i),
+                (unsigned long long)histogram->count, (unsigned long long)histogram->n_of_samples,
+                (unsigned long long)histogram->n_of_errors, (unsigned long long)(histogram->total_ns / histogram->n_of_samples),
+                (unsigned long long)stats_quantile(histogram, 0.5), (unsigned long long)stats_quantile(histogram, 0.9),
+                (unsigned long long)stats_quantile(histogram, 0.99), (unsigned long long)stats_quantile(histogram, 0.999),
+                (unsigned long long)histogram->max_ns);
+        first = false;
+    }
+    fprintf(file, "},\"io\":{");
+    for (uint32_t i = 0; i < N_OF_STATS_COUNTERS; i++)
+        fprintf(file, "%s\"%s\":%llu", i == 0 ? "" : ",", STATS_COUNTER_NAMES[i], (unsigned long long)stats_counters[i]);
+    fprintf(file, "}}\n");
+    if (fclose(file) != 0 || rename(STATS_FILE ".tmp", STATS_FILE) != 0){
+        printf("Error writing statistics\n");
+        return 1;
+    }
+    return 0;
+}
+
+// called between operations, there is no timer thread
+void stats_maybe_dump(){
+    if (stats_dump_interval != 0 && stats_clock() - stats_dumped_ns >= (uint64_t)stats_dump_interval * 1000000000)
+        stats_dump();
+}
+
+// checked money arithmetic: each returns 0 and the result, or 1 when it overflows or leaves the allowed range;
+// the conditions are or-ed rather than short-circuited so the hot loops stay free of extra branches
+int money_add(money_t a, money_t b, money_t limit, money_t* sum){
+    bool overflow = __builtin_add_overflow(a, b, sum);
+    return overflow | (*sum < 0) | (*sum > limit);
+}
+
+int money_sub(money_t a, money_t b, money_t* difference){
+    bool overflow = __builtin_sub_overflow(a, b, difference);
+    return overflow | (*difference < 0);
+}
+
+// amount * rate / RATE_SCALE truncated towards zero, split at RATE_SCALE so no 128-bit product is needed
+int money_mul_rate(money_t amount, rate_t rate, money_t* product){
+    money_t whole, fraction;
+    bool overflow = __builtin_mul_overflow(amount / RATE_SCALE, rate, &whole);
+    overflow |= __builtin_mul_overflow(amount % RATE_SCALE, rate, &fraction);
+    overflow |= __builtin_add_overflow(whole, fraction / RATE_SCALE, product);
+    return overflow;
+}
+
+// "-123.45", returns the length
+int format_money(money_t value, char* text){
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    return sprintf(text, "%s%llu.%0*llu", value < 0 ? "-" : "", (unsigned long long)(magnitude / MONEY_SCALE),
+                   MONEY_DECIMALS, (unsigned long long)(magnitude % MONEY_SCALE));
+}
+
+// "0.1000000", returns the length
+int format_rate(rate_t rate, char* text){
+    uint64_t magnitude = rate < 0 ? -(uint64_t)rate : (uint64_t)rate;
+    return sprintf(text, "%s%llu.%0*llu", rate < 0 ? "-" : "", (unsigned long long)(magnitude / RATE_SCALE),
+                   LENGTH_OF_INTEREST_RATE, (unsigned long long)(magnitude % RATE_SCALE));
+}
+
+// a decimal number with at most `decimals` fractional digits into an integer scaled by 10^decimals;
+// leading blanks and a sign are accepted like strtol, *end is left after the last digit
+int parse_fixed(const char* text, int decimals, int64_t* value, char** end){
+    const char* cursor = text;
+    while (*cursor == ' ' || *cursor == '\t')
+        cursor++;
+    bool negative = *cursor == '-';
+    if (*cursor == '-' || *cursor == '+')
+        cursor++;
+    int64_t result = 0;
+    int n_of_digits = 0;
+    bool overflow = false;
+    while (*cursor >= '0' && *cursor <= '9'){
+        overflow |= __builtin_mul_overflow(result, 10, &result);
+        overflow |= __builtin_add_overflow(result, *cursor++ - '0', &result);
+        n_of_digits++;
+    }
+    int n_of_decimals = 0;
+    if (*cursor == '.'){
+        cursor++;
+        while (*cursor >= '0' && *cursor <= '9'){
+            if (++n_of_decimals > decimals)
+                return 1;
+            overflow |= __builtin_mul_overflow(result, 10, &result);
+            overflow |= __builtin_add_overflow(result, *cursor++ - '0', &result);
+            n_of_digits++;
+        }
+    }
+    for (; n_of_decimals < decimals; n_of_decimals++)
+        overflow |= __builtin_mul_overflow(result, 10, &result);
+    if (n_of_digits == 0 || overflow)
+        return 1;
+    *value = negative ? -result : result;
+    if (end != NULL)
+        *end = (char*)cursor;
+    return 0;
+}
+
+int parse_money(const char* text, money_t* value, char** end){
+    return parse_fixed(text, MONEY_DECIMALS, value, end);
+}
+
+int parse_rate(const char* text, rate_t* rate, char** end){
+    return parse_fixed(text, LENGTH_OF_INTEREST_RATE, rate, end);
+}
 
 void print_help(){
     printf("Available commands:\n");
-    printf("list <view_mode> - list all accounts 0-full_view 1-short_view\n");
+    printf("list <view_mode> [balance|loan [page]] - list all accounts 0-full_view 1-short_view, or one page ordered by a column\n");
     printf("add - add new account\n");
     printf("deposit <account_number> <value> - deposit money to account\n");
     printf("withdraw <account_number> <value> - withdraw money from account\n");
@@ -90,10 +968,29 @@ void print_help(){
     printf("repay <account_number> <value> - repay loan\n");
     printf("transfer <origin_account_number> <dest_account_number2> <amount>\n");
     printf("search <search option> <searched value>- search for account\n");
+    printf("search <balance|loan> <min> <max> - accounts with the column in a range, in ascending order\n");
     printf("get <account_number> - get account info\n");
     printf("quit - exit program\n");
     printf("reset_file - reset file to initial state\n");
-    printf("collect_interest <account_number> - collect interest on loan\n");
+    printf("collect_interest <account_number|all> - collect interest on loan\n");
+    printf("format <table|csv|json> - output format of list and search\n");
+    printf("verify - check every block of the record file against its checksum\n");
+    printf("cache [capacity] - show account cache counters, or resize it\n");
+    printf("history <account_number> [from] [to] - ledger entries of an account, times as YYYY-MM-DD[THH:MM:SS]\n");
+    printf("balance_at <account_number> <time> - balance and loan of an account at a past time\n");
+    printf("snapshot - copy the record file in the background for --recover\n");
+    printf("stats [reset] - operation counts, latency percentiles and I/O counters since start or reset\n");
+    printf("close <account_number> - close an empty account, its number is given to the next account added\n");
+    printf("compact - release closed accounts at the end of the file and rebuild the free list and indexes\n");
+    printf("report [balance|loan] [min] [max] - customer totals, or count, sum, min, max and histogram of a column in a range\n");
+    printf("top <balance|loan> [n] - the n accounts with the largest values of a column, 10 by default\n");
+    printf("import <file> - append the accounts of a csv file in the export layout, numbers are assigned anew; a write error part-way keeps the accounts written before it\n");
+    printf("export <file> - write every open account to a csv file\n");
+    printf("dedupe_report - accounts whose national ID another open account also has\n");
+    printf("standing_order add <from> <to> <amount> <period> <first date> - pay the amount every period (7d, 2w, 1m), from the date on\n");
+    printf("standing_order cancel <order> - stop a standing order\n");
+    printf("standing_order list [account] - standing orders, of one account when given\n");
+    printf("run_due [date] - pay every standing order due by the date, today by default, as one batch\n");
     printf("help - display this message\n");
 }
 
@@ -104,6 +1001,8 @@ void print_search_help(){
     printf("3 - search by surname\n");
     printf("4 - search by address\n");
     printf("5 - search by national ID\n");
+    printf("Names, surnames and addresses are matched from their start ignoring case and Polish letters,\n");
+    printf("longer queries also find values a typo or two away; the closest matches are listed first\n");
 }
 
 void print_welcome_screen() {
@@ -139,40 +1038,217 @@ void print_table_header(int view_mode){
            LENGTH_OF_SURNAME/view_mode, LENGTH_OF_SURNAME/view_mode, "-----------------",
            LENGTH_OF_ADDRESS/view_mode, LENGTH_OF_ADDRESS/view_mode, "------------------------------------------------",
            LENGTH_OF_NATIONAL_ID/view_mode, LENGTH_OF_NATIONAL_ID/view_mode, "-----------",
-           LENGTH_OF_BALANCE, LENGTH_OF_BALANCE, "-----------",
-           LENGTH_OF_LOAN_BALANCE, LENGTH_OF_LOAN_BALANCE, "-----------",
+           LENGTH_OF_BALANCE, LENGTH_OF_BALANCE, "----------------",
+           LENGTH_OF_LOAN_BALANCE, LENGTH_OF_LOAN_BALANCE, "----------------",
            LENGTH_OF_INTEREST_RATE, LENGTH_OF_INTEREST_RATE+2, "-----------");
 }
 
 void print_account_as_table(acc_t account, int view_mode){
-    printf("| %0*.*u | %-*.*s | %-*.*s | %-*.*s | %-*.*s | %-*.d | %-*.d | %0.*f |\n",
+    char balance[LENGTH_OF_MONEY_TEXT] = "", loan_balance[LENGTH_OF_MONEY_TEXT] = "", interest_rate[LENGTH_OF_MONEY_TEXT];
+    if (account.curr_balance != 0) // zero amounts are left blank in tables
+        format_money(account.curr_balance, balance);
+    if (account.loan_balance != 0)
+        format_money(account.loan_balance, loan_balance);
+    format_rate(account.interest_rate, interest_rate);
+    printf("| %0*.*u | %-*.*s | %-*.*s | %-*.*s | %-*.*s | %-*s | %-*s | %s |\n",
            LENGTH_OF_ACCOUNT_NUMBER/view_mode, LENGTH_OF_ACCOUNT_NUMBER/view_mode, account.account_number,
            LENGTH_OF_NAME/view_mode, LENGTH_OF_NAME/view_mode, account.name,
            LENGTH_OF_SURNAME/view_mode, LENGTH_OF_SURNAME/view_mode, account.surname,
            LENGTH_OF_ADDRESS/view_mode, LENGTH_OF_ADDRESS/view_mode, account.address,
            LENGTH_OF_NATIONAL_ID/view_mode, LENGTH_OF_NATIONAL_ID/view_mode, account.national_id,
-           LENGTH_OF_BALANCE, account.curr_balance,
-           LENGTH_OF_LOAN_BALANCE, account.loan_balance,
-           LENGTH_OF_INTEREST_RATE, account.interest_rate);
+           LENGTH_OF_BALANCE, balance,
+           LENGTH_OF_LOAN_BALANCE, loan_balance,
+           interest_rate);
 }
 
-int read_all_records(int view_mode){
-    if(view_mode != FULL_VIEW && view_mode != SHORT_VIEW){
-        printf("Invalid view mode\n");
-        return 1;
+// list and search output is rendered by hand into output_buffer and written out in large chunks;
+// the table format matches print_account_as_table byte for byte
+void output_flush(){
+    size_t written = 0;
+    while (written < output_buffer.length){
+        ssize_t n = write(output_buffer.fd, output_buffer.data + written, output_buffer.length - written);
+        if (n <= 0){
+            output_buffer.failed = true;
+            break;
+        }
+        written += n;
+        stats_count(STATS_OUTPUT_WRITES, 1);
+        stats_count(STATS_OUTPUT_BYTES, n);
     }
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
-        printf("Error opening file\n");
-        return 1;
+    output_buffer.length = 0;
+}
+
+void output_char(char c){
+    output_buffer.data[output_buffer.length++] = c;
+}
+
+void output_chars(char c, int count){
+    for (int i = 0; i < count; i++)
+        output_char(c);
+}
+
+void output_string(const char* string, size_t length){
+    memcpy(output_buffer.data + output_buffer.length, string, length);
+    output_buffer.length += length;
+}
+
+// %-<width>.<precision>s
+void output_padded_string(const char* string, int width, int precision){
+    size_t length = strnlen(string, precision);
+    output_string(string, length);
+    output_chars(' ', width - (int)length);
+}
+
+// digits of value, at least min_digits of them; a zero with min_digits 0 renders as nothing (like printf's "%.0d")
+int format_uint(char* digits, uint64_t value, int min_digits){
+    char reversed[24];
+    int n = 0;
+    while (value != 0){
+        reversed[n++] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while (n < min_digits)
+        reversed[n++] = '0';
+    for (int i = 0; i < n; i++)
+        digits[i] = reversed[n - 1 - i];
+    return n;
+}
+
+void output_int(int64_t value, int min_digits, int width){
+    char digits[24];
+    int n = 0;
+    if (value < 0){
+        digits[n++] = '-';
+        n += format_uint(digits + n, -(uint64_t)value, min_digits);
+    } else {
+        n = format_uint(digits, value, min_digits);
     }
-    acc_t acc;
-    print_table_header(view_mode);
-    while (fread(&acc, sizeof(acc_t), 1, file)){
-        print_account_as_table(acc, view_mode);
+    output_string(digits, n);
+    output_chars(' ', width - n);
+}
+
+// fixed point value with `decimals` digits after the point, padded to width; a zero renders as nothing
+// when blank_zero is set, as amounts do in tables
+void output_fixed(int64_t value, uint64_t scale, int decimals, bool blank_zero, int width){
+    char digits[32];
+    int n = 0;
+    if (value != 0 || !blank_zero){
+        uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+        if (value < 0)
+            digits[n++] = '-';
+        n += format_uint(digits + n, magnitude / scale, 1);
+        digits[n++] = '.';
+        n += format_uint(digits + n, magnitude % scale, decimals);
+    }
+    output_string(digits, n);
+    output_chars(' ', width - n);
+}
+
+void output_money(money_t value, bool blank_zero, int width){
+    output_fixed(value, MONEY_SCALE, MONEY_DECIMALS, blank_zero, width);
+}
+
+void output_rate(rate_t rate){
+    output_fixed(rate, RATE_SCALE, LENGTH_OF_INTEREST_RATE, false, 0);
+}
+
+void output_csv_string(const char* string, size_t max_length){
+    size_t length = strnlen(string, max_length);
+    if (strcspn(string, ",\"\r\n") >= length){
+        output_string(string, length);
+        return;
+    }
+    output_char('"');
+    for (size_t i = 0; i < length; i++){
+        if (string[i] == '"')
+            output_char('"');
+        output_char(string[i]);
+    }
+    output_char('"');
+}
+
+void output_json_string(const char* string, size_t max_length){
+    static const char hex[] = "0123456789abcdef";
+    size_t length = strnlen(string, max_length);
+    output_char('"');
+    for (size_t i = 0; i < length; i++){
+        unsigned char c = string[i];
+        if (c == '"' || c == '\\'){
+            output_char('\\');
+            output_char(c);
+        } else if (c < 0x20){
+            output_string("\\u00", 4);
+            output_char(hex[c >> 4]);
+            output_char(hex[c & 0xF]);
+        } else {
+            output_char(c);
+        }
+    }
+    output_char('"');
+}
+
+void render_csv_header(){
+    static const char header[] = "account_number,name,surname,address,national_id,balance,loan_balance,interest_rate\n";
+    output_string(header, sizeof(header) - 1);
+}
+
+void render_account(const acc_t* account, int view_mode, int format){
+    if (output_buffer.length + MAX_RENDERED_ROW > OUTPUT_BUFFER_SIZE)
+        output_flush();
+    if (format == CSV_OUTPUT){
+        output_int(account->account_number, 1, 0);
+        output_char(',');
+        output_csv_string(account->name, LENGTH_OF_NAME);
+        output_char(',');
+        output_csv_string(account->surname, LENGTH_OF_SURNAME);
+        output_char(',');
+        output_csv_string(account->address, LENGTH_OF_ADDRESS);
+        output_char(',');
+        output_csv_string(account->national_id, LENGTH_OF_NATIONAL_ID);
+        output_char(',');
+        output_money(account->curr_balance, false, 0);
+        output_char(',');
+        output_money(account->loan_balance, false, 0);
+        output_char(',');
+        output_rate(account->interest_rate);
+        output_char('\n');
+    } else if (format == JSON_OUTPUT){
+        output_string("{\"account_number\":", 18);
+        output_int(account->account_number, 1, 0);
+        output_string(",\"name\":", 8);
+        output_json_string(account->name, LENGTH_OF_NAME);
+        output_string(",\"surname\":", 11);
+        output_json_string(account->surname, LENGTH_OF_SURNAME);
+        output_string(",\"address\":", 11);
+        output_json_string(account->address, LENGTH_OF_ADDRESS);
+        output_string(",\"national_id\":", 15);
+        output_json_string(account->national_id, LENGTH_OF_NATIONAL_ID);
+        output_string(",\"balance\":", 11);
+        output_money(account->curr_balance, false, 0);
+        output_string(",\"loan_balance\":", 16);
+        output_money(account->loan_balance, false, 0);
+        output_string(",\"interest_rate\":", 17);
+        output_rate(account->interest_rate);
+        output_string("}\n", 2);
+    } else {
+        output_string("| ", 2);
+        output_int(account->account_number, LENGTH_OF_ACCOUNT_NUMBER/view_mode, 0);
+        output_string(" | ", 3);
+        output_padded_string(account->name, LENGTH_OF_NAME/view_mode, LENGTH_OF_NAME/view_mode);
+        output_string(" | ", 3);
+        output_padded_string(account->surname, LENGTH_OF_SURNAME/view_mode, LENGTH_OF_SURNAME/view_mode);
+        output_string(" | ", 3);
+        output_padded_string(account->address, LENGTH_OF_ADDRESS/view_mode, LENGTH_OF_ADDRESS/view_mode);
+        output_string(" | ", 3);
+        output_padded_string(account->national_id, LENGTH_OF_NATIONAL_ID/view_mode, LENGTH_OF_NATIONAL_ID/view_mode);
+        output_string(" | ", 3);
+        output_money(account->curr_balance, true, LENGTH_OF_BALANCE);
+        output_string(" | ", 3);
+        output_money(account->loan_balance, true, LENGTH_OF_LOAN_BALANCE);
+        output_string(" | ", 3);
+        output_rate(account->interest_rate);
+        output_string(" |\n", 3);
     }
-    fclose(file);
-    return 0;
 }
 
 int is_account_null(acc_t account) {
@@ -188,310 +1264,4915 @@ int is_account_null(acc_t account) {
     return false;
 }
 
-int verify_account_validity(acc_t account){
-    if (account.account_number == NULL_ACCOUNT.account_number)
+// a closed account keeps its number and slot but loses its identity; open ones always carry a national ID
+bool is_account_closed(const acc_t* account){
+    return account->account_number != NULL_ACCOUNT.account_number && account->national_id[0] == '\0';
+}
+
+int check_account_fields(const acc_t* account){
+    if (account->account_number == NULL_ACCOUNT.account_number)
         return 1;
-    if (account.curr_balance < 0 || account.curr_balance > MAX_ACCOUNT_VALUE)
+    if (account->curr_balance < 0 || account->curr_balance > MAX_ACCOUNT_VALUE)
         return 2;
-    if (account.loan_balance < 0 || account.loan_balance > MAX_LOAN_VALUE)
+    if (account->loan_balance < 0 || account->loan_balance > MAX_LOAN_VALUE)
         return 3;
-    if (account.interest_rate < 0 || account.interest_rate > 1)
+    if (account->interest_rate < 0 || account->interest_rate > RATE_SCALE)
         return 4;
     for (int i = 0; i < LENGTH_OF_NATIONAL_ID; i++){
-        if (account.national_id[i] < '0' || account.national_id[i] > '9')
+        if (account->national_id[i] < '0' || account->national_id[i] > '9')
             return 5;
     }
     return 0;
 }
 
-int get_confirmation(){
-    char confirmation;
-    printf("Are you sure you want to make changes to the record file? (y/n)\n");
-    scanf("%c", &confirmation);
-    while (getchar() != '\n');
-    if (confirmation == 'y')
-        return true;
-    else
-        return false;
+int verify_account_validity(acc_t account){
+    uint64_t started = stats_sample();
+    int result = check_account_fields(&account);
+    stats_record(STATS_PROBE_VALIDATE, started, result);
+    return result;
 }
 
-int reset_file() {
-    printf("resetting file\n");
-    if(get_confirmation() == false)
+void store_unmap(){
+    if (store.mapping != NULL)
+        munmap(store.mapping, STORE_HEADER_SIZE + (size_t)store.n_of_blocks * STORE_BLOCK_SIZE);
+    store.mapping = NULL;
+    store.header = NULL;
+    store.checksums = NULL;
+    store.n_of_blocks = 0;
+}
+
+void store_shard_path(const char* path, uint32_t shard, char* shard_path){
+    snprintf(shard_path, STORE_PATH_LENGTH, "%s.%u", path, shard);
+}
+
+// blocks of the shard among the first n_of_blocks; shard 0 is the main file after the header
+uint32_t store_shard_length(uint32_t shard, uint32_t n_of_blocks){
+    if (store.shard_blocks == 0)
+        return shard == 0 ? n_of_blocks : 0;
+    uint32_t first_block = shard * store.shard_blocks;
+    if (first_block >= n_of_blocks)
+        return 0;
+    return n_of_blocks - first_block < store.shard_blocks ? n_of_blocks - first_block : store.shard_blocks;
+}
+
+uint32_t store_shard_of(uint32_t slot){
+    return store.shard_blocks == 0 ? 0 : slot / STORE_BLOCK_SLOTS / store.shard_blocks;
+}
+
+int store_extend(int fd, off_t size){
+    struct stat file_stat;
+    return fstat(fd, &file_stat) != 0 || (file_stat.st_size < size && ftruncate(fd, size) != 0);
+}
+
+// a shard is only open while it is mapped, the mapping keeps the file
+int store_map_shard(char* mapping, uint32_t shard, uint32_t n_of_blocks){
+    char path[STORE_PATH_LENGTH];
+    store_shard_path(store.path, shard, path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    off_t size = (off_t)store_shard_length(shard, n_of_blocks) * STORE_BLOCK_SIZE;
+    int result = fd < 0 || store_extend(fd, size) != 0 ||
+                 mmap(mapping + STORE_HEADER_SIZE + (size_t)shard * store.shard_blocks * STORE_BLOCK_SIZE, size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED;
+    if (fd >= 0)
+        close(fd);
+    return result;
+}
+
+// the main file and the shard files are mapped next to each other into one reserved range, so a slot
+// is still found by its offset and an account is routed to its shard without a lookup
+int store_map(uint32_t n_of_blocks){
+    off_t size = STORE_HEADER_SIZE + (off_t)store_shard_length(0, n_of_blocks) * STORE_BLOCK_SIZE;
+    if (store_extend(store.fd, size) != 0){
+        printf("Error resizing record file\n");
         return 1;
-    FILE *file = fopen(RECORD_FILE, "wb");
-    if (file == NULL) {
-        printf("Error opening file\n");
+    }
+    store_unmap();
+    size_t mapping_size = STORE_HEADER_SIZE + (size_t)n_of_blocks * STORE_BLOCK_SIZE;
+    char* mapping = mmap(NULL, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int result = mapping == MAP_FAILED ||
+                 mmap(mapping, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, store.fd, 0) == MAP_FAILED;
+    for (uint32_t shard = 1; result == 0 && store_shard_length(shard, n_of_blocks) != 0; shard++)
+        result = store_map_shard(mapping, shard, n_of_blocks);
+    if (result != 0){
+        if (mapping != MAP_FAILED)
+            munmap(mapping, mapping_size);
+        printf("Error mapping record file\n");
         return 1;
     }
-    fwrite(&NULL_ACCOUNT, sizeof(acc_t), 1, file);
-    fwrite(&ROOT_BANK_ACCOUNT, sizeof(acc_t), 1, file);
-    fclose(file);
-    number_of_accounts = 1;
+    store.mapping = mapping;
+    store.header = (store_header_t*)mapping;
+    store.checksums = (uint32_t*)(store.mapping + STORE_PAGE_SIZE);
+    store.n_of_blocks = n_of_blocks;
     return 0;
 }
 
-int verify_file_integrity(){
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
-        printf("Error opening file\n");
+int store_reserve(uint32_t n_of_slots){
+    uint32_t n_of_blocks = (n_of_slots + STORE_BLOCK_SLOTS - 1) / STORE_BLOCK_SLOTS;
+    if (n_of_blocks <= store.n_of_blocks)
+        return 0;
+    if (n_of_blocks > STORE_MAX_BLOCKS){
+        printf("Record file is full\n");
         return 1;
     }
-    acc_t account;
-    while (fread(&account, sizeof(acc_t), 1, file)){
-        if (verify_account_validity(account) != 0 && is_account_null(account)==false){
+    n_of_blocks = (n_of_blocks / STORE_GROWTH_BLOCKS + 1) * STORE_GROWTH_BLOCKS;
+    return store_map(n_of_blocks > STORE_MAX_BLOCKS ? STORE_MAX_BLOCKS : n_of_blocks);
+}
+
+hot_t* store_hot(uint32_t slot){
+    char* block = store.mapping + STORE_HEADER_SIZE + (size_t)(slot / STORE_BLOCK_SLOTS) * STORE_BLOCK_SIZE;
+    return (hot_t*)block + slot % STORE_BLOCK_SLOTS;
+}
+
+cold_t* store_cold(uint32_t slot){
+    char* block = store.mapping + STORE_HEADER_SIZE + (size_t)(slot / STORE_BLOCK_SLOTS) * STORE_BLOCK_SIZE;
+    return (cold_t*)(block + STORE_BLOCK_SLOTS * sizeof(hot_t)) + slot % STORE_BLOCK_SLOTS;
+}
+
+uint32_t store_slot_hash(uint32_t slot){
+    uint64_t words[(sizeof(hot_t) + sizeof(cold_t)) / sizeof(uint64_t)];
+    memcpy(words, store_hot(slot), sizeof(hot_t));
+    memcpy((char*)words + sizeof(hot_t), store_cold(slot), sizeof(cold_t));
+    uint64_t hash = 14695981039346656037ull ^ slot; // FNV-1a over words, seeded with the slot so moved records do not match
+    for (size_t i = 0; i < sizeof(words) / sizeof(uint64_t); i++){
+        hash ^= words[i];
+        hash *= 1099511628211ull;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+uint32_t store_block_checksum(uint32_t block){
+    uint32_t first_slot = block * STORE_BLOCK_SLOTS;
+    uint32_t end_slot = first_slot + STORE_BLOCK_SLOTS < store.n_of_slots ? first_slot + STORE_BLOCK_SLOTS : store.n_of_slots;
+    uint32_t checksum = 0;
+    for (uint32_t slot = first_slot; slot < end_slot; slot++)
+        checksum += store_slot_hash(slot);
+    return checksum;
+}
+
+// checks one block against its checksum and its records for validity; reports problems but keeps going,
+// like the full startup scan used to. A block of an uncleanly closed file is rehashed instead of compared
+int store_verify_block(uint32_t block){
+    uint32_t checksum = store_block_checksum(block);
+    int result = store.checksums_trusted && checksum != store.checksums[block];
+    uint32_t first_slot = block * STORE_BLOCK_SLOTS;
+    for (uint32_t slot = first_slot; slot < first_slot + STORE_BLOCK_SLOTS && slot < store.n_of_slots; slot++){
+        const hot_t* hot = store_hot(slot);
+        const cold_t* cold = store_cold(slot);
+        acc_t account = NULL_ACCOUNT;
+        account.account_number = hot->account_number;
+        account.curr_balance = hot->curr_balance;
+        account.loan_balance = hot->loan_balance;
+        account.interest_rate = hot->interest_rate;
+        memcpy(account.name, cold->name, sizeof(account.name));
+        memcpy(account.surname, cold->surname, sizeof(account.surname));
+        memcpy(account.address, cold->address, sizeof(account.address));
+        memcpy(account.national_id, cold->national_id, sizeof(account.national_id));
+        if (check_account_fields(&account) != 0 && is_account_null(account)==false && !is_account_closed(&account)){
             print_table_header(FULL_VIEW);
             print_account_as_table(account, FULL_VIEW);
-            printf("Error verifying file integrity - reset_file or manual trimming of data advised\n");
-            fclose(file);
-            return 1;
+            result = 1;
         }
     }
-    fclose(file);
-    return 0;
+    uint64_t bit = 1ull << (block % 64);
+    // lazy checks may race between worker threads, only the first to finish records the block
+    if (__atomic_fetch_or(&store.verified[block / 64], bit, __ATOMIC_ACQ_REL) & bit)
+        return result;
+    if (!store.checksums_trusted)
+        store.checksums[block] = checksum;
+    if (result != 0)
+        printf("Error verifying file integrity in block %u - --recover from the latest snapshot, reset_file or manual trimming of data advised\n", block);
+    return result;
 }
 
-acc_t get_account(uint32_t account_number){
-    if (account_number == 0 || account_number > number_of_accounts){
-        printf("Invalid account number\n");
-        return NULL_ACCOUNT;
-    }
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
-        printf("Error opening file\n");
-        return NULL_ACCOUNT;
-    }
-    if (fseek(file, account_number * sizeof(acc_t), SEEK_SET) != 0) {
-        printf("Error finding account - id possibly out of range\n");
-        fclose(file);
-        return NULL_ACCOUNT;
+uint32_t store_n_of_unverified(){
+    uint32_t n_of_blocks = (store.n_of_slots + STORE_BLOCK_SLOTS - 1) / STORE_BLOCK_SLOTS;
+    uint32_t n_of_unverified = 0;
+    for (uint32_t i = 0; i < n_of_blocks; i += 64){
+        uint64_t word = __atomic_load_n(&store.verified[i / 64], __ATOMIC_ACQUIRE);
+        if (n_of_blocks - i < 64)
+            word |= ~0ull << (n_of_blocks - i);
+        n_of_unverified += 64 - __builtin_popcountll(word);
     }
+    return n_of_unverified;
+}
 
-    acc_t account;
-    if(fread(&account, sizeof(acc_t), 1, file)!=1){
-        printf("Error reading account\n");
-        fclose(file);
-        return NULL_ACCOUNT;
-    }
-    fclose(file);
+// verifies the block of slot on its first access
+void store_check(uint32_t slot){
+    uint32_t block = slot / STORE_BLOCK_SLOTS;
+    if ((__atomic_load_n(&store.verified[block / 64], __ATOMIC_ACQUIRE) & (1ull << (block % 64))) == 0)
+        store_verify_block(block);
+}
+
+// the clean mark has to be off on disk before any block can change under its checksum
+void store_mark_dirty(){
+    if (!store.header->clean)
+        return;
+    store.header->clean = 0;
+    stats_count(STATS_MSYNCS, 1);
+    if (msync(store.mapping, STORE_PAGE_SIZE, MS_SYNC) != 0)
+        printf("Error flushing record file\n");
+}
+
+// notes the shard of a written slot for the next sync; replay workers write slots in parallel
+void store_touch(uint32_t slot){
+    uint32_t shard = store_shard_of(slot);
+    __atomic_fetch_or(&store.dirty_shards[shard / 64], 1ull << (shard % 64), __ATOMIC_RELAXED);
+}
+
+acc_t store_get(uint32_t slot){
+    store_check(slot);
+    stats_count(STATS_SLOT_READS, 1);
+    const hot_t* hot = store_hot(slot);
+    const cold_t* cold = store_cold(slot);
+    acc_t account = NULL_ACCOUNT;
+    account.account_number = hot->account_number;
+    account.curr_balance = hot->curr_balance;
+    account.loan_balance = hot->loan_balance;
+    account.interest_rate = hot->interest_rate;
+    memcpy(account.name, cold->name, sizeof(account.name));
+    memcpy(account.surname, cold->surname, sizeof(account.surname));
+    memcpy(account.address, cold->address, sizeof(account.address));
+    memcpy(account.national_id, cold->national_id, sizeof(account.national_id));
     return account;
 }
 
-acc_t get_last_account(){
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
+// adds (sign 1) or takes away (sign -1) what the slot holds from the running totals; replay workers
+// write slots in parallel, so the totals are updated atomically
+void store_count_slot(uint32_t slot, int sign){
+    const hot_t* hot = store_hot(slot);
+    uint32_t open = hot->account_number != NULL_ACCOUNT.account_number && store_cold(slot)->national_id[0] != '\0';
+    store_totals_t* totals = &store.header->totals;
+    __atomic_fetch_add(&totals->balance, sign * hot->curr_balance, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->loans, sign * hot->loan_balance, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->n_of_accounts, sign * (int32_t)open, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals->n_of_loans, sign * (int32_t)(open & (hot->loan_balance != 0)), __ATOMIC_RELAXED);
+}
+
+void store_set(uint32_t slot, const acc_t* account){
+    store_check(slot);
+    stats_count(STATS_SLOT_WRITES, 1);
+    store_mark_dirty();
+    store_touch(slot);
+    uint32_t block = slot / STORE_BLOCK_SLOTS;
+    store_count_slot(slot, -1); // slots past n_of_slots are zeroed and count for nothing
+    if (slot < store.n_of_slots)
+        store.checksums[block] -= store_slot_hash(slot);
+    hot_t* hot = store_hot(slot);
+    cold_t* cold = store_cold(slot);
+    hot->account_number = account->account_number;
+    hot->curr_balance = account->curr_balance;
+    hot->loan_balance = account->loan_balance;
+    hot->interest_rate = account->interest_rate;
+    memcpy(cold->name, account->name, sizeof(cold->name));
+    memcpy(cold->surname, account->surname, sizeof(cold->surname));
+    memcpy(cold->address, account->address, sizeof(cold->address));
+    memcpy(cold->national_id, account->national_id, sizeof(cold->national_id));
+    store_count_slot(slot, 1);
+    if (slot < store.n_of_slots)
+        store.checksums[block] += store_slot_hash(slot);
+}
+
+void store_set_n_of_slots(uint32_t n_of_slots){
+    store.n_of_slots = n_of_slots;
+    store.header->n_of_slots = n_of_slots;
+}
+
+int store_append(const acc_t* account){
+    if (store_reserve(store.n_of_slots + 1) != 0)
+        return 1;
+    uint32_t slot = store.n_of_slots;
+    store_set(slot, account);
+    store_set_n_of_slots(slot + 1);
+    store.checksums[slot / STORE_BLOCK_SLOTS] += store_slot_hash(slot);
+    return 0;
+}
+
+// removes the shard files from the given one on
+void store_remove_shards(const char* path, uint32_t first_shard){
+    char shard_path[STORE_PATH_LENGTH];
+    for (uint32_t shard = first_shard; ; shard++){
+        store_shard_path(path, shard, shard_path);
+        if (unlink(shard_path) != 0)
+            break;
+    }
+}
+
+void store_remove(const char* path){
+    unlink(path);
+    store_remove_shards(path, 1);
+}
+
+// renames the main file and its shards; shards the target had beyond the source's are removed
+int store_rename(const char* from, const char* to){
+    if (rename(from, to) != 0)
+        return 1;
+    char from_shard[STORE_PATH_LENGTH], to_shard[STORE_PATH_LENGTH];
+    uint32_t shard = 1;
+    for (;; shard++){
+        store_shard_path(from, shard, from_shard);
+        store_shard_path(to, shard, to_shard);
+        if (rename(from_shard, to_shard) != 0)
+            break;
+    }
+    if (errno != ENOENT)
+        return 1;
+    store_remove_shards(to, shard);
+    return 0;
+}
+
+// blocks of an existing file: those of the main file, then those of each full shard and the first short one
+uint32_t store_count_blocks(off_t main_size){
+    uint32_t n_of_blocks = main_size < STORE_HEADER_SIZE ? 0 : (main_size - STORE_HEADER_SIZE) / STORE_BLOCK_SIZE;
+    if (store.shard_blocks == 0 || n_of_blocks < store.shard_blocks)
+        return n_of_blocks;
+    n_of_blocks = store.shard_blocks;
+    char path[STORE_PATH_LENGTH];
+    struct stat file_stat;
+    for (uint32_t shard = 1; n_of_blocks <= STORE_MAX_BLOCKS; shard++){
+        store_shard_path(store.path, shard, path);
+        if (stat(path, &file_stat) != 0)
+            break;
+        uint32_t n_of_shard_blocks = file_stat.st_size / STORE_BLOCK_SIZE;
+        n_of_blocks += n_of_shard_blocks < store.shard_blocks ? n_of_shard_blocks : store.shard_blocks;
+        if (n_of_shard_blocks < store.shard_blocks)
+            break;
+    }
+    return n_of_blocks;
+}
+
+// the cache, the journal and the indexes all assume one process owns the files, so the whole record
+// file is write-locked for as long as it is open. The lock belongs to the open file description: worker
+// threads and the forked snapshot writer share it, another process is refused instead of losing updates
+int store_lock(int fd){
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0};
+    if (fcntl(fd, F_OFD_SETLK, &lock) == 0)
+        return 0;
+    if (errno == EAGAIN || errno == EACCES)
+        printf("Record file is in use by another process - run one with --serve and connect the others with --connect\n");
+    else
+        printf("Error locking record file\n");
+    return 1;
+}
+
+int store_open_path(const char* path){
+    store.path = path;
+    store.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store.fd < 0){
         printf("Error opening file\n");
-        return NULL_ACCOUNT;
+        return 1;
+    }
+    if (store_lock(store.fd) != 0){
+        close(store.fd);
+        store.fd = -1;
+        return 1;
+    }
+    struct stat file_stat;
+    if (fstat(store.fd, &file_stat) != 0){
+        printf("Error opening file\n");
+        close(store.fd);
+        store.fd = -1;
+        return 1;
+    }
+    if (file_stat.st_size == 0){
+        store.shard_blocks = STORE_SHARD_BLOCKS;
+        store_remove_shards(path, 1); // left over from a file removed by hand, they would show through as records
+        if (store_map(0) != 0)
+            return 1;
+        memcpy(store.header->magic, STORE_MAGIC, sizeof(store.header->magic));
+        store.header->version = STORE_FORMAT_VERSION;
+        store.header->block_slots = STORE_BLOCK_SLOTS;
+        store.header->shard_blocks = STORE_SHARD_BLOCKS;
+        store_set_n_of_slots(0);
+        store.header->totals_kept = 1;
+        store.checksums_trusted = true;
+        store.free_list_trusted = true;
+        store.totals_trusted = true;
+        memset(store.verified, 0, sizeof(store.verified));
+        return store_append(&NULL_ACCOUNT);
+    }
+    store_header_t header;
+    if (pread(store.fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0){
+        printf("Record file uses the old layout - run with --migrate to convert it\n");
+        return 1;
+    }
+    if (header.version < STORE_FORMAT_VERSION && header.block_slots == STORE_BLOCK_SLOTS){
+        printf("Record file uses format v%u - run with --migrate to convert it\n", header.version);
+        return 1;
+    }
+    if (header.version != STORE_FORMAT_VERSION || header.block_slots != STORE_BLOCK_SLOTS){
+        printf("Unsupported record file format version %u\n", header.version);
+        return 1;
+    }
+    store.shard_blocks = header.shard_blocks;
+    uint32_t n_of_blocks = store_count_blocks(file_stat.st_size);
+    if (header.n_of_slots == 0 || header.n_of_slots > (uint64_t)n_of_blocks * STORE_BLOCK_SLOTS || n_of_blocks > STORE_MAX_BLOCKS){
+        printf("Record file header does not match file size - a shard file may be missing\n");
+        return 1;
+    }
+    // only the header is read here, blocks are verified on first access
+    if (store_map(n_of_blocks) != 0)
+        return 1;
+    store.n_of_slots = header.n_of_slots;
+    store.checksums_trusted = header.clean != 0;
+    store.free_list_trusted = header.clean != 0;
+    store.totals_trusted = header.clean != 0 && header.totals_kept != 0;
+    memset(store.verified, 0, sizeof(store.verified));
+    return 0;
+}
+
+int store_open(){
+    return store_open_path(RECORD_FILE);
+}
+
+int store_truncate(uint32_t n_of_slots){
+    if (n_of_slots < store.n_of_slots)
+        store_mark_dirty();
+    for (uint32_t i = n_of_slots; i < store.n_of_slots; i++){
+        store_check(i);
+        store.checksums[i / STORE_BLOCK_SLOTS] -= store_slot_hash(i);
+        store_count_slot(i, -1);
+        store_touch(i);
+        memset(store_hot(i), 0, sizeof(hot_t));
+        memset(store_cold(i), 0, sizeof(cold_t));
+    }
+    if (n_of_slots < store.n_of_slots){
+        store_set_n_of_slots(n_of_slots);
+        store.free_list_trusted = false;
+    }
+    return 0;
+}
+
+bool store_slot_closed(uint32_t slot){
+    store_check(slot);
+    return store_hot(slot)->account_number != NULL_ACCOUNT.account_number && store_cold(slot)->national_id[0] == '\0';
+}
+
+void store_set_next_free(uint32_t slot, uint32_t next_free){
+    store_check(slot);
+    store_mark_dirty();
+    store_touch(slot);
+    uint32_t block = slot / STORE_BLOCK_SLOTS;
+    store.checksums[block] -= store_slot_hash(slot);
+    store_hot(slot)->next_free = next_free;
+    store.checksums[block] += store_slot_hash(slot);
+}
+
+void store_free_push(uint32_t slot){
+    store_set_next_free(slot, store.header->free_head);
+    store.header->free_head = slot;
+    store.header->n_of_free++;
+}
+
+// pushed from the top down, so reuse fills the lowest holes first
+void store_rebuild_free_list(){
+    store_mark_dirty();
+    store.header->free_head = 0;
+    store.header->n_of_free = 0;
+    for (uint32_t slot = store.n_of_slots; slot-- > 2;){ // NULL_ACCOUNT and the bank are never closed
+        if (store_slot_closed(slot))
+            store_free_push(slot);
+    }
+    store.free_list_trusted = true;
+}
+
+// closed slot a new account can take, 0 if there is none
+uint32_t store_free_slot(){
+    if (!store.free_list_trusted)
+        store_rebuild_free_list();
+    uint32_t slot = store.header->free_head;
+    // the list is only advisory after a crash, an entry that is no longer closed means it is stale
+    if (slot != 0 && (slot >= store.n_of_slots || !store_slot_closed(slot))){
+        store_rebuild_free_list();
+        slot = store.header->free_head;
+    }
+    return slot;
+}
+
+// called once the account that took the head slot is committed
+void store_free_pop(uint32_t slot){
+    if (!store.free_list_trusted || store.header->free_head != slot)
+        return;
+    store_mark_dirty();
+    store.header->free_head = store_hot(slot)->next_free;
+    store.header->n_of_free--;
+    store_set_next_free(slot, 0);
+}
+
+// after an unclean shutdown the totals may not match the blocks that reached the disk
+void store_recount_totals(){
+    store_mark_dirty();
+    store_totals_t totals = {0, 0, 0, 0};
+    for (uint32_t slot = 1; slot < store.n_of_slots; slot++){
+        store_check(slot);
+        const hot_t* hot = store_hot(slot);
+        bool open = hot->account_number != NULL_ACCOUNT.account_number && store_cold(slot)->national_id[0] != '\0';
+        totals.balance += hot->curr_balance;
+        totals.loans += hot->loan_balance;
+        totals.n_of_accounts += open;
+        totals.n_of_loans += open && hot->loan_balance != 0;
+    }
+    store.header->totals = totals;
+    store.header->totals_kept = 1;
+    store.totals_trusted = true;
+}
+
+// flushes the shards written since the last sync, each on its own, then the header and checksum table
+int store_sync(){
+    if (store.mapping == NULL)
+        return 0;
+    for (uint32_t shard = 0; store_shard_length(shard, store.n_of_blocks) != 0; shard++){
+        uint64_t bit = 1ull << (shard % 64);
+        if ((__atomic_fetch_and(&store.dirty_shards[shard / 64], ~bit, __ATOMIC_RELAXED) & bit) == 0)
+            continue;
+        char* first_block = store.mapping + STORE_HEADER_SIZE + (size_t)shard * store.shard_blocks * STORE_BLOCK_SIZE;
+        stats_count(STATS_MSYNCS, 1);
+        if (msync(first_block, (size_t)store_shard_length(shard, store.n_of_blocks) * STORE_BLOCK_SIZE, MS_SYNC) != 0){
+            printf("Error flushing record file\n");
+            return 1;
+        }
+    }
+    stats_count(STATS_MSYNCS, 1);
+    if (msync(store.mapping, STORE_HEADER_SIZE, MS_SYNC) != 0){
+        printf("Error flushing record file\n");
+        return 1;
+    }
+    if (!store.checksums_trusted && store_n_of_unverified() == 0)
+        store.checksums_trusted = true; // every block has been rehashed since the unclean shutdown
+    if (!store.checksums_trusted || store.header->clean)
+        return 0;
+    store.header->clean = 1;
+    stats_count(STATS_MSYNCS, 1);
+    if (msync(store.mapping, STORE_PAGE_SIZE, MS_SYNC) != 0){
+        printf("Error flushing record file\n");
+        return 1;
+    }
+    return 0;
+}
+
+// cuts the files back to n_of_blocks: the main file and the last shard in use are shortened, later shards removed
+int store_trim(uint32_t n_of_blocks){
+    int result = ftruncate(store.fd, STORE_HEADER_SIZE + (off_t)store_shard_length(0, n_of_blocks) * STORE_BLOCK_SIZE);
+    char path[STORE_PATH_LENGTH];
+    uint32_t shard = 1;
+    for (; store_shard_length(shard, n_of_blocks) != 0; shard++){
+        store_shard_path(store.path, shard, path);
+        result |= truncate(path, (off_t)store_shard_length(shard, n_of_blocks) * STORE_BLOCK_SIZE);
+    }
+    store_remove_shards(store.path, shard);
+    if (result != 0)
+        printf("Error trimming record file\n");
+    return result != 0;
+}
+
+void store_close(){
+    if (store.fd < 0)
+        return;
+    store_sync();
+    uint32_t n_of_blocks = (store.n_of_slots + STORE_BLOCK_SLOTS - 1) / STORE_BLOCK_SLOTS;
+    store_unmap();
+    // drop growth padding past the last used block
+    store_trim(n_of_blocks);
+    close(store.fd);
+    store.fd = -1;
+    store.n_of_slots = 0;
+}
+
+const char* index_field(const trigram_index_t* index, uint32_t account_number){
+    return (const char*)store_cold(account_number) + index->field_offset;
+}
+
+// base letter of a Polish letter given as its two UTF-8 bytes, '\0' for any other character
+char fold_polish_letter(uint8_t lead, uint8_t trail){
+    static const struct {uint8_t lead; uint8_t trail; char letter;} LETTERS[] = {
+            {0xC4, 0x84, 'a'}, {0xC4, 0x85, 'a'}, {0xC4, 0x86, 'c'}, {0xC4, 0x87, 'c'}, {0xC4, 0x98, 'e'},
+            {0xC4, 0x99, 'e'}, {0xC5, 0x81, 'l'}, {0xC5, 0x82, 'l'}, {0xC5, 0x83, 'n'}, {0xC5, 0x84, 'n'},
+            {0xC3, 0x93, 'o'}, {0xC3, 0xB3, 'o'}, {0xC5, 0x9A, 's'}, {0xC5, 0x9B, 's'}, {0xC5, 0xB9, 'z'},
+            {0xC5, 0xBA, 'z'}, {0xC5, 0xBB, 'z'}, {0xC5, 0xBC, 'z'}
+    };
+    for (size_t i = 0; i < sizeof(LETTERS) / sizeof(LETTERS[0]); i++){
+        if (LETTERS[i].lead == lead && LETTERS[i].trail == trail)
+            return LETTERS[i].letter;
+    }
+    return '\0';
+}
+
+// lower-case ASCII letters and digits, Polish letters reduced to their base letter and any other letter to '?';
+// runs of spaces and punctuation become one space and none is kept at either end; at most capacity
+// characters are written before the terminator
+size_t normalize_text(const char* text, size_t length, char* normalized, size_t capacity){
+    size_t n = 0;
+    for (size_t i = 0; i < length && text[i] != '\0' && n < capacity; i++){
+        uint8_t c = (uint8_t)text[i];
+        char letter = ' ';
+        if (c >= 'A' && c <= 'Z')
+            letter = c - 'A' + 'a';
+        else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+            letter = c;
+        else if (c >= 0x80){
+            letter = i + 1 < length ? fold_polish_letter(c, (uint8_t)text[i + 1]) : '\0';
+            if (letter == '\0')
+                letter = '?';
+            while (i + 1 < length && ((uint8_t)text[i + 1] & 0xC0) == 0x80)
+                i++; // continuation bytes of the same character
+        }
+        if (letter == ' ' && (n == 0 || normalized[n - 1] == ' '))
+            continue;
+        normalized[n++] = letter;
+    }
+    while (n > 0 && normalized[n - 1] == ' ')
+        n--;
+    normalized[n] = '\0';
+    return n;
+}
+
+uint32_t trigram_symbol(char c){
+    if (c >= 'a' && c <= 'z')
+        return 1 + (c - 'a');
+    if (c >= '0' && c <= '9')
+        return 27 + (c - '0');
+    return TRIGRAM_SYMBOLS - 1;
+}
+
+// distinct trigrams of normalized text; the text is preceded by two start symbols,
+// so its first two trigrams only match at the start of a field
+uint32_t text_trigrams(const char* normalized, size_t length, uint32_t* trigrams){
+    uint32_t n_of_trigrams = 0, window = 0;
+    for (size_t i = 0; i < length; i++){
+        window = (window * TRIGRAM_SYMBOLS + trigram_symbol(normalized[i])) % N_OF_TRIGRAMS;
+        uint32_t j = 0;
+        while (j < n_of_trigrams && trigrams[j] != window)
+            j++;
+        if (j == n_of_trigrams)
+            trigrams[n_of_trigrams++] = window;
+    }
+    return n_of_trigrams;
+}
+
+// edit distance from the query to the closest prefix of the text, limit + 1 once it is known to exceed limit
+uint32_t prefix_edit_distance(const char* query, size_t query_length, const char* text, size_t text_length, uint32_t limit){
+    uint32_t row[LENGTH_OF_NORMALIZED + 1]; // distances from the query so far to each prefix of the text
+    for (size_t j = 0; j <= text_length; j++)
+        row[j] = j;
+    for (size_t i = 1; i <= query_length; i++){
+        uint32_t diagonal = row[0], smallest = i;
+        row[0] = i;
+        for (size_t j = 1; j <= text_length; j++){
+            uint32_t above = row[j];
+            uint32_t distance = diagonal + (query[i - 1] != text[j - 1]);
+            if (above + 1 < distance)
+                distance = above + 1;
+            if (row[j - 1] + 1 < distance)
+                distance = row[j - 1] + 1;
+            row[j] = distance;
+            diagonal = above;
+            if (distance < smallest)
+                smallest = distance;
+        }
+        if (smallest > limit)
+            return limit + 1;
+    }
+    uint32_t closest = row[0];
+    for (size_t j = 1; j <= text_length; j++){
+        if (row[j] < closest)
+            closest = row[j];
+    }
+    return closest;
+}
+
+// lists the account under every trigram of its current field value
+int trigram_index_insert(trigram_index_t* index, uint32_t account_number){
+    char normalized[LENGTH_OF_NORMALIZED + 1];
+    uint32_t trigrams[LENGTH_OF_NORMALIZED];
+    size_t length = normalize_text(index_field(index, account_number), index->field_length, normalized, LENGTH_OF_NORMALIZED);
+    uint32_t n_of_trigrams = text_trigrams(normalized, length, trigrams);
+    for (uint32_t i = 0; i < n_of_trigrams; i++){
+        trigram_list_t* list = &index->lists[trigrams[i]];
+        if (list->count == list->capacity){
+            uint32_t capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+            uint32_t* accounts = realloc(list->accounts, (size_t)capacity * sizeof(uint32_t));
+            if (accounts == NULL){
+                printf("Error growing search index\n");
+                return 1;
+            }
+            list->accounts = accounts;
+            list->capacity = capacity;
+        }
+        list->accounts[list->count++] = account_number;
+    }
+    return 0;
+}
+
+uint32_t hash_national_id(const char* national_id){
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < LENGTH_OF_NATIONAL_ID && national_id[i] != '\0'; i++){
+        hash ^= (uint8_t)national_id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void id_index_link(uint32_t account_number){
+    uint32_t bucket = hash_national_id(store_cold(account_number)->national_id) & (id_index.n_of_buckets - 1);
+    id_index.next[account_number] = id_index.buckets[bucket];
+    id_index.buckets[bucket] = account_number;
+}
+
+int id_index_rehash(uint32_t n_of_buckets){
+    uint32_t* buckets = calloc(n_of_buckets, sizeof(uint32_t));
+    if (buckets == NULL){
+        printf("Error growing search index\n");
+        return 1;
+    }
+    uint32_t* old_buckets = id_index.buckets;
+    uint32_t old_n_of_buckets = id_index.n_of_buckets;
+    id_index.buckets = buckets;
+    id_index.n_of_buckets = n_of_buckets;
+    for (uint32_t i = 0; i < old_n_of_buckets; i++){
+        uint32_t account_number = old_buckets[i];
+        while (account_number != 0){
+            uint32_t next = id_index.next[account_number];
+            id_index_link(account_number);
+            account_number = next;
+        }
+    }
+    free(old_buckets);
+    return 0;
+}
+
+int id_index_insert(uint32_t account_number){
+    if (account_number >= id_index.next_capacity){
+        uint32_t capacity = (account_number / INDEX_GROWTH + 1) * INDEX_GROWTH;
+        uint32_t* next = realloc(id_index.next, (size_t)capacity * sizeof(uint32_t));
+        if (next == NULL){
+            printf("Error growing search index\n");
+            return 1;
+        }
+        id_index.next = next;
+        id_index.next_capacity = capacity;
+    }
+    // keep the load factor at or below 1
+    if (id_index.count >= id_index.n_of_buckets &&
+        id_index_rehash(id_index.n_of_buckets < ID_INDEX_MIN_BUCKETS ? ID_INDEX_MIN_BUCKETS : id_index.n_of_buckets * 2) != 0)
+        return 1;
+    id_index_link(account_number);
+    id_index.count++;
+    return 0;
+}
+
+void id_index_remove(uint32_t account_number){
+    if (id_index.n_of_buckets == 0)
+        return;
+    uint32_t* link = &id_index.buckets[hash_national_id(store_cold(account_number)->national_id) & (id_index.n_of_buckets - 1)];
+    while (*link != 0 && *link != account_number)
+        link = &id_index.next[*link];
+    if (*link == 0)
+        return;
+    *link = id_index.next[account_number];
+    id_index.count--;
+}
+
+uint64_t hash_national_id_wide(const char* national_id){
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (int i = 0; i < LENGTH_OF_NATIONAL_ID && national_id[i] != '\0'; i++){
+        hash ^= (uint8_t)national_id[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void clear_id_filter(){
+    free(id_filter.bits);
+    id_filter = (id_filter_t){NULL, 0, 0};
+}
+
+// probes are spread by double hashing on the two halves of one 64-bit hash
+void id_filter_add(const char* national_id){
+    if (id_filter.bits == NULL)
+        return;
+    uint64_t hash = hash_national_id_wide(national_id);
+    uint64_t step = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < ID_FILTER_PROBES; i++, hash += step)
+        id_filter.bits[(hash & (id_filter.n_of_bits - 1)) / 64] |= 1ull << (hash % 64);
+    // past its sizing the false positive rate climbs, the filter is rebuilt larger on next use
+    if (++id_filter.count > id_filter.n_of_bits / ID_FILTER_BITS_PER_ACCOUNT)
+        clear_id_filter();
+}
+
+bool id_filter_may_contain(const char* national_id){
+    uint64_t hash = hash_national_id_wide(national_id);
+    uint64_t step = (hash >> 32 | hash << 32) | 1;
+    for (int i = 0; i < ID_FILTER_PROBES; i++, hash += step){
+        if ((id_filter.bits[(hash & (id_filter.n_of_bits - 1)) / 64] & (1ull << (hash % 64))) == 0)
+            return false;
+    }
+    return true;
+}
+
+// filled from the identity columns, which are always current in the file; closed slots have no ID
+int build_id_filter(){
+    clear_id_filter();
+    uint64_t n_of_bits = ID_FILTER_MIN_BITS;
+    while (n_of_bits < (uint64_t)store.n_of_slots * 2 * ID_FILTER_BITS_PER_ACCOUNT)
+        n_of_bits *= 2;
+    uint64_t* bits = calloc(n_of_bits / 64, sizeof(uint64_t));
+    if (bits == NULL){
+        printf("Error building national ID filter\n");
+        return 1;
+    }
+    id_filter = (id_filter_t){bits, n_of_bits, 0};
+    for (uint32_t slot = 1; slot < store.n_of_slots; slot++){
+        if (slot == 1 || slot % STORE_BLOCK_SLOTS == 0)
+            store_check(slot);
+        const cold_t* cold = store_cold(slot);
+        if (cold->national_id[0] != '\0')
+            id_filter_add(cold->national_id);
+    }
+    return 0;
+}
+
+// must be called while the account slot still holds the indexed values; the trigram lists keep
+// the account until the next build, searches check every field they read against the query
+void index_remove_account(uint32_t account_number){
+    n_of_stale_accounts++;
+    id_index_remove(account_number);
+}
+
+int index_add_account(uint32_t account_number){
+    for (int i = 0; i < N_OF_TEXT_INDEXES; i++){
+        if (trigram_index_insert(&trigram_indexes[i], account_number) != 0)
+            return 1;
+    }
+    return id_index_insert(account_number);
+}
+
+bool account_identity_equal(const acc_t* a, const acc_t* b){
+    return strncmp(a->name, b->name, LENGTH_OF_NAME) == 0 &&
+           strncmp(a->surname, b->surname, LENGTH_OF_SURNAME) == 0 &&
+           strncmp(a->address, b->address, LENGTH_OF_ADDRESS) == 0 &&
+           strncmp(a->national_id, b->national_id, LENGTH_OF_NATIONAL_ID) == 0;
+}
+
+int compare_order_keys(order_key_t a, order_key_t b){
+    if (a.value != b.value)
+        return (a.value > b.value) - (a.value < b.value);
+    return (a.account_number > b.account_number) - (a.account_number < b.account_number);
+}
+
+// the page that holds the key or would hold it: the last page whose first key is not above it
+uint32_t order_index_page(const order_index_t* index, order_key_t key){
+    uint32_t low = 0, high = index->n_of_pages;
+    while (high - low > 1){
+        uint32_t mid = low + (high - low) / 2;
+        if (compare_order_keys(index->pages[mid]->keys[0], key) <= 0)
+            low = mid;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// position of the first key in the page not below the given one
+uint32_t order_page_lower_bound(const order_page_t* page, order_key_t key){
+    uint32_t low = 0, high = page->count;
+    while (low < high){
+        uint32_t mid = low + (high - low) / 2;
+        if (compare_order_keys(page->keys[mid], key) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+order_page_t* order_index_add_page(order_index_t* index, uint32_t position){
+    if (index->n_of_pages == index->capacity){
+        order_page_t** pages = realloc(index->pages, (size_t)(index->capacity + INDEX_GROWTH) * sizeof(order_page_t*));
+        if (pages == NULL)
+            return NULL;
+        index->pages = pages;
+        index->capacity += INDEX_GROWTH;
+    }
+    order_page_t* page = malloc(sizeof(order_page_t));
+    if (page == NULL)
+        return NULL;
+    page->count = 0;
+    memmove(&index->pages[position + 1], &index->pages[position], (size_t)(index->n_of_pages - position) * sizeof(order_page_t*));
+    index->pages[position] = page;
+    index->n_of_pages++;
+    return page;
+}
+
+void order_index_drop_page(order_index_t* index, uint32_t position){
+    free(index->pages[position]);
+    memmove(&index->pages[position], &index->pages[position + 1], (size_t)(index->n_of_pages - position - 1) * sizeof(order_page_t*));
+    index->n_of_pages--;
+}
+
+int order_index_insert(order_index_t* index, order_key_t key){
+    if (index->n_of_pages == 0 && order_index_add_page(index, 0) == NULL)
+        return 1;
+    uint32_t position = order_index_page(index, key);
+    order_page_t* page = index->pages[position];
+    if (page->count == ORDER_PAGE_KEYS){
+        order_page_t* right = order_index_add_page(index, position + 1);
+        if (right == NULL)
+            return 1;
+        right->count = ORDER_PAGE_KEYS / 2;
+        memcpy(right->keys, &page->keys[ORDER_PAGE_KEYS / 2], (size_t)right->count * sizeof(order_key_t));
+        page->count = ORDER_PAGE_KEYS / 2;
+        if (compare_order_keys(key, right->keys[0]) >= 0)
+            page = right;
+    }
+    uint32_t slot = order_page_lower_bound(page, key);
+    memmove(&page->keys[slot + 1], &page->keys[slot], (size_t)(page->count - slot) * sizeof(order_key_t));
+    page->keys[slot] = key;
+    page->count++;
+    index->count++;
+    return 0;
+}
+
+void order_index_remove(order_index_t* index, order_key_t key){
+    if (index->n_of_pages == 0)
+        return;
+    uint32_t position = order_index_page(index, key);
+    order_page_t* page = index->pages[position];
+    uint32_t slot = order_page_lower_bound(page, key);
+    if (slot == page->count || compare_order_keys(page->keys[slot], key) != 0)
+        return;
+    memmove(&page->keys[slot], &page->keys[slot + 1], (size_t)(page->count - slot - 1) * sizeof(order_key_t));
+    page->count--;
+    index->count--;
+    // neighbours that fit into half a page are merged, an empty page never stays in the index
+    if (position + 1 < index->n_of_pages && page->count + index->pages[position + 1]->count <= ORDER_PAGE_KEYS / 2){
+        order_page_t* next = index->pages[position + 1];
+        memcpy(&page->keys[page->count], next->keys, (size_t)next->count * sizeof(order_key_t));
+        page->count += next->count;
+        order_index_drop_page(index, position + 1);
+    } else if (position > 0 && page->count + index->pages[position - 1]->count <= ORDER_PAGE_KEYS / 2){
+        order_page_t* previous = index->pages[position - 1];
+        memcpy(&previous->keys[previous->count], page->keys, (size_t)page->count * sizeof(order_key_t));
+        previous->count += page->count;
+        order_index_drop_page(index, position);
+    } else if (page->count == 0){
+        order_index_drop_page(index, position);
+    }
+}
+
+void clear_order_indexes(){
+    order_indexes_built = false;
+    for (int i = 0; i < N_OF_ORDER_INDEXES; i++){
+        for (uint32_t j = 0; j < order_indexes[i].n_of_pages; j++)
+            free(order_indexes[i].pages[j]);
+        free(order_indexes[i].pages);
+        order_indexes[i] = (order_index_t){NULL, 0, 0, 0};
+    }
+}
+
+bool is_account_ordered(const acc_t* account){
+    return account->account_number != NULL_ACCOUNT.account_number && !is_account_closed(account);
+}
+
+money_t order_column_value(const acc_t* account, int column){
+    return column == LOAN_COLUMN ? account->loan_balance : account->curr_balance;
+}
+
+// moves an account between its old and new values; before is NULL for a new slot.
+// The orders are dropped when a page cannot be allocated and rebuilt on next use
+void order_indexes_update(const acc_t* before, const acc_t* after){
+    if (!order_indexes_built)
+        return;
+    for (int i = 0; i < N_OF_ORDER_INDEXES; i++){
+        bool was_ordered = before != NULL && is_account_ordered(before);
+        bool is_ordered = is_account_ordered(after);
+        order_key_t old_key = {was_ordered ? order_column_value(before, i) : 0, after->account_number};
+        order_key_t new_key = {order_column_value(after, i), after->account_number};
+        if (was_ordered && is_ordered && old_key.value == new_key.value)
+            continue;
+        if (was_ordered)
+            order_index_remove(&order_indexes[i], old_key);
+        if (is_ordered && order_index_insert(&order_indexes[i], new_key) != 0){
+            clear_order_indexes();
+            return;
+        }
+    }
+}
+
+void clear_indexes(){
+    indexes_built = false;
+    for (int i = 0; i < N_OF_TEXT_INDEXES; i++){
+        for (uint32_t j = 0; trigram_indexes[i].lists != NULL && j < N_OF_TRIGRAMS; j++)
+            trigram_indexes[i].lists[j].count = 0;
+    }
+    n_of_stale_accounts = 0;
+    free(id_index.buckets);
+    id_index.buckets = NULL;
+    id_index.n_of_buckets = 0;
+    id_index.count = 0;
+}
+
+// the trigram lists keep their memory between builds, a rebuild refills them in account order
+int build_indexes(){
+    clear_indexes();
+    uint32_t capacity = store.n_of_slots;
+    for (int i = 0; i < N_OF_TEXT_INDEXES; i++){
+        if (trigram_indexes[i].lists != NULL)
+            continue;
+        trigram_indexes[i].lists = calloc(N_OF_TRIGRAMS, sizeof(trigram_list_t));
+        if (trigram_indexes[i].lists == NULL){
+            printf("Error growing search index\n");
+            return 1;
+        }
+    }
+    if (id_index.next_capacity < capacity){
+        uint32_t* next = realloc(id_index.next, (size_t)capacity * sizeof(uint32_t));
+        if (next == NULL){
+            printf("Error growing search index\n");
+            return 1;
+        }
+        id_index.next = next;
+        id_index.next_capacity = capacity;
+    }
+    uint32_t n_of_buckets = ID_INDEX_MIN_BUCKETS;
+    while (n_of_buckets < capacity)
+        n_of_buckets *= 2;
+    if (id_index_rehash(n_of_buckets) != 0)
+        return 1;
+    for (uint32_t i = 1; i < store.n_of_slots; i++){
+        acc_t account = store_get(i);
+        if (is_account_null(account) || is_account_closed(&account))
+            continue;
+        for (int j = 0; j < N_OF_TEXT_INDEXES; j++){
+            if (trigram_index_insert(&trigram_indexes[j], i) != 0)
+                return 1;
+        }
+        id_index_link(i);
+        id_index.count++;
+    }
+    indexes_built = true;
+    return 0;
+}
+
+// once the stale entries outnumber the accounts the lists are rebuilt rather than read through them
+int ensure_indexes(){
+    if (indexes_built && n_of_stale_accounts <= id_index.count)
+        return 0;
+    return build_indexes();
+}
+
+// the open account holding the national ID, 0 when there is none; most new IDs are settled
+// by the filter alone, the rest are looked up in id_index
+int find_national_id(const char* national_id, uint32_t* owner){
+    *owner = 0;
+    if (id_filter.bits == NULL && build_id_filter() != 0)
+        return 1;
+    if (!id_filter_may_contain(national_id))
+        return 0;
+    if (ensure_indexes() != 0)
+        return 1;
+    uint32_t account_number = id_index.buckets[hash_national_id(national_id) & (id_index.n_of_buckets - 1)];
+    for (; account_number != 0; account_number = id_index.next[account_number]){
+        if (strncmp(store_cold(account_number)->national_id, national_id, LENGTH_OF_NATIONAL_ID) == 0){
+            *owner = account_number;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+uint32_t cache_bucket(uint32_t account_number){
+    return (account_number * 2654435761u) & (account_cache.n_of_buckets - 1);
+}
+
+cache_entry_t* cache_find(uint32_t account_number){
+    if (account_cache.count == 0)
+        return NULL;
+    for (uint32_t bucket = cache_bucket(account_number); account_cache.buckets[bucket] != 0;
+         bucket = (bucket + 1) & (account_cache.n_of_buckets - 1)){
+        cache_entry_t* entry = &account_cache.entries[account_cache.buckets[bucket] - 1];
+        if (entry->account.account_number == account_number)
+            return entry;
+    }
+    return NULL;
+}
+
+void cache_link(uint32_t position){
+    uint32_t bucket = cache_bucket(account_cache.entries[position].account.account_number);
+    while (account_cache.buckets[bucket] != 0)
+        bucket = (bucket + 1) & (account_cache.n_of_buckets - 1);
+    account_cache.buckets[bucket] = position + 1;
+}
+
+// removes the bucket of an entry, shifting later members of its probe run back into the gap
+void cache_unlink(uint32_t position){
+    uint32_t mask = account_cache.n_of_buckets - 1;
+    uint32_t gap = cache_bucket(account_cache.entries[position].account.account_number);
+    while (account_cache.buckets[gap] != position + 1)
+        gap = (gap + 1) & mask;
+    for (uint32_t bucket = (gap + 1) & mask; account_cache.buckets[bucket] != 0; bucket = (bucket + 1) & mask){
+        uint32_t home = cache_bucket(account_cache.entries[account_cache.buckets[bucket] - 1].account.account_number);
+        // entries whose home lies cyclically in (gap, bucket] stay where they are
+        if (((bucket - home) & mask) < ((bucket - gap) & mask))
+            continue;
+        account_cache.buckets[gap] = account_cache.buckets[bucket];
+        gap = bucket;
+    }
+    account_cache.buckets[gap] = 0;
+}
+
+// mapped pages can reach the disk at any time, so a dirty entry stays in the cache until the journal
+// record of its operation has been fsynced
+bool cache_entry_unsynced(const cache_entry_t* entry){
+    return entry->dirty && entry->sequence >= journal.synced_sequence;
+}
+
+void cache_write_entry(cache_entry_t* entry){
+    if (!entry->dirty || cache_entry_unsynced(entry))
+        return;
+    store_set(entry->account.account_number, &entry->account);
+    entry->dirty = false;
+    account_cache.n_of_write_backs++;
+}
+
+// puts account into the cache, evicting with the CLOCK hand once it is full; NULL when every
+// entry is waiting for the journal to be synced
+cache_entry_t* cache_insert(const acc_t* account, bool dirty){
+    uint32_t position = account_cache.count;
+    if (account_cache.count == account_cache.capacity){
+        uint32_t n_of_unsynced = 0; // passed in a row, a whole round of them means there is no victim
+        while (account_cache.entries[account_cache.hand].referenced || cache_entry_unsynced(&account_cache.entries[account_cache.hand])){
+            if (!cache_entry_unsynced(&account_cache.entries[account_cache.hand]))
+                n_of_unsynced = 0;
+            else if (++n_of_unsynced == account_cache.capacity)
+                return NULL;
+            account_cache.entries[account_cache.hand].referenced = false;
+            account_cache.hand = (account_cache.hand + 1) % account_cache.capacity;
+        }
+        position = account_cache.hand;
+        account_cache.hand = (account_cache.hand + 1) % account_cache.capacity;
+        cache_write_entry(&account_cache.entries[position]);
+        cache_unlink(position);
+        account_cache.n_of_evictions++;
+    } else {
+        account_cache.count++;
+    }
+    cache_entry_t* entry = &account_cache.entries[position];
+    *entry = (cache_entry_t){*account, journal.next_sequence, dirty, true};
+    cache_link(position);
+    return entry;
+}
+
+// reads an account through the cache, or straight from the record file when the cache is off
+acc_t cache_get(uint32_t account_number){
+    if (account_cache.capacity == 0)
+        return store_get(account_number);
+    cache_entry_t* entry = cache_find(account_number);
+    if (entry != NULL){
+        account_cache.n_of_hits++;
+        entry->referenced = true;
+        return entry->account;
+    }
+    account_cache.n_of_misses++;
+    acc_t account = store_get(account_number);
+    cache_insert(&account, false);
+    return account;
+}
+
+// the cached copy when there is one, without touching the counters
+acc_t cache_peek(uint32_t account_number){
+    cache_entry_t* entry = account_cache.capacity == 0 ? NULL : cache_find(account_number);
+    return entry != NULL ? entry->account : store_get(account_number);
+}
+
+// records the after-image of the operation just journaled: kept dirty in the cache, or written to the file
+// when write_through is set (the caller has synced the journal then); fails while no entry can be evicted
+int cache_put(const acc_t* account, bool write_through){
+    cache_entry_t* entry = account_cache.capacity == 0 ? NULL : cache_find(account->account_number);
+    if (account_cache.capacity != 0 && entry == NULL && (entry = cache_insert(account, !write_through)) == NULL)
+        return 1;
+    if (write_through || account_cache.capacity == 0)
+        store_set(account->account_number, account);
+    if (account_cache.capacity == 0)
+        return 0;
+    entry->account = *account;
+    entry->sequence = journal.next_sequence - 1;
+    entry->dirty = !write_through;
+    entry->referenced = true;
+    return 0;
+}
+
+// brings the record file up to date, for the checkpoint and for readers that scan the file directly
+void cache_write_back(){
+    for (uint32_t i = 0; i < account_cache.count; i++)
+        cache_write_entry(&account_cache.entries[i]);
+}
+
+// writes back and empties the cache, before something else writes to the record file
+void cache_clear(){
+    cache_write_back();
+    if (account_cache.n_of_buckets != 0)
+        memset(account_cache.buckets, 0, (size_t)account_cache.n_of_buckets * sizeof(uint32_t));
+    account_cache.count = 0;
+    account_cache.hand = 0;
+}
+
+int cache_resize(uint32_t capacity){
+    if (capacity > ACCOUNT_CACHE_MAX_CAPACITY){
+        printf("Cache capacity must be at most %u accounts\n", ACCOUNT_CACHE_MAX_CAPACITY);
+        return 1;
+    }
+    cache_clear();
+    uint32_t n_of_buckets = 16;
+    while (n_of_buckets < capacity * 2)
+        n_of_buckets *= 2;
+    cache_entry_t* entries = realloc(account_cache.entries, (size_t)(capacity == 0 ? 1 : capacity) * sizeof(cache_entry_t));
+    uint32_t* buckets = entries == NULL ? NULL : calloc(n_of_buckets, sizeof(uint32_t));
+    if (buckets == NULL){
+        account_cache.entries = entries;
+        printf("Error resizing account cache\n");
+        return 1;
+    }
+    free(account_cache.buckets);
+    account_cache.entries = entries;
+    account_cache.buckets = buckets;
+    account_cache.n_of_buckets = n_of_buckets;
+    account_cache.capacity = capacity;
+    return 0;
+}
+
+void print_cache_stats(){
+    uint32_t n_of_dirty = 0;
+    for (uint32_t i = 0; i < account_cache.count; i++)
+        n_of_dirty += account_cache.entries[i].dirty;
+    uint64_t n_of_lookups = account_cache.n_of_hits + account_cache.n_of_misses;
+    printf("Account cache: capacity %u, %u cached, %u dirty\n", account_cache.capacity, account_cache.count, n_of_dirty);
+    printf("%llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu written back\n",
+           (unsigned long long)account_cache.n_of_hits, (unsigned long long)account_cache.n_of_misses,
+           n_of_lookups == 0 ? 0.0 : 100.0 * account_cache.n_of_hits / n_of_lookups,
+           (unsigned long long)account_cache.n_of_evictions, (unsigned long long)account_cache.n_of_write_backs);
+}
+
+int read_all_records(int view_mode){
+    if(view_mode != FULL_VIEW && view_mode != SHORT_VIEW){
+        printf("Invalid view mode\n");
+        return 1;
+    }
+    cache_write_back();
+    if (global_output_format == TABLE_OUTPUT)
+        print_table_header(view_mode);
+    else if (global_output_format == CSV_OUTPUT)
+        render_csv_header();
+    fflush(stdout); // stdio output has to reach the terminal before the buffered rows
+    for (uint32_t i = 0; i < store.n_of_slots; i++){
+        acc_t account = store_get(i);
+        // the null slot is part of the table view but not a record for csv/json consumers
+        if ((global_output_format != TABLE_OUTPUT && is_account_null(account)) || is_account_closed(&account))
+            continue;
+        render_account(&account, view_mode, global_output_format);
+    }
+    output_flush();
+    return 0;
+}
+
+int compare_order_key_entries(const void* a, const void* b){
+    return compare_order_keys(*(const order_key_t*)a, *(const order_key_t*)b);
+}
+
+// bulk load from the hot columns: sorted keys are cut into pages filled to three quarters,
+// leaving room for updates before the first splits
+int build_order_indexes(){
+    cache_write_back(); // dirty cached balances are newer than the file
+    clear_order_indexes();
+    order_key_t* keys = malloc((size_t)store.n_of_slots * sizeof(order_key_t));
+    if (keys == NULL){
+        printf("Error building balance index\n");
+        return 1;
+    }
+    for (int column = 0; column < N_OF_ORDER_INDEXES; column++){
+        uint32_t n_of_keys = 0;
+        for (uint32_t slot = 1; slot < store.n_of_slots; slot++){
+            if (slot == 1 || slot % STORE_BLOCK_SLOTS == 0)
+                store_check(slot);
+            const hot_t* hot = store_hot(slot);
+            // only closed and never used slots can be all zero without an identity
+            if (hot->curr_balance == 0 && hot->loan_balance == 0 && store_cold(slot)->national_id[0] == '\0')
+                continue;
+            keys[n_of_keys++] = (order_key_t){column == LOAN_COLUMN ? hot->loan_balance : hot->curr_balance, slot};
+        }
+        qsort(keys, n_of_keys, sizeof(order_key_t), compare_order_key_entries);
+        order_index_t* index = &order_indexes[column];
+        for (uint32_t i = 0; i < n_of_keys; i += ORDER_PAGE_KEYS * 3 / 4){
+            order_page_t* page = order_index_add_page(index, index->n_of_pages);
+            if (page == NULL){
+                printf("Error building balance index\n");
+                free(keys);
+                clear_order_indexes();
+                return 1;
+            }
+            page->count = n_of_keys - i < ORDER_PAGE_KEYS * 3 / 4 ? n_of_keys - i : ORDER_PAGE_KEYS * 3 / 4;
+            memcpy(page->keys, &keys[i], (size_t)page->count * sizeof(order_key_t));
+            index->count += page->count;
+        }
+    }
+    free(keys);
+    order_indexes_built = true;
+    return 0;
+}
+
+int ensure_order_indexes(){
+    return order_indexes_built ? 0 : build_order_indexes();
+}
+
+// "balance" or "loan" (plurals too) at the start of the text, end is left after the word
+int parse_order_column(char* text, int* column, char** end){
+    while (*text == ' ' || *text == '\t')
+        text++;
+    if (strncmp(text, "balance", 7) == 0)
+        *column = BALANCE_COLUMN;
+    else if (strncmp(text, "loan", 4) == 0)
+        *column = LOAN_COLUMN;
+    else
+        return 1;
+    *end = text + strcspn(text, " \t");
+    return 0;
+}
+
+int print_accounts(const uint32_t* accounts, uint32_t n_of_accounts, int view_mode){
+    if (view_mode != FULL_VIEW && view_mode != SHORT_VIEW){
+        printf("Invalid view mode\n");
+        return 1;
+    }
+    cache_write_back();
+    if (n_of_accounts == 0 && global_output_format == TABLE_OUTPUT)
+        printf("No matching accounts found\n");
+    else if (global_output_format == TABLE_OUTPUT)
+        print_table_header(view_mode);
+    else if (global_output_format == CSV_OUTPUT)
+        render_csv_header();
+    fflush(stdout); // stdio output has to reach the terminal before the buffered rows
+    for (uint32_t i = 0; i < n_of_accounts; i++){
+        acc_t account = store_get(accounts[i]);
+        render_account(&account, view_mode, global_output_format);
+    }
+    output_flush();
+    return 0;
+}
+
+// accounts with the column in [min, max], ascending by value then account number
+int print_order_range(int column, money_t min, money_t max){
+    if (ensure_order_indexes() != 0)
+        return 1;
+    const order_index_t* index = &order_indexes[column];
+    uint32_t* accounts = malloc((size_t)(index->count == 0 ? 1 : index->count) * sizeof(uint32_t));
+    if (accounts == NULL){
+        printf("Error collecting search results\n");
+        return 1;
+    }
+    uint32_t n_of_accounts = 0;
+    order_key_t first = {min, 0};
+    bool done = false;
+    for (uint32_t p = index->n_of_pages == 0 ? 0 : order_index_page(index, first); p < index->n_of_pages && !done; p++){
+        const order_page_t* page = index->pages[p];
+        for (uint32_t i = order_page_lower_bound(page, first); i < page->count; i++){
+            if (page->keys[i].value > max){
+                done = true;
+                break;
+            }
+            accounts[n_of_accounts++] = page->keys[i].account_number;
+        }
+    }
+    int result = print_accounts(accounts, n_of_accounts, global_view_mode);
+    free(accounts);
+    return result;
+}
+
+// the n accounts with the largest non-zero values, largest first
+int print_order_top(int column, uint32_t n){
+    if (ensure_order_indexes() != 0)
+        return 1;
+    const order_index_t* index = &order_indexes[column];
+    if (n > index->count)
+        n = index->count;
+    uint32_t* accounts = malloc((size_t)(n == 0 ? 1 : n) * sizeof(uint32_t));
+    if (accounts == NULL){
+        printf("Error collecting search results\n");
+        return 1;
+    }
+    uint32_t n_of_accounts = 0;
+    for (uint32_t p = index->n_of_pages; p > 0 && n_of_accounts < n; p--){
+        const order_page_t* page = index->pages[p - 1];
+        for (uint32_t i = page->count; i > 0 && n_of_accounts < n && page->keys[i - 1].value > 0; i--)
+            accounts[n_of_accounts++] = page->keys[i - 1].account_number;
+        if (page->count != 0 && page->keys[0].value <= 0)
+            break;
+    }
+    int result = print_accounts(accounts, n_of_accounts, global_view_mode);
+    free(accounts);
+    return result;
+}
+
+// one page of LIST_PAGE_SIZE accounts in ascending order of the column, pages count from 1;
+// whole leaf pages are skipped by their counts
+int print_order_page(int column, uint32_t page_number, int view_mode){
+    if (page_number == 0){
+        printf("Invalid page - pages count from 1\n");
+        return 1;
+    }
+    if (ensure_order_indexes() != 0)
+        return 1;
+    const order_index_t* index = &order_indexes[column];
+    uint64_t skip = (uint64_t)(page_number - 1) * LIST_PAGE_SIZE;
+    if (skip >= index->count && index->count != 0){
+        printf("Invalid page - %u accounts make %u pages\n", index->count, (index->count + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE);
+        return 1;
+    }
+    uint32_t accounts[LIST_PAGE_SIZE];
+    uint32_t n_of_accounts = 0;
+    for (uint32_t p = 0; p < index->n_of_pages && n_of_accounts < LIST_PAGE_SIZE; p++){
+        const order_page_t* page = index->pages[p];
+        if (skip >= page->count){
+            skip -= page->count;
+            continue;
+        }
+        for (uint32_t i = skip; i < page->count && n_of_accounts < LIST_PAGE_SIZE; i++)
+            accounts[n_of_accounts++] = page->keys[i].account_number;
+        skip = 0;
+    }
+    return print_accounts(accounts, n_of_accounts, view_mode);
+}
+
+// "list <view_mode> [balance|loan [page]]", without a column the whole file is listed in account order
+int list_command(char* arguments){
+    char* cursor;
+    int view_mode = strtol(arguments, &cursor, 10) + 1;
+    int column;
+    if (parse_order_column(cursor, &column, &cursor) != 0)
+        return read_all_records(view_mode);
+    long page_number = strtol(cursor, &cursor, 10);
+    return print_order_page(column, page_number == 0 ? 1 : page_number, view_mode);
+}
+
+// "search balance|loan <min> <max>"
+int search_order_range(int column, char* arguments){
+    money_t bounds[2];
+    for (int i = 0; i < 2; i++){
+        while (*arguments == ' ' || *arguments == '\t')
+            arguments++;
+        if (parse_money(arguments, &bounds[i], &arguments) != 0){
+            printf("Invalid amount - use search %s <min> <max> with at most %d decimals\n",
+                   column == LOAN_COLUMN ? "loan" : "balance", MONEY_DECIMALS);
+            return 1;
+        }
+    }
+    return print_order_range(column, bounds[0], bounds[1]);
+}
+
+// "top <balance|loan> [n]"
+int top_command(char* arguments){
+    int column;
+    if (parse_order_column(arguments, &column, &arguments) != 0){
+        printf("Unknown column - use top balance [n] or top loan [n]\n");
+        return 1;
+    }
+    char* end;
+    long n = strtol(arguments, &end, 10);
+    if (end == arguments)
+        n = DEFAULT_TOP_COUNT;
+    if (n < 1){
+        printf("Invalid count\n");
+        return 1;
+    }
+    if (n > (long)store.n_of_slots)
+        n = store.n_of_slots; // more than the book holds lists all of it
+    return print_order_top(column, n);
+}
+
+int compare_national_ids(const void* a, const void* b){
+    uint32_t account_a = *(const uint32_t*)a, account_b = *(const uint32_t*)b;
+    int cmp = strncmp(store_cold(account_a)->national_id, store_cold(account_b)->national_id, LENGTH_OF_NATIONAL_ID);
+    if (cmp != 0)
+        return cmp;
+    return (account_a > account_b) - (account_a < account_b);
+}
+
+// open accounts sharing a national ID with another, grouped by ID; they predate the uniqueness check
+// or were pasted over another account's data
+int dedupe_report(){
+    uint32_t* accounts = malloc((size_t)store.n_of_slots * sizeof(uint32_t));
+    if (accounts == NULL){
+        printf("Error collecting search results\n");
+        return 1;
+    }
+    uint32_t n_of_accounts = 0;
+    for (uint32_t slot = 1; slot < store.n_of_slots; slot++){
+        if (slot == 1 || slot % STORE_BLOCK_SLOTS == 0)
+            store_check(slot);
+        if (store_cold(slot)->national_id[0] != '\0')
+            accounts[n_of_accounts++] = slot;
+    }
+    qsort(accounts, n_of_accounts, sizeof(uint32_t), compare_national_ids);
+    uint32_t n_of_duplicates = 0, n_of_ids = 0;
+    for (uint32_t i = 0, run = 1; i < n_of_accounts; i += run){
+        for (run = 1; i + run < n_of_accounts &&
+                      strncmp(store_cold(accounts[i])->national_id, store_cold(accounts[i + run])->national_id, LENGTH_OF_NATIONAL_ID) == 0; run++)
+            ;
+        if (run == 1)
+            continue;
+        memmove(&accounts[n_of_duplicates], &accounts[i], (size_t)run * sizeof(uint32_t));
+        n_of_duplicates += run;
+        n_of_ids++;
+    }
+    int result = 0;
+    if (n_of_duplicates == 0)
+        printf("No national ID is shared by two accounts\n");
+    else
+        result = print_accounts(accounts, n_of_duplicates, global_view_mode);
+    if (n_of_duplicates != 0 && global_output_format == TABLE_OUTPUT)
+        printf("%u national IDs shared by %u accounts\n", n_of_ids, n_of_duplicates);
+    free(accounts);
+    return result;
+}
+
+uint32_t ledger_checksum(const ledger_entry_t* entry){
+    const uint8_t* bytes = (const uint8_t*)entry;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(ledger_entry_t, checksum); i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// the skip target heights of bitcoin's block index: any earlier height is reached in O(log n) hops
+uint32_t ledger_skip_height(uint32_t height){
+    if (height < 2)
+        return 0;
+    if (height & 1){
+        uint32_t even = (height - 1) & (height - 2);
+        return (even & (even - 1)) + 1;
+    }
+    return height & (height - 1);
+}
+
+int ledger_read(uint64_t entry_number, ledger_entry_t* entry){
+    if (entry_number >= ledger.n_of_entries){
+        *entry = ledger.chunk[entry_number - ledger.n_of_entries];
+        return 0;
+    }
+    if (pread(ledger.fd, entry, sizeof(*entry), (off_t)entry_number * sizeof(*entry)) != sizeof(*entry)){
+        printf("Error reading ledger\n");
+        return 1;
+    }
+    stats_count(STATS_LEDGER_READS, 1);
+    stats_count(STATS_LEDGER_BYTES_READ, sizeof(*entry));
+    return 0;
+}
+
+// link of the entry at the given height, walking back from the entry at link
+uint64_t ledger_ancestor(uint64_t link, uint32_t height){
+    ledger_entry_t walk;
+    if (ledger_read(link - 1, &walk) != 0)
+        return 0;
+    while (walk.height > height){
+        uint32_t skip_height = ledger_skip_height(walk.height);
+        uint32_t previous_skip_height = ledger_skip_height(walk.height - 1);
+        // the previous entry's skip can be the better hop when it lands closer without overshooting
+        if (walk.skip != 0 && (skip_height == height ||
+            (skip_height > height && !(previous_skip_height + 2 < skip_height && previous_skip_height >= height))))
+            link = walk.skip;
+        else
+            link = walk.previous;
+        if (ledger_read(link - 1, &walk) != 0)
+            return 0;
+    }
+    return link;
+}
+
+void ledger_unmap(){
+    if (ledger.index_mapping != NULL)
+        munmap(ledger.index_mapping, LEDGER_INDEX_HEADER_SIZE + (size_t)ledger.n_of_heads * sizeof(uint64_t));
+    ledger.index_mapping = NULL;
+    ledger.header = NULL;
+    ledger.heads = NULL;
+    ledger.n_of_heads = 0;
+}
+
+int ledger_map(uint32_t n_of_heads){
+    off_t size = LEDGER_INDEX_HEADER_SIZE + (off_t)n_of_heads * sizeof(uint64_t);
+    struct stat file_stat;
+    if (fstat(ledger.index_fd, &file_stat) != 0 || (file_stat.st_size < size && ftruncate(ledger.index_fd, size) != 0)){
+        printf("Error resizing ledger index\n");
+        return 1;
+    }
+    ledger_unmap();
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ledger.index_fd, 0);
+    if (mapping == MAP_FAILED){
+        printf("Error mapping ledger index\n");
+        return 1;
+    }
+    ledger.index_mapping = mapping;
+    ledger.header = mapping;
+    ledger.heads = (uint64_t*)(ledger.index_mapping + LEDGER_INDEX_HEADER_SIZE);
+    ledger.n_of_heads = n_of_heads;
+    return 0;
+}
+
+int ledger_reserve(uint32_t account_number){
+    if (account_number < ledger.n_of_heads)
+        return 0;
+    return ledger_map((account_number / LEDGER_INDEX_GROWTH + 1) * LEDGER_INDEX_GROWTH);
+}
+
+// latest entry of the account, including linked entries still waiting in the chunk
+uint64_t ledger_head(uint32_t account_number){
+    for (uint32_t i = ledger.n_of_chunk; i > 0; i--){
+        if (ledger.chunk[i - 1].account_number == account_number)
+            return ledger.n_of_entries + i;
+    }
+    return account_number < ledger.n_of_heads ? ledger.heads[account_number] : 0;
+}
+
+// heads move only once their entries are in the file, so they never point past its end
+int ledger_write_chunk(){
+    if (ledger.n_of_chunk == 0)
+        return 0;
+    size_t size = ledger.n_of_chunk * sizeof(ledger_entry_t);
+    if (write(ledger.fd, ledger.chunk, size) != (ssize_t)size){
+        printf("Error writing ledger\n");
+        return 1;
+    }
+    stats_count(STATS_LEDGER_WRITES, 1);
+    stats_count(STATS_LEDGER_BYTES_WRITTEN, size);
+    for (uint32_t i = 0; i < ledger.n_of_chunk; i++){
+        if (ledger_reserve(ledger.chunk[i].account_number) != 0)
+            return 1;
+        ledger.heads[ledger.chunk[i].account_number] = ledger.n_of_entries + i + 1;
+    }
+    ledger.n_of_entries += ledger.n_of_chunk;
+    ledger.header->n_of_entries = ledger.n_of_entries;
+    ledger.n_of_unsynced += ledger.n_of_chunk;
+    ledger.n_of_chunk = 0;
+    return 0;
+}
+
+// chains a stamped entry behind the account's latest one; an opening starts a chain of its own, so the
+// history of a number handed on after a close never leads back to the previous customer's entries
+int ledger_link(ledger_entry_t entry){
+    uint64_t head = entry.operation == LEDGER_OPEN ? 0 : ledger_head(entry.account_number);
+    entry.magic = LEDGER_MAGIC;
+    entry.height = 0;
+    entry.previous = head;
+    entry.skip = 0;
+    if (head != 0){
+        ledger_entry_t previous;
+        if (ledger_read(head - 1, &previous) != 0)
+            return 1;
+        entry.height = previous.height + 1;
+        entry.skip = ledger_ancestor(head, ledger_skip_height(entry.height));
+        if (entry.skip == 0)
+            return 1;
+    }
+    entry.checksum = ledger_checksum(&entry);
+    ledger.chunk[ledger.n_of_chunk++] = entry;
+    if (ledger.n_of_chunk == LEDGER_WRITE_CHUNK)
+        return ledger_write_chunk();
+    return 0;
+}
+
+uint64_t ledger_stamp(){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    // a clock stepped backwards must not break the ordering the searches rely on
+    if (timestamp < ledger.last_timestamp)
+        timestamp = ledger.last_timestamp;
+    ledger.last_timestamp = timestamp;
+    return timestamp;
+}
+
+ledger_entry_t ledger_entry(uint8_t operation, const acc_t* account, uint32_t counterparty, money_t balance_change, money_t loan_change){
+    ledger_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.account_number = account->account_number;
+    entry.counterparty = counterparty;
+    entry.balance_change = balance_change;
+    entry.loan_change = loan_change;
+    entry.curr_balance = account->curr_balance;
+    entry.loan_balance = account->loan_balance;
+    entry.operation = operation;
+    return entry;
+}
+
+// appends the entries of one committed operation in a single write, stamped and journaled along with it
+// by the caller; during a batch they are stamped here and held back with the working set, and only
+// reach the ledger if the batch is written back
+int ledger_record(const ledger_entry_t* entries, uint32_t n_of_entries){
+    if (working_set_active){
+        if (engine_running)
+            pthread_mutex_lock(&ledger.lock);
+        int result = 0;
+        for (uint32_t i = 0; i < n_of_entries && result == 0; i++){
+            // the bank's side is settled once when its shards are folded back
+            if (bank_sharded && entries[i].account_number == ROOT_BANK_ACCOUNT.account_number)
+                continue;
+            if (ledger.n_of_pending == ledger.pending_capacity){
+                ledger_entry_t* grown = realloc(ledger.pending, (size_t)(ledger.pending_capacity + INDEX_GROWTH) * sizeof(ledger_entry_t));
+                if (grown == NULL){
+                    printf("Error recording ledger entry\n");
+                    result = 1;
+                    break;
+                }
+                ledger.pending = grown;
+                ledger.pending_capacity += INDEX_GROWTH;
+            }
+            ledger.pending[ledger.n_of_pending] = entries[i];
+            ledger.pending[ledger.n_of_pending++].timestamp = ledger_stamp();
+        }
+        if (engine_running)
+            pthread_mutex_unlock(&ledger.lock);
+        return result;
+    }
+    for (uint32_t i = 0; i < n_of_entries; i++){
+        if (ledger_link(entries[i]) != 0)
+            return 1;
+    }
+    return ledger_write_chunk();
+}
+
+// entries of one operation share its time
+void ledger_stamp_entries(ledger_entry_t* entries, uint32_t n_of_entries){
+    uint64_t timestamp = n_of_entries == 0 ? 0 : ledger_stamp();
+    for (uint32_t i = 0; i < n_of_entries; i++)
+        entries[i].timestamp = timestamp;
+}
+
+int ledger_write_pending(){
+    int result = 0;
+    for (uint32_t i = 0; i < ledger.n_of_pending && result == 0; i++)
+        result = ledger_link(ledger.pending[i]);
+    if (result == 0)
+        result = ledger_write_chunk();
+    ledger.n_of_pending = 0;
+    return result;
+}
+
+void ledger_discard_pending(){
+    free(ledger.pending);
+    ledger.pending = NULL;
+    ledger.n_of_pending = 0;
+    ledger.pending_capacity = 0;
+}
+
+int ledger_flush(){
+    if (ledger.n_of_unsynced == 0)
+        return 0;
+    stats_count(STATS_FSYNCS, 1);
+    if (fdatasync(ledger.fd) != 0){
+        printf("Error flushing ledger\n");
+        return 1;
+    }
+    ledger.n_of_unsynced = 0;
+    return 0;
+}
+
+int ledger_sync(){
+    if (ledger.index_mapping == NULL)
+        return 0;
+    stats_count(STATS_MSYNCS, 1);
+    if (msync(ledger.index_mapping, LEDGER_INDEX_HEADER_SIZE + (size_t)ledger.n_of_heads * sizeof(uint64_t), MS_SYNC) != 0){
+        printf("Error flushing ledger index\n");
+        return 1;
+    }
+    return 0;
+}
+
+// opening costs O(1) when the index covers the whole ledger; entries written after it was last
+// updated are re-linked, and a torn entry at the tail is cut off
+int ledger_open(){
+    ledger.fd = open(LEDGER_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    ledger.index_fd = open(LEDGER_INDEX_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat ledger_stat, index_stat;
+    if (ledger.fd < 0 || ledger.index_fd < 0 || fstat(ledger.fd, &ledger_stat) != 0 || fstat(ledger.index_fd, &index_stat) != 0){
+        printf("Error opening ledger\n");
+        return 1;
+    }
+    uint32_t first_magic;
+    if (pread(ledger.fd, &first_magic, sizeof(first_magic), 0) == sizeof(first_magic) && first_magic == LEDGER_V3_MAGIC){
+        printf("Ledger uses the old format - run with --migrate\n");
+        return 1;
+    }
+    uint32_t n_of_heads = index_stat.st_size < LEDGER_INDEX_HEADER_SIZE ? 0 :
+                          (index_stat.st_size - LEDGER_INDEX_HEADER_SIZE) / sizeof(uint64_t);
+    if (ledger_map(n_of_heads) != 0)
+        return 1;
+    uint64_t n_of_entries = ledger_stat.st_size / sizeof(ledger_entry_t);
+    if (memcmp(ledger.header->magic, LEDGER_INDEX_MAGIC, sizeof(ledger.header->magic)) != 0 ||
+        ledger.header->n_of_entries > n_of_entries){
+        // a new or damaged index is rebuilt from the whole ledger
+        memset(ledger.index_mapping, 0, LEDGER_INDEX_HEADER_SIZE + (size_t)ledger.n_of_heads * sizeof(uint64_t));
+        memcpy(ledger.header->magic, LEDGER_INDEX_MAGIC, sizeof(ledger.header->magic));
+    }
+    ledger.n_of_entries = ledger.header->n_of_entries;
+    // read in chunks straight from the file, ledger_read would take entries past n_of_entries from the chunk
+    bool torn = false;
+    while (ledger.n_of_entries < n_of_entries && !torn){
+        uint64_t n = n_of_entries - ledger.n_of_entries < LEDGER_WRITE_CHUNK ? n_of_entries - ledger.n_of_entries : LEDGER_WRITE_CHUNK;
+        if (pread(ledger.fd, ledger.chunk, n * sizeof(ledger_entry_t), ledger.n_of_entries * sizeof(ledger_entry_t)) != (ssize_t)(n * sizeof(ledger_entry_t))){
+            printf("Error reading ledger\n");
+            return 1;
+        }
+        for (uint64_t i = 0; i < n && !torn; i++){
+            const ledger_entry_t* entry = &ledger.chunk[i];
+            torn = entry->magic != LEDGER_MAGIC || entry->checksum != ledger_checksum(entry);
+            if (torn)
+                break;
+            if (ledger_reserve(entry->account_number) != 0)
+                return 1;
+            ledger.heads[entry->account_number] = ++ledger.n_of_entries;
+        }
+    }
+    ledger.header->n_of_entries = ledger.n_of_entries;
+    ledger_entry_t entry;
+    if ((off_t)(ledger.n_of_entries * sizeof(ledger_entry_t)) != ledger_stat.st_size){
+        printf("Dropping %llu bytes of torn ledger entries\n",
+               (unsigned long long)(ledger_stat.st_size - ledger.n_of_entries * sizeof(ledger_entry_t)));
+        if (ftruncate(ledger.fd, ledger.n_of_entries * sizeof(ledger_entry_t)) != 0){
+            printf("Error trimming ledger\n");
+            return 1;
+        }
+    }
+    if (ledger.n_of_entries != 0){
+        if (ledger_read(ledger.n_of_entries - 1, &entry) != 0)
+            return 1;
+        ledger.last_timestamp = entry.timestamp;
+    }
+    return 0;
+}
+
+// history is meaningless once the accounts it refers to are gone
+int ledger_reset(){
+    if (ftruncate(ledger.fd, 0) != 0){
+        printf("Error truncating ledger\n");
+        return 1;
+    }
+    memset(ledger.heads, 0, (size_t)ledger.n_of_heads * sizeof(uint64_t));
+    ledger.n_of_entries = 0;
+    ledger.header->n_of_entries = 0;
+    ledger.n_of_chunk = 0;
+    ledger.n_of_unsynced = 0;
+    return ledger_sync();
+}
+
+void ledger_close(){
+    if (ledger.fd < 0)
+        return;
+    ledger_write_chunk();
+    ledger_flush();
+    ledger_sync();
+    ledger_unmap();
+    close(ledger.fd);
+    close(ledger.index_fd);
+    ledger.fd = ledger.index_fd = -1;
+}
+
+// latest entry of the account at or before the timestamp, 0 when it has none; skips are taken
+// whenever they still land after the timestamp, so the walk is logarithmic in the account's entries
+uint64_t ledger_find(uint32_t account_number, uint64_t timestamp, ledger_entry_t* entry){
+    uint64_t link = ledger_head(account_number);
+    uint32_t floor = 0; // the answer is known to be at or above this height
+    while (link != 0){
+        if (ledger_read(link - 1, entry) != 0)
+            return 0;
+        if (entry->timestamp <= timestamp)
+            return link;
+        uint32_t skip_height = ledger_skip_height(entry->height);
+        uint64_t next = entry->previous;
+        if (entry->skip != 0 && skip_height > floor && skip_height + 1 < entry->height){
+            ledger_entry_t skipped;
+            if (ledger_read(entry->skip - 1, &skipped) != 0)
+                return 0;
+            if (skipped.timestamp > timestamp)
+                next = entry->skip;
+            else
+                floor = skip_height;
+        }
+        link = next;
+    }
+    return 0;
+}
+
+// "YYYY-MM-DD[THH:MM[:SS]]" in local time, or seconds since the epoch; a bare date used as
+// an upper bound covers the whole day
+int parse_timestamp(const char* text, bool end_of_day, uint64_t* timestamp){
+    struct tm time_parts;
+    memset(&time_parts, 0, sizeof(time_parts));
+    char* endptr;
+    if (strchr(text, '-') == NULL){
+        long long seconds = strtoll(text, &endptr, 10);
+        if (endptr == text || seconds < 0)
+            return 1;
+        *timestamp = (uint64_t)seconds * 1000000 + (end_of_day ? 999999 : 0);
+        return 0;
+    }
+    int n = sscanf(text, "%d-%d-%dT%d:%d:%d", &time_parts.tm_year, &time_parts.tm_mon, &time_parts.tm_mday,
+                   &time_parts.tm_hour, &time_parts.tm_min, &time_parts.tm_sec);
+    if (n != 3 && n != 5 && n != 6)
+        return 1;
+    time_parts.tm_year -= 1900;
+    time_parts.tm_mon -= 1;
+    time_parts.tm_isdst = -1;
+    time_t seconds = mktime(&time_parts);
+    if (seconds == (time_t)-1)
+        return 1;
+    if (n == 3 && end_of_day)
+        seconds += 24 * 60 * 60 - 1;
+    *timestamp = (uint64_t)seconds * 1000000 + (end_of_day ? 999999 : 0);
+    return 0;
+}
+
+void format_ledger_time(uint64_t timestamp, char* text){
+    time_t seconds = timestamp / 1000000;
+    struct tm time_parts;
+    localtime_r(&seconds, &time_parts);
+    size_t n = strftime(text, LENGTH_OF_LEDGER_TIME + 1, "%Y-%m-%d %H:%M:%S", &time_parts);
+    snprintf(text + n, LENGTH_OF_LEDGER_TIME + 1 - n, ".%06u", (unsigned)(timestamp % 1000000));
+}
+
+void render_ledger_header(int format){
+    if (format == CSV_OUTPUT){
+        static const char header[] = "time,operation,counterparty,balance_change,loan_change,balance,loan_balance\n";
+        output_string(header, sizeof(header) - 1);
+    } else if (format == TABLE_OUTPUT){
+        printf("| %-*s | %-*s | %-*s | %-*s | %-*s | %-*s | %-*s |\n",
+               LENGTH_OF_LEDGER_TIME, "Time", LENGTH_OF_LEDGER_OPERATION, "Operation", LENGTH_OF_ACCOUNT_NUMBER, "Other side",
+               LENGTH_OF_BALANCE + 1, "Change", LENGTH_OF_LOAN_BALANCE + 1, "Loan change",
+               LENGTH_OF_BALANCE, "Balance", LENGTH_OF_LOAN_BALANCE, "Loan");
+        fflush(stdout);
+    }
+}
+
+void render_ledger_entry(const ledger_entry_t* entry, int format){
+    char time_text[LENGTH_OF_LEDGER_TIME + 1];
+    const char* operation = entry->operation < sizeof(LEDGER_OPERATIONS) / sizeof(LEDGER_OPERATIONS[0]) ?
+                            LEDGER_OPERATIONS[entry->operation] : "";
+    if (output_buffer.length + MAX_RENDERED_ROW > OUTPUT_BUFFER_SIZE)
+        output_flush();
+    format_ledger_time(entry->timestamp, time_text);
+    if (format == CSV_OUTPUT){
+        output_string(time_text, LENGTH_OF_LEDGER_TIME);
+        output_char(',');
+        output_csv_string(operation, LENGTH_OF_LEDGER_OPERATION);
+        output_char(',');
+        output_int(entry->counterparty, 1, 0);
+        output_char(',');
+        output_money(entry->balance_change, false, 0);
+        output_char(',');
+        output_money(entry->loan_change, false, 0);
+        output_char(',');
+        output_money(entry->curr_balance, false, 0);
+        output_char(',');
+        output_money(entry->loan_balance, false, 0);
+        output_char('\n');
+    } else if (format == JSON_OUTPUT){
+        output_string("{\"time\":", 8);
+        output_json_string(time_text, LENGTH_OF_LEDGER_TIME);
+        output_string(",\"operation\":", 13);
+        output_json_string(operation, LENGTH_OF_LEDGER_OPERATION);
+        output_string(",\"counterparty\":", 16);
+        output_int(entry->counterparty, 1, 0);
+        output_string(",\"balance_change\":", 18);
+        output_money(entry->balance_change, false, 0);
+        output_string(",\"loan_change\":", 15);
+        output_money(entry->loan_change, false, 0);
+        output_string(",\"balance\":", 11);
+        output_money(entry->curr_balance, false, 0);
+        output_string(",\"loan_balance\":", 16);
+        output_money(entry->loan_balance, false, 0);
+        output_string("}\n", 2);
+    } else {
+        output_string("| ", 2);
+        output_string(time_text, LENGTH_OF_LEDGER_TIME);
+        output_string(" | ", 3);
+        output_padded_string(operation, LENGTH_OF_LEDGER_OPERATION, LENGTH_OF_LEDGER_OPERATION);
+        output_string(" | ", 3);
+        output_int(entry->counterparty, LENGTH_OF_ACCOUNT_NUMBER, 0);
+        output_string(" | ", 3);
+        output_money(entry->balance_change, false, LENGTH_OF_BALANCE + 1);
+        output_string(" | ", 3);
+        output_money(entry->loan_change, false, LENGTH_OF_LOAN_BALANCE + 1);
+        output_string(" | ", 3);
+        output_money(entry->curr_balance, false, LENGTH_OF_BALANCE);
+        output_string(" | ", 3);
+        output_money(entry->loan_balance, false, LENGTH_OF_LOAN_BALANCE);
+        output_string(" |\n", 3);
+    }
+}
+
+uint32_t journal_checksum(const journal_record_t* record){
+    const uint8_t* bytes = (const uint8_t*)record;
+    uint32_t hash = 2166136261u; // FNV-1a over everything but the checksum itself
+    for (size_t i = 0; i < offsetof(journal_record_t, checksum); i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// the ledger is opened, flushed and closed along with the journal
+int journal_open(){
+    journal.fd = open(JOURNAL_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal.fd < 0){
+        printf("Error opening journal\n");
+        return 1;
+    }
+    return ledger_open();
+}
+
+int journal_sync(){
+    if (ledger_flush() != 0)
+        return 1;
+    if (journal.n_of_unsynced != 0){
+        stats_count(STATS_FSYNCS, 1);
+        if (fsync(journal.fd) != 0){
+            printf("Error flushing journal\n");
+            return 1;
+        }
+        journal.n_of_unsynced = 0;
+    }
+    journal.synced_sequence = journal.next_sequence;
+    return 0;
+}
+
+int journal_flush(){
+    uint64_t started = stats_clock();
+    int result = journal_sync();
+    stats_record(STATS_PROBE_JOURNAL_FLUSH, started, result);
+    return result;
+}
+
+// an operation has to be on disk before anything it changed is written into the mapped record file
+int journal_settle(uint64_t sequence){
+    return sequence < journal.synced_sequence ? 0 : journal_flush();
+}
+
+// records where replay has to start; written only after the blocks it vouches for are on disk
+int journal_mark_folded(uint64_t sequence, uint64_t offset){
+    if (store.header->journal_sequence == sequence && store.header->journal_offset == offset)
+        return 0;
+    store.header->journal_sequence = sequence;
+    store.header->journal_offset = offset;
+    stats_count(STATS_MSYNCS, 1);
+    if (msync(store.mapping, STORE_PAGE_SIZE, MS_SYNC) != 0){
+        printf("Error flushing record file\n");
+        return 1;
+    }
+    return 0;
+}
+
+// folds the journal into the record file; the journal itself is kept until the next snapshot
+// so that the snapshot plus the journal can rebuild the file
+int journal_checkpoint(){
+    if (journal_flush() != 0)
+        return 1;
+    cache_write_back();
+    if (store_sync() != 0 || ledger_sync() != 0)
+        return 1;
+    off_t offset = lseek(journal.fd, 0, SEEK_END);
+    if (offset < 0 || journal_mark_folded(journal.next_sequence, offset) != 0)
+        return 1;
+    journal.n_of_records = 0;
+    return 0;
+}
+
+int journal_truncate(){
+    if (ftruncate(journal.fd, 0) != 0){
+        printf("Error truncating journal\n");
+        return 1;
+    }
+    return journal_mark_folded(journal.next_sequence, 0);
+}
+
+// reaps the snapshot writer; a finished snapshot no longer needs the journal segment before it
+bool snapshot_running(bool wait){
+    if (snapshot_pid == 0)
+        return false;
+    int status;
+    pid_t pid = waitpid(snapshot_pid, &status, wait ? 0 : WNOHANG);
+    if (pid == 0)
+        return true;
+    snapshot_pid = 0;
+    if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        unlink(SNAPSHOT_JOURNAL_FILE);
+    else
+        printf("Snapshot failed - the previous snapshot is kept\n");
+    return false;
+}
+
+// runs in the forked child: the blocks are copied while the parent keeps writing them, so the copy
+// is fuzzy, but every change made after the fork is journaled and redone on recovery
+int snapshot_write(uint64_t sequence){
+    size_t size = STORE_HEADER_SIZE + (size_t)store.n_of_blocks * STORE_BLOCK_SIZE;
+    char header_page[STORE_PAGE_SIZE];
+    memcpy(header_page, store.mapping, STORE_PAGE_SIZE);
+    store_header_t* header = (store_header_t*)header_page;
+    header->clean = 0; // checksums are rehashed after recovery
+    header->journal_sequence = sequence;
+    header->journal_offset = 0;
+    int fd = open(SNAPSHOT_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+    size_t written = 0;
+    while (written < size){
+        const char* data = written < STORE_PAGE_SIZE ? header_page + written : store.mapping + written;
+        size_t length = written < STORE_PAGE_SIZE ? STORE_PAGE_SIZE - written : size - written;
+        ssize_t n = write(fd, data, length);
+        if (n <= 0){
+            close(fd);
+            return 1;
+        }
+        written += n;
+    }
+    if (fsync(fd) != 0 || close(fd) != 0)
+        return 1;
+    return rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) != 0;
+}
+
+// moves the journal so far aside: a new snapshot starts with an empty journal, and the old segment
+// stays until the snapshot is complete in case recovery still has to start from the previous one
+int snapshot_rotate_journal(){
+    if (access(SNAPSHOT_JOURNAL_FILE, F_OK) != 0){
+        if (rename(JOURNAL_FILE, SNAPSHOT_JOURNAL_FILE) != 0){
+            printf("Error rotating journal\n");
+            return 1;
+        }
+        close(journal.fd);
+        journal.fd = open(JOURNAL_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (journal.fd < 0){
+            printf("Error opening journal\n");
+            return 1;
+        }
+        return journal_mark_folded(journal.next_sequence, 0);
+    }
+    // the snapshot before this one never finished, its segment grows by this one
+    int fd = open(SNAPSHOT_JOURNAL_FILE, O_WRONLY | O_APPEND);
+    char buffer[1 << 16];
+    ssize_t n = fd < 0 ? -1 : 0;
+    off_t offset = 0;
+    while (fd >= 0 && (n = pread(journal.fd, buffer, sizeof(buffer), offset)) > 0){
+        if (write(fd, buffer, n) != n){
+            n = -1;
+            break;
+        }
+        offset += n;
+    }
+    if (n < 0 || fsync(fd) != 0){
+        printf("Error rotating journal\n");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    close(fd);
+    return journal_truncate();
+}
+
+// takes a consistent copy of the record file without holding up transactions: a checkpoint, then a
+// forked child writes the copy while this process carries on
+int snapshot_start(){
+    if (snapshot_running(false)){
+        printf("Snapshot already in progress\n");
+        return 1;
+    }
+    if (journal_checkpoint() != 0 || snapshot_rotate_journal() != 0)
+        return 1;
+    journal.n_of_retained = 0;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(snapshot_write(journal.next_sequence));
+    if (pid < 0){
+        printf("Error starting snapshot\n");
+        return 1;
+    }
+    snapshot_pid = pid;
+    return 0;
+}
+
+// history before a reset is of no use for recovering what comes after it
+int snapshot_discard(){
+    snapshot_running(true);
+    if ((unlink(SNAPSHOT_FILE) != 0 && errno != ENOENT) || (unlink(SNAPSHOT_JOURNAL_FILE) != 0 && errno != ENOENT)){
+        printf("Error removing snapshot\n");
+        return 1;
+    }
+    journal.n_of_retained = 0;
+    return journal_truncate();
+}
+
+// copies the next length bytes of source into a new file at path
+int snapshot_copy_part(int source, const char* path, off_t length){
+    int target = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char buffer[1 << 16];
+    ssize_t n = target < 0 ? -1 : 0;
+    while (target >= 0 && length > 0 && (n = read(source, buffer, length < (off_t)sizeof(buffer) ? length : (off_t)sizeof(buffer))) > 0){
+        if (write(target, buffer, n) != n){
+            n = -1;
+            break;
+        }
+        length -= n;
+    }
+    if (target >= 0 && (fsync(target) != 0 || close(target) != 0))
+        n = -1;
+    return n < 0;
+}
+
+// replaces the record file with the latest snapshot, keeping the damaged one aside; the snapshot is one
+// image of the mapping and is cut back into shard files here. journal_replay then redoes everything
+// journaled since the snapshot began
+int snapshot_restore(){
+    int owner = open(RECORD_FILE, O_RDWR);
+    if (owner >= 0 && store_lock(owner) != 0){
+        close(owner);
+        return 1;
+    }
+    if (owner >= 0)
+        close(owner);
+    int source = open(SNAPSHOT_FILE, O_RDONLY);
+    if (source < 0){
+        printf("No snapshot to recover from\n");
+        return 1;
+    }
+    store_header_t header;
+    struct stat file_stat;
+    int result = fstat(source, &file_stat) != 0 || pread(source, &header, sizeof(header), 0) != sizeof(header);
+    off_t shard_size = 0;
+    if (result == 0)
+        shard_size = header.shard_blocks == 0 ? (off_t)file_stat.st_size : (off_t)header.shard_blocks * (off_t)STORE_BLOCK_SIZE;
+    store_remove(RECORD_FILE ".recovering");
+    if (result == 0)
+        result = snapshot_copy_part(source, RECORD_FILE ".recovering", STORE_HEADER_SIZE + shard_size);
+    char path[STORE_PATH_LENGTH];
+    for (uint32_t shard = 1; result == 0 && lseek(source, 0, SEEK_CUR) < file_stat.st_size; shard++){
+        store_shard_path(RECORD_FILE ".recovering", shard, path);
+        result = snapshot_copy_part(source, path, shard_size);
+    }
+    close(source);
+    if (result != 0){
+        printf("Error restoring snapshot\n");
+        return 1;
+    }
+    if ((store_rename(RECORD_FILE, RECORD_FILE ".damaged") != 0 && errno != ENOENT) || store_rename(RECORD_FILE ".recovering", RECORD_FILE) != 0){
+        printf("Error restoring snapshot\n");
+        return 1;
+    }
+    printf("Record file restored from the latest snapshot, the previous one kept as %s\n", RECORD_FILE ".damaged");
+    return 0;
+}
+
+// periodic upkeep after a commit
+int journal_maintain(){
+    bool snapshot_in_progress = snapshot_running(false);
+    if (journal.n_of_retained >= SNAPSHOT_INTERVAL_RECORDS && !snapshot_in_progress)
+        return snapshot_start();
+    if (journal.n_of_records >= JOURNAL_CHECKPOINT_RECORDS)
+        return journal_checkpoint();
+    return 0;
+}
+
+// journals one operation; its after-images and then its ledger entries are spread over as many records
+// as needed, all but the last flagged JOURNAL_CONTINUES so replay only redoes whole operations. The entries
+// are about to be linked behind the ledger's last one, their records note where that puts them
+int journal_append(const acc_t* accounts, uint32_t n_of_accounts, const ledger_entry_t* entries, uint32_t n_of_entries){
+    static journal_record_t records[JOURNAL_WRITE_CHUNK];
+    if (n_of_accounts == 0 && n_of_entries == 0)
+        return 0;
+    uint32_t n_of_image_records = (n_of_accounts + JOURNAL_MAX_ACCOUNTS - 1) / JOURNAL_MAX_ACCOUNTS;
+    uint32_t n_of_records = n_of_image_records + (n_of_entries + JOURNAL_MAX_ACCOUNTS - 1) / JOURNAL_MAX_ACCOUNTS;
+    uint64_t ledger_position = ledger.n_of_entries + ledger.n_of_chunk;
+    uint32_t written = 0;
+    while (written < n_of_records){
+        uint32_t chunk = n_of_records - written < JOURNAL_WRITE_CHUNK ? n_of_records - written : JOURNAL_WRITE_CHUNK;
+        for (uint32_t i = 0; i < chunk; i++){
+            journal_record_t* record = &records[i];
+            memset(record, 0, sizeof(*record));
+            record->magic = JOURNAL_MAGIC;
+            record->sequence = journal.next_sequence;
+            record->flags = written + i + 1 < n_of_records ? JOURNAL_CONTINUES : 0;
+            if (written + i < n_of_image_records){
+                uint32_t first = (written + i) * JOURNAL_MAX_ACCOUNTS;
+                record->n_of_accounts = n_of_accounts - first < JOURNAL_MAX_ACCOUNTS ? n_of_accounts - first : JOURNAL_MAX_ACCOUNTS;
+                memcpy(record->accounts, &accounts[first], record->n_of_accounts * sizeof(acc_t));
+            } else {
+                uint32_t first = (written + i - n_of_image_records) * JOURNAL_MAX_ACCOUNTS;
+                record->n_of_accounts = n_of_entries - first < JOURNAL_MAX_ACCOUNTS ? n_of_entries - first : JOURNAL_MAX_ACCOUNTS;
+                record->flags |= JOURNAL_LEDGER;
+                record->ledger_position = ledger_position + first;
+                memcpy(record->entries, &entries[first], record->n_of_accounts * sizeof(ledger_entry_t));
+            }
+            record->checksum = journal_checksum(record);
+        }
+        // a single write keeps a record whole even if the process dies right after it
+        if (write(journal.fd, records, chunk * sizeof(journal_record_t)) != (ssize_t)(chunk * sizeof(journal_record_t))){
+            printf("Error writing journal\n");
+            return 1;
+        }
+        stats_count(STATS_JOURNAL_WRITES, 1);
+        stats_count(STATS_JOURNAL_BYTES, chunk * sizeof(journal_record_t));
+        written += chunk;
+    }
+    journal.next_sequence++;
+    journal.n_of_records += n_of_records;
+    journal.n_of_retained += n_of_records;
+    journal.n_of_unsynced += n_of_records;
+    // outside a server round the operation is acknowledged as soon as it returns
+    if (!journal_group_commit || journal.n_of_unsynced >= JOURNAL_GROUP_COMMIT)
+        return journal_flush();
+    return 0;
+}
+
+// writes an after-image into its slot, extending the store when it is the next account
+int store_put(const acc_t* account){
+    if (account->account_number == store.n_of_slots)
+        return store_append(account);
+    if (account->account_number == 0 || account->account_number > store.n_of_slots){
+        printf("Error finding account - id possibly out of range\n");
+        return 1;
+    }
+    store_set(account->account_number, account);
+    return 0;
+}
+
+// gathers the after-images of every complete operation from offset on that is not older than
+// min_sequence, and the ledger entries of any complete operation that the ledger file stops short of;
+// a torn or unfinished operation at the tail never committed
+int journal_collect(int fd, off_t offset, uint64_t min_sequence, replay_t* replay){
+    journal_record_t record;
+    uint32_t first_pending = replay->n_of_images, first_pending_entry = replay->n_of_entries;
+    if (lseek(fd, offset, SEEK_SET) != offset){
+        printf("Error reading journal\n");
+        return 1;
+    }
+    while (read(fd, &record, sizeof(record)) == sizeof(record)){
+        if (record.magic != JOURNAL_MAGIC || record.n_of_accounts > JOURNAL_MAX_ACCOUNTS ||
+            record.checksum != journal_checksum(&record))
+            break;
+        if (record.flags & JOURNAL_LEDGER){
+            for (uint32_t i = 0; i < record.n_of_accounts; i++){
+                if (record.ledger_position + i < ledger.n_of_entries)
+                    continue; // written before the process stopped
+                if (replay->n_of_entries == replay->entries_capacity){
+                    ledger_entry_t* grown = realloc(replay->entries, (size_t)(replay->entries_capacity + INDEX_GROWTH) * sizeof(ledger_entry_t));
+                    if (grown == NULL){
+                        printf("Error replaying journal\n");
+                        return 1;
+                    }
+                    replay->entries = grown;
+                    replay->entries_capacity += INDEX_GROWTH;
+                }
+                replay->entries[replay->n_of_entries++] = record.entries[i];
+            }
+        } else {
+            if (replay->n_of_images + record.n_of_accounts > replay->capacity){
+                acc_t* grown = realloc(replay->images, (size_t)(replay->capacity + INDEX_GROWTH) * sizeof(acc_t));
+                if (grown == NULL){
+                    printf("Error replaying journal\n");
+                    return 1;
+                }
+                replay->images = grown;
+                replay->capacity += INDEX_GROWTH;
+            }
+            memcpy(&replay->images[replay->n_of_images], record.accounts, record.n_of_accounts * sizeof(acc_t));
+            replay->n_of_images += record.n_of_accounts;
+        }
+        if (record.flags & JOURNAL_CONTINUES)
+            continue;
+        first_pending_entry = replay->n_of_entries;
+        if (record.sequence < min_sequence){
+            replay->n_of_images = first_pending; // already in the record file
+            continue;
+        }
+        first_pending = replay->n_of_images;
+        replay->n_of_operations++;
+        replay->next_sequence = record.sequence + 1;
+    }
+    replay->n_of_images = first_pending;
+    replay->n_of_entries = first_pending_entry;
+    return 0;
+}
+
+void* replay_worker_main(void* arg){
+    replay_worker_t* worker = arg;
+    const replay_t* replay = worker->replay;
+    for (uint32_t i = 0; i < replay->n_of_images; i++){
+        uint32_t account_number = replay->images[i].account_number;
+        if (account_number / STORE_BLOCK_SLOTS % worker->n_of_workers == worker->id)
+            store_set(account_number, &replay->images[i]);
+    }
+    return NULL;
+}
+
+// redoes the gathered operations; the images are partitioned by the block their account lives in,
+// so every block and its checksum has a single writer and each account's images stay in journal order
+int journal_apply(const replay_t* replay){
+    // accounts added since the file was written are appended in order first, the workers only overwrite
+    for (uint32_t i = 0; i < replay->n_of_images; i++){
+        uint32_t account_number = replay->images[i].account_number;
+        if (account_number == 0 || account_number > store.n_of_slots){
+            printf("Error finding account - id possibly out of range\n");
+            return 1;
+        }
+        if (account_number == store.n_of_slots && store_append(&replay->images[i]) != 0)
+            return 1;
+    }
+    if (replay->n_of_images == 0)
+        return 0;
+    store_mark_dirty();
+    long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_of_workers = n_of_cpus < 1 ? 1 : n_of_cpus > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : n_of_cpus;
+    if (n_of_workers > replay->n_of_images / REPLAY_PARALLEL_MIN + 1)
+        n_of_workers = replay->n_of_images / REPLAY_PARALLEL_MIN + 1;
+    replay_worker_t workers[MAX_WORKER_THREADS];
+    uint32_t n_of_started = 1;
+    for (uint32_t i = 0; i < n_of_workers; i++)
+        workers[i] = (replay_worker_t){0, replay, i, n_of_workers};
+    for (; n_of_started < n_of_workers; n_of_started++){
+        if (pthread_create(&workers[n_of_started].thread, NULL, replay_worker_main, &workers[n_of_started]) != 0)
+            break;
+    }
+    // partitions without a thread of their own are redone here
+    for (uint32_t i = 0; i < n_of_workers; i++){
+        if (i == 0 || i >= n_of_started)
+            replay_worker_main(&workers[i]);
+    }
+    for (uint32_t i = 1; i < n_of_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    return 0;
+}
+
+// links the ledger entries that were journaled but never reached the ledger file, in their original order
+int journal_restore_ledger(const replay_t* replay){
+    for (uint32_t i = 0; i < replay->n_of_entries; i++){
+        if (ledger_link(replay->entries[i]) != 0)
+            return 1;
+        if (replay->entries[i].timestamp > ledger.last_timestamp)
+            ledger.last_timestamp = replay->entries[i].timestamp;
+    }
+    if (replay->n_of_entries != 0)
+        printf("Restored %u ledger entries from the journal\n", replay->n_of_entries);
+    return ledger_write_chunk();
+}
+
+// redoes every operation the record file may not hold yet: the segment kept for an unfinished snapshot,
+// if any, and the current journal from where the last checkpoint left it (all of it after a restore)
+int journal_replay(){
+    replay_t replay = {NULL, 0, 0, NULL, 0, 0, 0, store.header->journal_sequence};
+    uint64_t min_sequence = store.header->journal_sequence;
+    struct stat journal_stat, previous_stat;
+    int result = fstat(journal.fd, &journal_stat) != 0;
+    int previous_fd = open(SNAPSHOT_JOURNAL_FILE, O_RDONLY);
+    journal.n_of_retained = result == 0 ? journal_stat.st_size / sizeof(journal_record_t) : 0;
+    if (previous_fd >= 0){
+        if (result == 0 && fstat(previous_fd, &previous_stat) == 0)
+            journal.n_of_retained += previous_stat.st_size / sizeof(journal_record_t);
+        result = result || journal_collect(previous_fd, 0, min_sequence, &replay);
+        close(previous_fd);
+    }
+    off_t offset = result == 0 && (off_t)store.header->journal_offset <= journal_stat.st_size ? (off_t)store.header->journal_offset : 0;
+    result = result || journal_collect(journal.fd, offset, min_sequence, &replay) || journal_apply(&replay) ||
+             journal_restore_ledger(&replay);
+    free(replay.images);
+    free(replay.entries);
+    if (result != 0)
+        return 1;
+    journal.next_sequence = replay.next_sequence;
+    if (replay.n_of_operations != 0){
+        printf("Replayed %u journaled operations\n", replay.n_of_operations);
+        store.free_list_trusted = false; // replayed closes never reached the list
+    }
+    return journal_checkpoint();
+}
+
+void journal_close(){
+    if (journal.fd < 0)
+        return;
+    snapshot_running(true);
+    journal_checkpoint();
+    close(journal.fd);
+    journal.fd = -1;
+    ledger_close();
+}
+
+// money was held in whole units in 32 bits and rates as doubles up to format v3
+acc_t account_from_v3(const acc_v3_t* old){
+    acc_t account = NULL_ACCOUNT;
+    account.account_number = old->account_number;
+    memcpy(account.name, old->name, sizeof(account.name));
+    memcpy(account.surname, old->surname, sizeof(account.surname));
+    memcpy(account.address, old->address, sizeof(account.address));
+    memcpy(account.national_id, old->national_id, sizeof(account.national_id));
+    account.curr_balance = (money_t)old->curr_balance * MONEY_SCALE;
+    account.loan_balance = (money_t)old->loan_balance * MONEY_SCALE;
+    double scaled_rate = old->interest_rate * RATE_SCALE;
+    account.interest_rate = (rate_t)(scaled_rate < 0 ? scaled_rate - 0.5 : scaled_rate + 0.5);
+    return account;
+}
+
+uint32_t journal_v3_checksum(const journal_record_v3_t* record){
+    const uint8_t* bytes = (const uint8_t*)record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(journal_record_v3_t, checksum); i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t ledger_v3_checksum(const ledger_entry_v3_t* entry){
+    const uint8_t* bytes = (const uint8_t*)entry;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(ledger_entry_v3_t, checksum); i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// appends every intact record of an old journal converted to the current layout, sequences and flags unchanged;
+// replay skips whatever the migrated record file already holds, as it did before
+int journal_convert_v3(const char* path, int fd, uint32_t* n_of_records){
+    int old_fd = open(path, O_RDONLY);
+    if (old_fd < 0)
+        return errno != ENOENT;
+    journal_record_v3_t old;
+    journal_record_t record;
+    int result = 0;
+    while (result == 0 && read(old_fd, &old, sizeof(old)) == sizeof(old)){
+        if (old.magic != JOURNAL_MAGIC || old.n_of_accounts > JOURNAL_MAX_ACCOUNTS || old.checksum != journal_v3_checksum(&old))
+            break;
+        memset(&record, 0, sizeof(record));
+        record.magic = JOURNAL_MAGIC;
+        record.n_of_accounts = old.n_of_accounts;
+        record.sequence = old.sequence;
+        for (uint32_t i = 0; i < old.n_of_accounts; i++)
+            record.accounts[i] = account_from_v3(&old.accounts[i]);
+        record.flags = old.flags;
+        record.checksum = journal_checksum(&record);
+        result = write(fd, &record, sizeof(record)) != sizeof(record);
+        (*n_of_records)++;
+    }
+    close(old_fd);
+    return result;
+}
+
+// the segment kept for an unfinished snapshot and the current journal become one journal in the new layout;
+// the old snapshot cannot be restored into the new format and goes with them
+int journal_migrate(){
+    int fd = open(JOURNAL_FILE ".migrating", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint32_t n_of_records = 0;
+    if (fd < 0 || journal_convert_v3(SNAPSHOT_JOURNAL_FILE, fd, &n_of_records) != 0 ||
+        journal_convert_v3(JOURNAL_FILE, fd, &n_of_records) != 0 || fsync(fd) != 0){
+        printf("Error converting journal\n");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    close(fd);
+    bool kept = rename(JOURNAL_FILE, JOURNAL_FILE ".v3") == 0;
+    if ((!kept && errno != ENOENT) || rename(JOURNAL_FILE ".migrating", JOURNAL_FILE) != 0 ||
+        (unlink(SNAPSHOT_JOURNAL_FILE) != 0 && errno != ENOENT) || (unlink(SNAPSHOT_FILE) != 0 && errno != ENOENT)){
+        printf("Error replacing journal\n");
+        return 1;
+    }
+    if (kept)
+        printf("Converted %u journal records, original journal kept as %s\n", n_of_records, JOURNAL_FILE ".v3");
+    return 0;
+}
+
+// rewrites the ledger with 64-bit money; links are entry numbers and carry over unchanged, and the
+// index is rebuilt from the new file when the ledger is next opened
+int ledger_migrate(){
+    int old_fd = open(LEDGER_FILE, O_RDONLY);
+    uint32_t first_magic;
+    if (old_fd < 0)
+        return errno != ENOENT;
+    if (pread(old_fd, &first_magic, sizeof(first_magic), 0) != sizeof(first_magic) || first_magic != LEDGER_V3_MAGIC){
+        close(old_fd);
+        return 0;
+    }
+    int fd = open(LEDGER_FILE ".migrating", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ledger_entry_v3_t old;
+    ledger_entry_t entry;
+    uint64_t n_of_entries = 0;
+    int result = fd < 0;
+    while (result == 0 && read(old_fd, &old, sizeof(old)) == sizeof(old)){
+        if (old.magic != LEDGER_V3_MAGIC || old.checksum != ledger_v3_checksum(&old))
+            break; // torn tail, ledger_open would have cut it off
+        memset(&entry, 0, sizeof(entry));
+        entry.magic = LEDGER_MAGIC;
+        entry.account_number = old.account_number;
+        entry.timestamp = old.timestamp;
+        entry.previous = old.previous;
+        entry.skip = old.skip;
+        entry.height = old.height;
+        entry.counterparty = old.counterparty;
+        entry.balance_change = (money_t)old.balance_change * MONEY_SCALE;
+        entry.loan_change = (money_t)old.loan_change * MONEY_SCALE;
+        entry.curr_balance = (money_t)old.curr_balance * MONEY_SCALE;
+        entry.loan_balance = (money_t)old.loan_balance * MONEY_SCALE;
+        entry.operation = old.operation;
+        entry.checksum = ledger_checksum(&entry);
+        result = write(fd, &entry, sizeof(entry)) != sizeof(entry);
+        n_of_entries++;
+    }
+    close(old_fd);
+    if (result != 0 || fsync(fd) != 0){
+        printf("Error converting ledger\n");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    close(fd);
+    if (rename(LEDGER_FILE, LEDGER_FILE ".v3") != 0 || rename(LEDGER_FILE ".migrating", LEDGER_FILE) != 0 ||
+        (unlink(LEDGER_INDEX_FILE) != 0 && errno != ENOENT)){
+        printf("Error replacing ledger\n");
+        return 1;
+    }
+    printf("Converted %llu ledger entries, original ledger kept as %s\n", (unsigned long long)n_of_entries, LEDGER_FILE ".v3");
+    return 0;
+}
+
+// converts a record file in an older layout - the original raw account array, format v2 which had
+// no checksum table, or format v3 which held money in whole units - into the current format, keeping
+// the original next to it as RECORD_FILE ".v<n>"; the journal and ledger are converted along with it
+int store_migrate(){
+    int old_fd = open(RECORD_FILE, O_RDWR);
+    struct stat file_stat;
+    if (old_fd < 0 || fstat(old_fd, &file_stat) != 0){
+        printf("Error opening file\n");
+        return 1;
+    }
+    if (store_lock(old_fd) != 0){
+        close(old_fd);
+        return 1;
+    }
+    store_header_t old_header;
+    bool has_header = pread(old_fd, &old_header, sizeof(old_header), 0) == sizeof(old_header) &&
+                      memcmp(old_header.magic, STORE_MAGIC, sizeof(old_header.magic)) == 0;
+    if (has_header && old_header.version == STORE_FORMAT_VERSION){
+        printf("Record file is already in the current layout\n");
+        close(old_fd);
+        return 0;
+    }
+    size_t old_header_size = !has_header ? 0 : old_header.version == 2 ? STORE_V2_HEADER_SIZE : STORE_HEADER_SIZE;
+    if (has_header && ((old_header.version != 2 && old_header.version != 3) || old_header.block_slots != STORE_BLOCK_SLOTS ||
+                       (off_t)old_header_size > file_stat.st_size ||
+                       old_header.n_of_slots > (file_stat.st_size - old_header_size) / STORE_V3_BLOCK_SIZE * STORE_BLOCK_SLOTS)){
+        printf("Unsupported record file format version %u\n", old_header.version);
+        close(old_fd);
+        return 1;
+    }
+    const char* old_path = !has_header ? RECORD_FILE ".v1" : old_header.version == 2 ? RECORD_FILE ".v2" : RECORD_FILE ".v3";
+    uint32_t n_of_old_slots = has_header ? old_header.n_of_slots : file_stat.st_size / sizeof(acc_v3_t);
+    char* old_mapping = file_stat.st_size == 0 ? NULL : mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, old_fd, 0);
+    close(old_fd);
+    if (old_mapping == MAP_FAILED){
+        printf("Error mapping record file\n");
+        return 1;
+    }
+    store_remove(RECORD_FILE ".migrating");
+    if (store_open_path(RECORD_FILE ".migrating") != 0){
+        if (old_mapping != NULL)
+            munmap(old_mapping, file_stat.st_size);
+        return 1;
+    }
+    store_truncate(0);
+    uint32_t n_of_used_slots = 0;
+    for (uint32_t slot = 0; slot < n_of_old_slots; slot++){
+        acc_v3_t old;
+        if (has_header){
+            char* block = old_mapping + old_header_size + (size_t)(slot / STORE_BLOCK_SLOTS) * STORE_V3_BLOCK_SIZE;
+            const hot_v3_t* hot = (const hot_v3_t*)block + slot % STORE_BLOCK_SLOTS;
+            const cold_t* cold = (const cold_t*)(block + STORE_BLOCK_SLOTS * sizeof(hot_v3_t)) + slot % STORE_BLOCK_SLOTS;
+            old.account_number = hot->account_number;
+            old.curr_balance = hot->curr_balance;
+            old.loan_balance = hot->loan_balance;
+            old.interest_rate = hot->interest_rate;
+            memcpy(old.name, cold->name, sizeof(old.name));
+            memcpy(old.surname, cold->surname, sizeof(old.surname));
+            memcpy(old.address, cold->address, sizeof(old.address));
+            memcpy(old.national_id, cold->national_id, sizeof(old.national_id));
+        } else {
+            memcpy(&old, old_mapping + (size_t)slot * sizeof(acc_v3_t), sizeof(acc_v3_t));
+        }
+        acc_t account = account_from_v3(&old);
+        if (store_append(&account) != 0){
+            munmap(old_mapping, file_stat.st_size);
+            store_close();
+            return 1;
+        }
+        // trailing NULL_ACCOUNT slots are growth padding, not records
+        if (!is_account_null(account) || store.n_of_slots == 1)
+            n_of_used_slots = store.n_of_slots;
+    }
+    if (old_mapping != NULL)
+        munmap(old_mapping, file_stat.st_size);
+    if (n_of_used_slots == 0)
+        store_append(&NULL_ACCOUNT);
+    else
+        store_truncate(n_of_used_slots);
+    store_rebuild_free_list();
+    // the converted journal starts at offset 0, replay picks up from the same operation as before
+    store.header->journal_sequence = has_header ? old_header.journal_sequence : 0;
+    store.header->journal_offset = 0;
+    uint32_t n_of_records = store.n_of_slots;
+    store_close();
+    if (has_header && journal_migrate() != 0)
+        return 1;
+    if (rename(RECORD_FILE, old_path) != 0 || store_rename(RECORD_FILE ".migrating", RECORD_FILE) != 0){
+        printf("Error replacing record file\n");
+        return 1;
+    }
+    printf("Migrated %u records, original file kept as %s\n", n_of_records, old_path);
+    return ledger_migrate();
+}
+
+working_set_t* working_set_of(uint32_t account_number){
+    return &working_sets[account_number % LOCK_STRIPES];
+}
+
+acc_t* working_set_find(uint32_t account_number){
+    working_set_t* working_set = working_set_of(account_number);
+    if (working_set->n_of_buckets == 0)
+        return NULL;
+    uint32_t bucket = (account_number * 2654435761u) & (working_set->n_of_buckets - 1);
+    while (working_set->buckets[bucket] != 0){
+        acc_t* account = &working_set->accounts[working_set->buckets[bucket] - 1];
+        if (account->account_number == account_number)
+            return account;
+        bucket = (bucket + 1) & (working_set->n_of_buckets - 1);
+    }
+    return NULL;
+}
+
+int working_set_rehash(working_set_t* working_set, uint32_t n_of_buckets){
+    uint32_t* buckets = calloc(n_of_buckets, sizeof(uint32_t));
+    if (buckets == NULL){
+        printf("Error growing working set\n");
+        return 1;
+    }
+    free(working_set->buckets);
+    working_set->buckets = buckets;
+    working_set->n_of_buckets = n_of_buckets;
+    for (uint32_t i = 0; i < working_set->count; i++){
+        uint32_t bucket = (working_set->accounts[i].account_number * 2654435761u) & (n_of_buckets - 1);
+        while (buckets[bucket] != 0)
+            bucket = (bucket + 1) & (n_of_buckets - 1);
+        buckets[bucket] = i + 1;
+    }
+    return 0;
+}
+
+int working_set_put(const acc_t* account){
+    acc_t* dirty = working_set_find(account->account_number);
+    if (dirty != NULL){
+        *dirty = *account;
+        return 0;
+    }
+    working_set_t* working_set = working_set_of(account->account_number);
+    if (working_set->count == working_set->capacity){
+        acc_t* accounts = realloc(working_set->accounts, (size_t)(working_set->capacity + INDEX_GROWTH) * sizeof(acc_t));
+        if (accounts == NULL){
+            printf("Error growing working set\n");
+            return 1;
+        }
+        working_set->accounts = accounts;
+        working_set->capacity += INDEX_GROWTH;
+    }
+    // keep the load factor at or below 1/2
+    if (working_set->count * 2 >= working_set->n_of_buckets &&
+        working_set_rehash(working_set, working_set->n_of_buckets < WORKING_SET_MIN_BUCKETS ? WORKING_SET_MIN_BUCKETS : working_set->n_of_buckets * 2) != 0)
+        return 1;
+    working_set->accounts[working_set->count] = *account;
+    working_set->count++;
+    uint32_t bucket = (account->account_number * 2654435761u) & (working_set->n_of_buckets - 1);
+    while (working_set->buckets[bucket] != 0)
+        bucket = (bucket + 1) & (working_set->n_of_buckets - 1);
+    working_set->buckets[bucket] = working_set->count;
+    return 0;
+}
+
+uint32_t working_set_count(){
+    uint32_t count = 0;
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        count += working_sets[i].count;
+    return count;
+}
+
+void working_set_clear(){
+    for (int i = 0; i < LOCK_STRIPES; i++){
+        free(working_sets[i].buckets);
+        free(working_sets[i].accounts);
+        working_sets[i] = (working_set_t){NULL, NULL, 0, 0, 0};
+    }
+    ledger_discard_pending();
+    working_set_active = false;
+}
+
+// writes every dirty account back as one journaled operation and folds it into the record file
+int working_set_write_back(){
+    uint32_t count = working_set_count();
+    acc_t* dirty = malloc((size_t)(count == 0 ? 1 : count) * sizeof(acc_t));
+    int result = dirty == NULL ? 1 : 0;
+    for (int i = 0, n = 0; i < LOCK_STRIPES && result == 0; i++){
+        memcpy(&dirty[n], working_sets[i].accounts, (size_t)working_sets[i].count * sizeof(acc_t));
+        n += working_sets[i].count;
+    }
+    if (result == 0 && (count != 0 || ledger.n_of_pending != 0) &&
+        (journal_append(dirty, count, ledger.pending, ledger.n_of_pending) != 0 || journal_flush() != 0))
+        result = 1;
+    if (result == 0)
+        result = ledger_write_pending();
+    for (uint32_t i = 0; i < count && result == 0; i++)
+        result = store_put(&dirty[i]);
+    if (result == 0)
+        result = journal_checkpoint();
+    free(dirty);
+    working_set_clear();
+    clear_order_indexes(); // batches move too many balances to update the orders one by one
+    return result;
+}
+
+money_t bank_shards_total(){
+    money_t total = 0;
+    for (int i = 0; i < BANK_SHARDS; i++)
+        total += bank_shards[i].balance;
+    return total;
+}
+
+void bank_shards_spread(money_t total){
+    for (int i = 0; i < BANK_SHARDS; i++)
+        bank_shards[i].balance = total / BANK_SHARDS;
+    bank_shards[0].balance += total % BANK_SHARDS;
+}
+
+void bank_shards_lock_all(){
+    for (int i = 0; i < BANK_SHARDS; i++)
+        pthread_mutex_lock(&bank_shards[i].lock);
+}
+
+void bank_shards_unlock_all(){
+    for (int i = BANK_SHARDS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&bank_shards[i].lock);
+}
+
+// pays value out of the worker's own shard, or out of the whole bank when the shard runs dry
+int bank_take(money_t value){
+    bank_shard_t* shard = &bank_shards[worker_id % BANK_SHARDS];
+    money_t remaining;
+    pthread_mutex_lock(&shard->lock);
+    if (money_sub(shard->balance, value, &remaining) == 0){
+        shard->balance = remaining;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    bank_shards_lock_all();
+    int result = money_sub(bank_shards_total(), value, &remaining);
+    if (result == 0)
+        bank_shards_spread(remaining);
+    bank_shards_unlock_all();
+    return result;
+}
+
+// each shard may hold its share of MAX_ACCOUNT_VALUE, so the reconciled bank balance never exceeds it
+int bank_give(money_t value){
+    bank_shard_t* shard = &bank_shards[worker_id % BANK_SHARDS];
+    money_t sum;
+    pthread_mutex_lock(&shard->lock);
+    if (money_add(shard->balance, value, MAX_ACCOUNT_VALUE / BANK_SHARDS, &sum) == 0){
+        shard->balance = sum;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    bank_shards_lock_all();
+    int result = money_add(bank_shards_total(), value, MAX_ACCOUNT_VALUE, &sum);
+    if (result == 0)
+        bank_shards_spread(sum);
+    bank_shards_unlock_all();
+    return result;
+}
+
+// lock ordering: stripes in ascending order, then (for the bank account) every bank shard
+void lock_accounts(uint32_t account_a, uint32_t account_b){
+    if (!engine_running)
+        return;
+    uint32_t first = account_a % LOCK_STRIPES, second = account_b % LOCK_STRIPES;
+    if (first > second){
+        uint32_t tmp = first;
+        first = second;
+        second = tmp;
+    }
+    pthread_mutex_lock(&account_locks[first]);
+    if (second != first)
+        pthread_mutex_lock(&account_locks[second]);
+    if (bank_sharded && (account_a == ROOT_BANK_ACCOUNT.account_number || account_b == ROOT_BANK_ACCOUNT.account_number))
+        bank_shards_lock_all();
+}
+
+void unlock_accounts(uint32_t account_a, uint32_t account_b){
+    if (!engine_running)
+        return;
+    if (bank_sharded && (account_a == ROOT_BANK_ACCOUNT.account_number || account_b == ROOT_BANK_ACCOUNT.account_number))
+        bank_shards_unlock_all();
+    uint32_t first = account_a % LOCK_STRIPES, second = account_b % LOCK_STRIPES;
+    if (second != first)
+        pthread_mutex_unlock(&account_locks[second]);
+    pthread_mutex_unlock(&account_locks[first]);
+}
+
+// all-or-nothing update of several accounts: one journaled operation with its ledger entries, then
+// the slots and indexes, then the entries are linked into the ledger
+int write_accounts(const acc_t* accounts, uint32_t n_of_accounts, ledger_entry_t* entries, uint32_t n_of_entries){
+    uint32_t n_of_slots = store.n_of_slots;
+    for (uint32_t i = 0; i < n_of_accounts; i++){
+        if (accounts[i].account_number == 0 || accounts[i].account_number > n_of_slots){
+            printf("Error finding account - id possibly out of range\n");
+            return 1;
+        }
+        if (accounts[i].account_number == n_of_slots)
+            n_of_slots++; // accounts appended by one operation follow each other
+    }
+    if (working_set_active){
+        for (uint32_t i = 0; i < n_of_accounts; i++){
+            if (accounts[i].account_number == store.n_of_slots){
+                printf("Error adding account - not allowed while a batch is in progress\n");
+                return 1;
+            }
+            if (bank_sharded && accounts[i].account_number == ROOT_BANK_ACCOUNT.account_number)
+                bank_shards_spread(accounts[i].curr_balance); // caller holds every shard lock
+            if (working_set_put(&accounts[i]) != 0)
+                return 1;
+        }
+        return ledger_record(entries, n_of_entries);
+    }
+    ledger_stamp_entries(entries, n_of_entries);
+    if (journal_append(accounts, n_of_accounts, entries, n_of_entries) != 0)
+        return 1;
+    uint64_t sequence = journal.next_sequence - 1;
+    for (uint32_t i = 0; i < n_of_accounts; i++){
+        uint32_t account_number = accounts[i].account_number;
+        if (account_number == store.n_of_slots){
+            if (journal_settle(sequence) != 0 || store_append(&accounts[i]) != 0)
+                return 1;
+            number_of_accounts++;
+            order_indexes_update(NULL, &accounts[i]);
+        } else {
+            // identity fields are always current in the file, the indexes read them from there
+            acc_t current = cache_peek(account_number);
+            bool identity_changed = !account_identity_equal(&current, &accounts[i]);
+            if ((identity_changed || account_cache.capacity == 0) && journal_settle(sequence) != 0)
+                return 1;
+            if (identity_changed && indexes_built)
+                index_remove_account(account_number);
+            // a full cache of unsynced entries makes room once the journal is flushed
+            if (cache_put(&accounts[i], identity_changed) != 0 && (journal_flush() != 0 || cache_put(&accounts[i], identity_changed) != 0))
+                return 1;
+            order_indexes_update(&current, &accounts[i]);
+            if (!identity_changed)
+                continue;
+        }
+        if (accounts[i].national_id[0] != '\0')
+            id_filter_add(accounts[i].national_id);
+        if (indexes_built && !is_account_closed(&accounts[i]) && index_add_account(account_number) != 0)
+            return 1;
+    }
+    if (ledger_record(entries, n_of_entries) != 0)
+        return 1;
+    return journal_maintain();
+}
+
+int commit_accounts(const acc_t* accounts, uint32_t n_of_accounts, ledger_entry_t* entries, uint32_t n_of_entries){
+    uint64_t started = stats_sample();
+    int result = write_accounts(accounts, n_of_accounts, entries, n_of_entries);
+    stats_record(STATS_PROBE_COMMIT, started, result);
+    return result;
+}
+
+int get_confirmation(){
+    char confirmation;
+    printf("Are you sure you want to make changes to the record file? (y/n)\n");
+    scanf("%c", &confirmation);
+    while (getchar() != '\n');
+    if (confirmation == 'y')
+        return true;
+    else
+        return false;
+}
+
+int reset_file() {
+    printf("resetting file\n");
+    if(get_confirmation() == false)
+        return 1;
+    if (journal_checkpoint() != 0 || ledger_reset() != 0 || snapshot_discard() != 0)
+        return 1;
+    cache_clear();
+    store_truncate(0);
+    clear_indexes();
+    clear_order_indexes();
+    clear_id_filter();
+    if (store_append(&NULL_ACCOUNT) != 0 || store_append(&ROOT_BANK_ACCOUNT) != 0)
+        return 1;
+    number_of_accounts = 1;
+    return store_sync();
+}
+
+// full check of every block, whether or not it was already verified on access
+int verify_file_integrity(){
+    uint32_t n_of_blocks = (store.n_of_slots + STORE_BLOCK_SLOTS - 1) / STORE_BLOCK_SLOTS;
+    uint32_t n_of_bad_blocks = 0;
+    cache_write_back();
+    memset(store.verified, 0, sizeof(store.verified));
+    for (uint32_t block = 0; block < n_of_blocks; block++)
+        n_of_bad_blocks += store_verify_block(block) != 0;
+    if (store_sync() != 0)
+        return 1;
+    printf("Verified %u blocks holding %u accounts, %u blocks with errors\n", n_of_blocks, store.n_of_slots - 1, n_of_bad_blocks);
+    return n_of_bad_blocks != 0;
+}
+
+acc_t read_account(uint32_t account_number){
+    if (account_number == 0 || account_number > number_of_accounts){
+        printf("Invalid account number\n");
+        return NULL_ACCOUNT;
+    }
+    acc_t* dirty = working_set_active ? working_set_find(account_number) : NULL;
+    if (dirty == NULL && account_number >= store.n_of_slots){
+        printf("Error finding account - id possibly out of range\n");
+        return NULL_ACCOUNT;
+    }
+    // batch workers read the file directly, the cache is emptied before a batch starts
+    acc_t result = dirty != NULL ? *dirty : working_set_active ? store_get(account_number) : cache_get(account_number);
+    if (bank_sharded && account_number == ROOT_BANK_ACCOUNT.account_number)
+        result.curr_balance = bank_shards_total(); // caller holds every shard lock
+    if (is_account_closed(&result)){
+        printf("Account %u is closed\n", account_number);
+        return NULL_ACCOUNT;
+    }
+    return result;
+}
+
+acc_t get_account(uint32_t account_number){
+    uint64_t started = stats_sample();
+    acc_t account = read_account(account_number);
+    stats_record(STATS_PROBE_GET_ACCOUNT, started, account.account_number == NULL_ACCOUNT.account_number);
+    return account;
+}
+
+acc_t get_last_account(){
+    if (store.n_of_slots == 0){
+        printf("Error reading last account\n");
+        return NULL_ACCOUNT;
+    }
+    acc_t last_account = working_set_active ? store_get(store.n_of_slots - 1) : cache_get(store.n_of_slots - 1);
+    if (number_of_accounts != 0 && last_account.account_number != number_of_accounts){
+        printf("Error reading last account - acc numbers not in sync\n");
+    }
+    return last_account;
+}
+
+// takes over the slot and number of a closed account when there is one, appends otherwise
+int add_account(acc_t new_account) {
+    uint32_t free_slot = working_set_active ? 0 : store_free_slot();
+    if (free_slot != 0){
+        new_account.account_number = free_slot;
+    } else {
+        acc_t last_account = get_last_account();
+        new_account.account_number = last_account.account_number + 1;
+    }
+    if (verify_account_validity(new_account) != 0){
+        printf("Error adding account - invalid data\n");
+        return 1;
+    }
+    uint32_t owner;
+    if (find_national_id(new_account.national_id, &owner) != 0)
+        return 1;
+    if (owner != 0){
+        printf("Error adding account - national ID already belongs to account %u\n", owner);
+        return 1;
+    }
+    ledger_entry_t entry = ledger_entry(LEDGER_OPEN, &new_account, 0, new_account.curr_balance, new_account.loan_balance);
+    if ((free_slot == 0 && new_account.account_number != store.n_of_slots) || commit_accounts(&new_account, 1, &entry, 1) != 0) {
+        printf("Error adding account\n");
+        return 1;
+    }
+    if (free_slot != 0)
+        store_free_pop(free_slot);
+    return 0;
+}
+
+// account numbers are slot positions, so live accounts stay where they are: closed slots at the end
+// are released, the free list is rebuilt lowest slot first and the search indexes are rewritten
+int compact_file(){
+    uint32_t n_of_slots_before = store.n_of_slots, n_of_blocks_before = store.n_of_blocks;
+    // the snapshot writer still reads the shared mapping that is about to shrink
+    snapshot_running(true);
+    cache_clear();
+    uint32_t n_of_slots = store.n_of_slots;
+    while (n_of_slots > 2 && store_slot_closed(n_of_slots - 1))
+        n_of_slots--;
+    store_truncate(n_of_slots);
+    number_of_accounts = n_of_slots - 1;
+    store_rebuild_free_list();
+    // replay must not bring back images of the released slots
+    if (journal_checkpoint() != 0)
+        return 1;
+    uint32_t n_of_blocks = (n_of_slots + STORE_BLOCK_SLOTS - 1) / STORE_BLOCK_SLOTS;
+    if (n_of_blocks < store.n_of_blocks){
+        store_unmap();
+        if (store_trim(n_of_blocks) != 0 || store_map(n_of_blocks) != 0)
+            return 1;
+    }
+    clear_indexes();
+    clear_order_indexes();
+    if (build_indexes() != 0)
+        return 1;
+    printf("Released %u closed slots and %u blocks, %u slots free for reuse\n",
+           n_of_slots_before - store.n_of_slots, n_of_blocks_before - store.n_of_blocks, store.header->n_of_free);
+    return 0;
+}
+
+int populate_file_with_preset_accounts(){
+    for (int i = 0; i < sizeof(PRESET_ACCOUNTS)/sizeof(acc_t); i++){
+        if(add_account(PRESET_ACCOUNTS[i]) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// the rest of a command line without surrounding blanks; input lines end in a blank where the newline was
+char* command_argument(char* text){
+    while (*text == ' ' || *text == '\t')
+        text++;
+    size_t length = strlen(text);
+    while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t'))
+        text[--length] = '\0';
+    return text;
+}
+
+// splits the line at cursor into fields pointing into the mapped input, without copying;
+// returns where the next line starts
+const char* csv_split_line(const char* cursor, const char* end, csv_field_t* fields, int* n_of_fields){
+    int n = 0;
+    bool quoted = false;
+    const char* field_start = cursor;
+    for (; cursor < end; cursor++){
+        if (*cursor == '"'){
+            quoted = !quoted; // an escaped quote toggles twice
+            continue;
+        }
+        if (quoted || (*cursor != ',' && *cursor != '\n'))
+            continue;
+        size_t length = cursor - field_start;
+        if (*cursor == '\n' && length != 0 && cursor[-1] == '\r')
+            length--;
+        if (n < IMPORT_FIELDS)
+            fields[n] = (csv_field_t){field_start, length};
+        n++;
+        field_start = cursor + 1;
+        if (*cursor == '\n'){
+            *n_of_fields = n;
+            return cursor + 1;
+        }
+    }
+    if (cursor > field_start || n != 0){
+        if (n < IMPORT_FIELDS)
+            fields[n] = (csv_field_t){field_start, cursor - field_start};
+        n++;
+    }
+    *n_of_fields = n;
+    return end;
+}
+
+// copies a field into a terminated string, undoing the quoting; fails when it does not fit
+int csv_copy_field(const csv_field_t* field, char* target, size_t capacity){
+    const char* cursor = field->start;
+    const char* end = field->start + field->length;
+    bool quoted = field->length != 0 && *cursor == '"';
+    if (quoted){
+        if (field->length < 2 || end[-1] != '"')
+            return 1;
+        cursor++;
+        end--;
+    }
+    size_t length = 0;
+    for (; cursor < end; cursor++){
+        if (quoted && *cursor == '"' && (++cursor == end || *cursor != '"'))
+            return 1;
+        if (length + 1 >= capacity)
+            return 1;
+        target[length++] = *cursor;
+    }
+    target[length] = '\0';
+    return 0;
+}
+
+int compare_import_ids(const void* a, const void* b){
+    const import_id_t* x = a;
+    const import_id_t* y = b;
+    int cmp = strcmp(x->national_id, y->national_id);
+    return cmp != 0 ? cmp : (x->line > y->line) - (x->line < y->line);
+}
+
+bool is_import_header(const csv_field_t* fields, int n_of_fields){
+    return n_of_fields != 0 && fields[0].length == 14 && strncmp(fields[0].start, "account_number", 14) == 0;
+}
+
+// one row in the export layout into an account numbered as the given slot; the exported account
+// number is ignored, imported accounts are always appended. Returns what is wrong with the row, or NULL
+const char* import_parse_account(const csv_field_t* fields, int n_of_fields, uint32_t account_number, acc_t* account){
+    char amounts[3][LENGTH_OF_MONEY_TEXT];
+    char* end;
+    if (n_of_fields != IMPORT_FIELDS)
+        return "expected 8 fields";
+    *account = NULL_ACCOUNT;
+    account->account_number = account_number;
+    if (csv_copy_field(&fields[1], account->name, sizeof(account->name)) != 0)
+        return "name too long";
+    if (csv_copy_field(&fields[2], account->surname, sizeof(account->surname)) != 0)
+        return "surname too long";
+    if (csv_copy_field(&fields[3], account->address, sizeof(account->address)) != 0)
+        return "address too long";
+    if (csv_copy_field(&fields[4], account->national_id, sizeof(account->national_id)) != 0)
+        return "national ID too long";
+    for (int i = 0; i < 3; i++){
+        if (csv_copy_field(&fields[5 + i], amounts[i], sizeof(amounts[i])) != 0)
+            return "invalid amount";
+    }
+    if (parse_money(amounts[0], &account->curr_balance, &end) != 0 || *end != '\0' ||
+        parse_money(amounts[1], &account->loan_balance, &end) != 0 || *end != '\0')
+        return "invalid amount";
+    if (parse_rate(amounts[2], &account->interest_rate, &end) != 0 || *end != '\0')
+        return "invalid interest rate";
+    if (verify_account_validity(*account) != 0)
+        return "invalid account data";
+    return NULL;
+}
+
+int import_append(acc_t* accounts, ledger_entry_t* entries, uint32_t n_of_accounts){
+    if (n_of_accounts == 0)
+        return 0;
+    for (uint32_t i = 0; i < n_of_accounts; i++)
+        entries[i] = ledger_entry(LEDGER_OPEN, &accounts[i], 0, accounts[i].curr_balance, accounts[i].loan_balance);
+    return commit_accounts(accounts, n_of_accounts, entries, n_of_accounts);
+}
+
+// bulk onboarding from a csv file in the export layout, parsed in place over a mapping of the file.
+// Every row is checked before anything is written, then the accounts are appended after the last
+// slot in journaled chunks of IMPORT_CHUNK, skipping the per-account lookups of add_account. Each chunk
+// is its own operation: a write error part-way leaves the chunks before it imported
+int import_accounts(char* path){
+    path = command_argument(path);
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0){
+        printf("Error opening import file\n");
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if (file_stat.st_size == 0){
+        printf("No accounts to import\n");
+        close(fd);
+        return 1;
+    }
+    const char* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        printf("Error mapping import file\n");
+        return 1;
+    }
+    madvise((void*)data, file_stat.st_size, MADV_SEQUENTIAL);
+    const char* end = data + file_stat.st_size;
+    csv_field_t fields[IMPORT_FIELDS];
+    int n_of_fields;
+    acc_t account;
+    uint32_t n_of_accounts = 0, n_of_rejected = 0, line = 0, capacity = 0;
+    import_id_t* ids = NULL; // IDs of the accepted rows, checked against each other once all are read
+    int result = 0;
+    for (const char* cursor = data; cursor < end && result == 0;){
+        cursor = csv_split_line(cursor, end, fields, &n_of_fields);
+        line++;
+        if ((n_of_fields == 1 && fields[0].length == 0) || (line == 1 && is_import_header(fields, n_of_fields)))
+            continue;
+        const char* problem = import_parse_account(fields, n_of_fields, store.n_of_slots + n_of_accounts, &account);
+        uint32_t owner = 0;
+        if (problem == NULL && find_national_id(account.national_id, &owner) != 0)
+            result = 1;
+        if (problem == NULL && owner == 0 && result == 0){
+            if (n_of_accounts == capacity){
+                import_id_t* grown = realloc(ids, (size_t)(capacity == 0 ? INDEX_GROWTH : capacity * 2) * sizeof(import_id_t));
+                if (grown == NULL){
+                    printf("Error importing accounts\n");
+                    result = 1;
+                    break;
+                }
+                ids = grown;
+                capacity = capacity == 0 ? INDEX_GROWTH : capacity * 2;
+            }
+            memcpy(ids[n_of_accounts].national_id, account.national_id, sizeof(account.national_id));
+            ids[n_of_accounts++].line = line;
+            continue;
+        }
+        if (result == 0 && n_of_rejected++ < IMPORT_MAX_REPORTED){
+            if (problem != NULL)
+                printf("Line %u rejected: %s\n", line, problem);
+            else
+                printf("Line %u rejected: national ID already belongs to account %u\n", line, owner);
+        }
+    }
+    if (result == 0 && n_of_accounts > 1){
+        qsort(ids, n_of_accounts, sizeof(import_id_t), compare_import_ids);
+        for (uint32_t i = 1; i < n_of_accounts; i++){
+            if (strcmp(ids[i].national_id, ids[i - 1].national_id) == 0 && n_of_rejected++ < IMPORT_MAX_REPORTED)
+                printf("Line %u rejected: national ID repeats line %u\n", ids[i].line, ids[i - 1].line);
+        }
+    }
+    free(ids);
+    if (result == 0 && n_of_rejected != 0){
+        printf("%u lines rejected - nothing imported\n", n_of_rejected);
+        result = 1;
+    } else if (result == 0 && n_of_accounts == 0){
+        printf("No accounts to import\n");
+        result = 1;
+    } else if (result == 0 && (uint64_t)store.n_of_slots + n_of_accounts > (uint64_t)STORE_MAX_BLOCKS * STORE_BLOCK_SLOTS){
+        printf("Record file is full\n");
+        result = 1;
+    } else if (result == 0 && REQUIRE_CONFIRMATION_ON_EDIT){
+        printf("%u accounts to be imported\n", n_of_accounts);
+        if (get_confirmation() == false){
+            printf("Operation aborted\n");
+            result = 1;
+        }
+    }
+    acc_t* chunk = result == 0 ? malloc(IMPORT_CHUNK * sizeof(acc_t)) : NULL;
+    ledger_entry_t* entries = result == 0 ? malloc(IMPORT_CHUNK * sizeof(ledger_entry_t)) : NULL;
+    if (result == 0 && (chunk == NULL || entries == NULL || store_reserve(store.n_of_slots + n_of_accounts) != 0)){
+        printf("Error importing accounts\n");
+        result = 1;
+    }
+    uint32_t first_account = store.n_of_slots, n_in_chunk = 0;
+    if (result == 0)
+        clear_indexes(); // adding row by row to the search indexes costs more than rebuilding them on next use
+    line = 0;
+    for (const char* cursor = data; cursor < end && result == 0;){
+        cursor = csv_split_line(cursor, end, fields, &n_of_fields);
+        line++;
+        if ((n_of_fields == 1 && fields[0].length == 0) || (line == 1 && is_import_header(fields, n_of_fields)))
+            continue;
+        import_parse_account(fields, n_of_fields, store.n_of_slots + n_in_chunk, &chunk[n_in_chunk]);
+        if (++n_in_chunk == IMPORT_CHUNK){
+            result = import_append(chunk, entries, n_in_chunk);
+            n_in_chunk = 0;
+        }
+    }
+    if (result == 0)
+        result = import_append(chunk, entries, n_in_chunk);
+    if (result == 0)
+        result = journal_flush();
+    munmap((void*)data, file_stat.st_size);
+    free(chunk);
+    free(entries);
+    if (result == 0)
+        printf("Imported %u accounts as %u to %u\n", n_of_accounts, first_account, store.n_of_slots - 1);
+    else if (store.n_of_slots != first_account)
+        printf("Import stopped after %u accounts\n", store.n_of_slots - first_account);
+    return result;
+}
+
+// every open account in the csv layout import reads
+int export_accounts(char* path){
+    path = command_argument(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        printf("Error opening export file\n");
+        return 1;
+    }
+    cache_write_back();
+    output_flush();
+    output_buffer.fd = fd;
+    output_buffer.failed = false;
+    render_csv_header();
+    uint32_t n_of_accounts = 0;
+    for (uint32_t slot = 1; slot < store.n_of_slots; slot++){
+        acc_t account = store_get(slot);
+        if (is_account_closed(&account))
+            continue;
+        render_account(&account, FULL_VIEW, CSV_OUTPUT);
+        n_of_accounts++;
+    }
+    output_flush();
+    output_buffer.fd = STDOUT_FILENO;
+    int result = output_buffer.failed || fsync(fd) != 0;
+    if (close(fd) != 0 || result != 0){
+        printf("Error writing export file\n");
+        return 1;
+    }
+    printf("Exported %u accounts to %s\n", n_of_accounts, path);
+    return 0;
+}
+
+int convert_newlines_to_whitespace(char* string, int length){
+    for (int i = 0; i < length; i++){
+        if (string[i] == '\n')
+            string[i] = ' ';
+        else if (string[i] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+int get_and_clean_input(char* input_buffer, int buffer_size) {
+    fgets(input_buffer, buffer_size, stdin);
+    int len = strlen(input_buffer);
+    if (len == 0){
+        return 1;
+    } else if (len >= buffer_size - 1) {
+        int c;
+        bool truncated = false;
+        while ((c = getchar()) != '\n' && c != EOF)
+            truncated = true;
+        if (truncated)
+            printf("Input too long, truncating\n");
+    }
+    convert_newlines_to_whitespace(input_buffer, len);
+    return 0;
+}
+
+int add_account_from_input(){
+    acc_t new_account = {0};
+    char temp_balance[LENGTH_OF_MONEY_TEXT], temp_loan_balance[LENGTH_OF_MONEY_TEXT], temp_interest_rate[LENGTH_OF_MONEY_TEXT];
+    printf("Enter name: ");
+    get_and_clean_input(new_account.name, LENGTH_OF_NAME);
+    printf("Enter surname: ");
+    get_and_clean_input(new_account.surname, LENGTH_OF_SURNAME);
+    printf("Enter address: ");
+    get_and_clean_input(new_account.address, LENGTH_OF_ADDRESS);
+    printf("Enter national ID: ");
+    get_and_clean_input(new_account.national_id, LENGTH_OF_NATIONAL_ID+1);
+    printf("Enter current balance: ");
+    get_and_clean_input(temp_balance, LENGTH_OF_MONEY_TEXT);
+    printf("Enter loan balance: ");
+    get_and_clean_input(temp_loan_balance, LENGTH_OF_MONEY_TEXT);
+    printf("Enter interest rate: ");
+    get_and_clean_input(temp_interest_rate, LENGTH_OF_MONEY_TEXT);
+    if (parse_money(temp_balance, &new_account.curr_balance, NULL) != 0 ||
+        parse_money(temp_loan_balance, &new_account.loan_balance, NULL) != 0 ||
+        parse_rate(temp_interest_rate, &new_account.interest_rate, NULL) != 0){
+        printf("Invalid amount - use at most %d decimals for money and %d for the interest rate\n", MONEY_DECIMALS, LENGTH_OF_INTEREST_RATE);
+        return 1;
+    }
+    printf("Account to be added:\n");
+    print_table_header(global_view_mode);
+    print_account_as_table(new_account, global_view_mode);
+    if (get_confirmation() == false || add_account(new_account)==1){
+        return 1;
+    }
+    printf("Account added successfully\n");
+
+    return 0;
+}
+
+// entry, when given, is the ledger entry of the change and is committed along with it
+int paste_account_at_number(uint32_t account_number, acc_t new_account, bool preauthorized, ledger_entry_t* entry) {
+    if(!preauthorized && REQUIRE_CONFIRMATION_ON_EDIT && get_confirmation()==false){
+        printf("Operation aborted\n");
+        return 1;
+    }
+    if(verify_account_validity(new_account) != 0){
+        printf("Error updating account - invalid data\n");
+        return 1;
+    }
+    if (account_number == 0 || account_number >= store.n_of_slots) {
+        printf("Error finding account - id possibly out of range\n");
+        return 1;
+    }
+    new_account.account_number = account_number;
+    return commit_accounts(&new_account, 1, entry, entry == NULL ? 0 : 1);
+}
+
+int make_deposit(uint32_t account_number, money_t deposit_value){
+    char limit[LENGTH_OF_MONEY_TEXT];
+    if (deposit_value <= 0){
+        printf("Deposit value must be positive\n");
+        return 1;
+    }
+    if (deposit_value > MAX_DEPOSIT){
+        format_money(MAX_DEPOSIT, limit);
+        printf("Deposit value exceeds maximum deposit value (%s)\n", limit);
+        return 1;
+    }
+    acc_t account = get_account(account_number);
+    if (account.account_number == NULL_ACCOUNT.account_number){
+        printf("Account not found\n");
+        return 1;
+    }
+    if (money_add(account.curr_balance, deposit_value, MAX_ACCOUNT_VALUE, &account.curr_balance) != 0){
+        format_money(MAX_ACCOUNT_VALUE, limit);
+        printf("Deposit exceeds maximum account value (%s)\n", limit);
+        return 1;
+    }
+    ledger_entry_t entry = ledger_entry(LEDGER_DEPOSIT, &account, 0, deposit_value, 0);
+    return paste_account_at_number(account_number, account, false, &entry);
+}
+
+int make_withdraw(uint32_t account_number, money_t withdraw_value){
+    char limit[LENGTH_OF_MONEY_TEXT];
+    if (withdraw_value <= 0){
+        printf("Withdraw value must be positive\n");
+        return 1;
+    }
+    if (withdraw_value > MAX_WITHDRAW){
+        format_money(MAX_WITHDRAW, limit);
+        printf("Withdraw value exceeds maximum withdraw value (%s)\n", limit);
+        return 1;
+    }
+    acc_t account = get_account(account_number);
+    if (account.account_number == NULL_ACCOUNT.account_number){
+        printf("Account not found\n");
+        return 1;
+    }
+    if (money_sub(account.curr_balance, withdraw_value, &account.curr_balance) != 0){
+        printf("Withdraw exceeds account balance\n");
+        return 1;
+    }
+    ledger_entry_t entry = ledger_entry(LEDGER_WITHDRAW, &account, 0, -withdraw_value, 0);
+    return paste_account_at_number(account_number, account, false, &entry);
+}
+
+int take_loan(uint32_t account_number, money_t loan_value){
+    char limit[LENGTH_OF_MONEY_TEXT];
+    if (loan_value <= 0){
+        printf("Loan value must be positive\n");
+        return 1;
+    }
+    if (loan_value > MAX_BORROW){
+        format_money(MAX_BORROW, limit);
+        printf("Loan value exceeds maximum loan value (%s)\n", limit);
+        return 1;
+    }
+    if (account_number == ROOT_BANK_ACCOUNT.account_number){
+        printf("Bank cannot borrow from itself\n");
+        return 1;
+    }
+    acc_t account = get_account(account_number);
+    if (account.account_number == NULL_ACCOUNT.account_number){
+        printf("Account not found\n");
+        return 1;
+    }
+    if (money_add(account.curr_balance, loan_value, MAX_ACCOUNT_VALUE, &account.curr_balance) != 0){
+        format_money(MAX_ACCOUNT_VALUE, limit);
+        printf("New account value exceeds max account value (%s)\n", limit);
+        return 1;
+    }
+    if (money_add(account.loan_balance, loan_value, MAX_LOAN_VALUE, &account.loan_balance) != 0){
+        format_money(MAX_LOAN_VALUE, limit);
+        printf("Loan exceeds maximum loan value (%s)\n", limit);
+        return 1;
+    }
+    if (bank_sharded){
+        // batch workers draw loans from the bank's sub-balances instead of serializing on its record
+        if (verify_account_validity(account) != 0)
+            return 1;
+        if (bank_take(loan_value) != 0){
+            printf("Bank does not have enough funds to provide loan\n");
+            return 1;
+        }
+        ledger_entry_t entry = ledger_entry(LEDGER_LOAN, &account, ROOT_BANK_ACCOUNT.account_number, loan_value, loan_value);
+        if (commit_accounts(&account, 1, &entry, 1) != 0){
+            bank_give(loan_value);
+            return 1;
+        }
+        return 0;
+    }
+    acc_t bank_account = get_account(ROOT_BANK_ACCOUNT.account_number);
+    if (money_sub(bank_account.curr_balance, loan_value, &bank_account.curr_balance) != 0){
+        printf("Bank does not have enough funds to provide loan\n");
+        return 1;
+    }
+    if (REQUIRE_CONFIRMATION_ON_EDIT && !get_confirmation()){
+        printf("Operation aborted\n");
+        return 1;
+    }
+    acc_t updated_accounts[] = {account, bank_account};
+    ledger_entry_t entries[] = {
+            ledger_entry(LEDGER_LOAN, &account, ROOT_BANK_ACCOUNT.account_number, loan_value, loan_value),
+            ledger_entry(LEDGER_LOAN, &bank_account, account_number, -loan_value, 0)
+    };
+    if (verify_account_validity(account) != 0 || verify_account_validity(bank_account) != 0 ||
+        commit_accounts(updated_accounts, 2, entries, 2) != 0)
+        return 1;
+    return 0;
+}
+
+int repay_loan(uint32_t account_number, money_t payment_value){
+    char limit[LENGTH_OF_MONEY_TEXT];
+    if (payment_value <= 0){
+        printf("Payment value must be positive\n");
+        return 1;
+    }
+    if (account_number == ROOT_BANK_ACCOUNT.account_number){
+        printf("Bank cannot repay itself\n");
+        return 1;
+    }
+    acc_t account = get_account(account_number);
+    if (account.account_number == NULL_ACCOUNT.account_number){
+        printf("Account not found\n");
+        return 1;
+    }
+    if(account.loan_balance == 0){
+        printf("No loans to repay\n");
+        return 1;
+    }
+    money_t curr_balance, loan_balance;
+    if (money_sub(account.curr_balance, payment_value, &curr_balance) != 0){
+        format_money(account.curr_balance, limit);
+        printf("Payment exceeds account balance (%s)\n", limit);
+        return 1;
+    }
+    if (money_sub(account.loan_balance, payment_value, &loan_balance) != 0){
+        format_money(account.loan_balance, limit);
+        printf("Payment too high, exceeds loan balance (%s)\n", limit);
+        return 1;
+    }
+    account.curr_balance = curr_balance;
+    account.loan_balance = loan_balance;
+    if (bank_sharded){
+        if (verify_account_validity(account) != 0)
+            return 1;
+        if (bank_give(payment_value) != 0){
+            printf("Bank has too much money, sorry\n");
+            return 1;
+        }
+        ledger_entry_t entry = ledger_entry(LEDGER_REPAYMENT, &account, ROOT_BANK_ACCOUNT.account_number, -payment_value, -payment_value);
+        if (commit_accounts(&account, 1, &entry, 1) != 0){
+            bank_take(payment_value);
+            return 1;
+        }
+        return 0;
+    }
+    acc_t bank_account = get_account(ROOT_BANK_ACCOUNT.account_number);
+    if (money_add(bank_account.curr_balance, payment_value, MAX_ACCOUNT_VALUE, &bank_account.curr_balance) != 0){
+        printf("Bank has too much money, sorry\n");
+        return 1;
+    }
+    if (REQUIRE_CONFIRMATION_ON_EDIT && !get_confirmation()){
+        printf("Operation aborted\n");
+        return 1;
+    }
+    acc_t updated_accounts[] = {account, bank_account};
+    ledger_entry_t entries[] = {
+            ledger_entry(LEDGER_REPAYMENT, &account, ROOT_BANK_ACCOUNT.account_number, -payment_value, -payment_value),
+            ledger_entry(LEDGER_REPAYMENT, &bank_account, account_number, payment_value, 0)
+    };
+    if (verify_account_validity(account) != 0 || verify_account_validity(bank_account) != 0 ||
+        commit_accounts(updated_accounts, 2, entries, 2) != 0)
+        return 1;
+    return 0;
+}
+
+int make_transfer(uint32_t origin_account_number, uint32_t dest_account_number, money_t transfer_value) {
+    if (origin_account_number == dest_account_number) {
+        printf("Cannot transfer to the same account\n");
+        return 1;
+    }
+    acc_t origin_account = get_account(origin_account_number);
+    acc_t dest_account = get_account(dest_account_number);
+    if (origin_account.account_number == NULL_ACCOUNT.account_number ||
+        dest_account.account_number == NULL_ACCOUNT.account_number) {
+        printf("Account not found\n");
+        return 1;
+    }
+    if (transfer_value <= 0) {
+        printf("Transfer value must be positive\n");
+        return 1;
+    }
+    if (transfer_value > MAX_TRANSFER) {
+        printf("Transfer exceeds maximum allowed transfer value\n");
+        return 1;
+    }
+    if (money_sub(origin_account.curr_balance, transfer_value, &origin_account.curr_balance) != 0) {
+        printf("Transfer value exceeds account balance\n");
+        return 1;
+    }
+    if (money_add(dest_account.curr_balance, transfer_value, MAX_ACCOUNT_VALUE, &dest_account.curr_balance) != 0) {
+        printf("Transfer exceeds maximum destination account value\n");
+        return 1;
+    }
+    if (REQUIRE_CONFIRMATION_ON_EDIT && !get_confirmation()){
+        printf("Operation aborted\n");
+        return 1;
+    }
+    acc_t updated_accounts[] = {origin_account, dest_account};
+    ledger_entry_t entries[] = {
+            ledger_entry(LEDGER_TRANSFER_OUT, &origin_account, dest_account_number, -transfer_value, 0),
+            ledger_entry(LEDGER_TRANSFER_IN, &dest_account, origin_account_number, transfer_value, 0)
+    };
+    if (verify_account_validity(origin_account) != 0 || verify_account_validity(dest_account) != 0 ||
+        commit_accounts(updated_accounts, 2, entries, 2) != 0){
+        printf("Transfer failed\n");
+        return 1;
+    }
+    if (REPORT_SUCCESS)
+        printf("Transfer successful\n");
+    return 0;
+}
+
+int collect_interest(uint32_t account_number){
+    acc_t account = get_account(account_number);
+    if (account.account_number == NULL_ACCOUNT.account_number){
+        printf("Account not found\n");
+        return 1;
+    }
+    if (account.loan_balance == 0){
+        return 0;
+    }
+    money_t interest_value;
+    char interest_text[LENGTH_OF_MONEY_TEXT];
+    if (money_mul_rate(account.loan_balance, account.interest_rate, &interest_value) |
+        money_add(account.loan_balance, interest_value, MAX_LOAN_VALUE, &account.loan_balance)){
+        printf("Interest achieved maximum debt in account %ud\n", account_number);
+        return 1;
+    }
+    format_money(interest_value, interest_text);
+    printf("Interest collected: %s\n", interest_text);
+    ledger_entry_t entry = ledger_entry(LEDGER_INTEREST, &account, ROOT_BANK_ACCOUNT.account_number, 0, interest_value);
+    return paste_account_at_number(account_number, account, false, &entry);
+}
+
+bool account_matches_pattern(const acc_t* account, const acc_t* pattern_acc){
+    return (pattern_acc->name[0] == NULL_ACCOUNT.name[0] || strncmp(pattern_acc->name, account->name, strlen(pattern_acc->name) - 1) == 0 ) &&
+           (pattern_acc->surname[0] == NULL_ACCOUNT.surname[0] || strncmp(pattern_acc->surname, account->surname, strlen(pattern_acc->surname) - 1) == 0 ) &&
+           (pattern_acc->address[0] == NULL_ACCOUNT.address[0] || strncmp(pattern_acc->address, account->address, strlen(pattern_acc->address) - 1) == 0 ) &&
+           (pattern_acc->national_id[0] == NULL_ACCOUNT.national_id[0] || strncmp(pattern_acc->national_id, account->national_id, strlen(pattern_acc->national_id) - 1) == 0);
+}
+
+bool is_full_national_id(const char* national_id){
+    for (int i = 0; i < LENGTH_OF_NATIONAL_ID; i++){
+        if (national_id[i] < '0' || national_id[i] > '9')
+            return false;
+    }
+    return true;
+}
+
+int compare_account_numbers(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+int append_match(uint32_t** matches, uint32_t* n_of_matches, uint32_t* capacity, uint32_t account_number){
+    if (*n_of_matches == *capacity){
+        uint32_t* grown = realloc(*matches, (size_t)(*capacity + INDEX_GROWTH) * sizeof(uint32_t));
+        if (grown == NULL){
+            printf("Error collecting search results\n");
+            return 1;
+        }
+        *matches = grown;
+        *capacity += INDEX_GROWTH;
+    }
+    (*matches)[(*n_of_matches)++] = account_number;
+    return 0;
+}
+
+// computes interest for one slot range; balances are gathered into column arrays
+// so the fixed-point arithmetic and the cap check run as straight-line loops over plain int64 lanes
+void* interest_sweep_main(void* arg){
+    interest_sweep_t* sweep = arg;
+    money_t loan_balances[SWEEP_BLOCK];
+    rate_t interest_rates[SWEEP_BLOCK];
+    money_t new_loan_balances[SWEEP_BLOCK];
+    uint32_t capacity = 0;
+    for (uint32_t block = sweep->first_slot; block < sweep->end_slot; block += SWEEP_BLOCK){
+        uint32_t n = sweep->end_slot - block < SWEEP_BLOCK ? sweep->end_slot - block : SWEEP_BLOCK;
+        for (uint32_t i = 0; i < n; i += STORE_BLOCK_SLOTS)
+            store_check(block + i);
+        store_check(block + n - 1);
+        for (uint32_t i = 0; i < n; i++){
+            const hot_t* hot = store_hot(block + i);
+            loan_balances[i] = hot->loan_balance;
+            interest_rates[i] = hot->interest_rate;
+        }
+        uint32_t n_of_capped = 0;
+        for (uint32_t i = 0; i < n; i++){
+            money_t interest_value, charged;
+            int over_cap = money_mul_rate(loan_balances[i], interest_rates[i], &interest_value) |
+                           money_add(loan_balances[i], interest_value, MAX_LOAN_VALUE, &charged);
+            n_of_capped += over_cap;
+            new_loan_balances[i] = over_cap ? loan_balances[i] : charged;
+        }
+        sweep->n_of_capped += n_of_capped;
+        for (uint32_t i = 0; i < n; i++){
+            if (new_loan_balances[i] == loan_balances[i])
+                continue;
+            if (sweep->n_of_charged == capacity){
+                acc_t* grown = realloc(sweep->charged, (size_t)(capacity + SWEEP_BLOCK) * sizeof(acc_t));
+                if (grown == NULL){
+                    sweep->error = 1;
+                    return NULL;
+                }
+                sweep->charged = grown;
+                capacity += SWEEP_BLOCK;
+            }
+            acc_t* account = &sweep->charged[sweep->n_of_charged++];
+            *account = store_get(block + i);
+            account->loan_balance = new_loan_balances[i];
+            sweep->interest_total += new_loan_balances[i] - loan_balances[i];
+        }
+    }
+    return NULL;
+}
+
+// month-end accrual: every account is charged in parallel chunks, then all changes are
+// journaled as one operation and written back in a single pass
+int collect_interest_all(){
+    if (REQUIRE_CONFIRMATION_ON_EDIT && get_confirmation() == false){
+        printf("Operation aborted\n");
+        return 1;
     }
-    fseek(file, -(long)sizeof(acc_t), SEEK_END); // go to the last record (assuming it's there
-    acc_t last_account = NULL_ACCOUNT;
-    if(fread(&last_account, sizeof(acc_t), 1, file) == 0){
-        printf("Error reading last account\n");
-        fclose(file);
-        return last_account;
+    cache_clear(); // the sweep reads and writes the record file directly
+    long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_of_threads = n_of_cpus < 1 ? 1 : n_of_cpus > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : n_of_cpus;
+    uint32_t n_of_accounts = store.n_of_slots - 1;
+    if (n_of_threads > n_of_accounts / SWEEP_BLOCK + 1)
+        n_of_threads = n_of_accounts / SWEEP_BLOCK + 1;
+    interest_sweep_t sweeps[MAX_WORKER_THREADS];
+    uint32_t per_thread = n_of_accounts / n_of_threads + 1;
+    uint32_t n_of_started = 0;
+    int result = 0;
+    for (uint32_t i = 0; i < n_of_threads; i++){
+        uint32_t first_slot = 1 + i * per_thread;
+        uint32_t end_slot = first_slot + per_thread > store.n_of_slots ? store.n_of_slots : first_slot + per_thread;
+        sweeps[i] = (interest_sweep_t){0, first_slot, end_slot, NULL, 0, 0, 0, 0};
+        if (i == 0)
+            continue; // the calling thread takes the first chunk itself
+        if (pthread_create(&sweeps[i].thread, NULL, interest_sweep_main, &sweeps[i]) != 0){
+            printf("Error starting worker thread\n");
+            result = 1;
+            break;
+        }
+        n_of_started = i;
     }
-    if (number_of_accounts != 0 && last_account.account_number != number_of_accounts){
-        printf("Error reading last account - acc numbers not in sync\n");
+    interest_sweep_main(&sweeps[0]);
+    uint32_t n_of_charged = 0, n_of_capped = 0;
+    money_t interest_total = 0;
+    char interest_text[LENGTH_OF_MONEY_TEXT];
+    for (uint32_t i = 0; i <= n_of_started; i++){
+        if (i != 0)
+            pthread_join(sweeps[i].thread, NULL);
+        result |= sweeps[i].error;
+        n_of_charged += sweeps[i].n_of_charged;
+        n_of_capped += sweeps[i].n_of_capped;
+        interest_total += sweeps[i].interest_total;
     }
-    fclose(file);
-    return last_account;
+
+    acc_t* charged = result == 0 ? malloc((size_t)(n_of_charged == 0 ? 1 : n_of_charged) * sizeof(acc_t)) : NULL;
+    if (charged == NULL)
+        result = 1;
+    for (uint32_t i = 0, n = 0; i <= n_of_started && result == 0; i++){
+        memcpy(&charged[n], sweeps[i].charged, (size_t)sweeps[i].n_of_charged * sizeof(acc_t));
+        n += sweeps[i].n_of_charged;
+    }
+    for (uint32_t i = 0; i <= n_of_started; i++)
+        free(sweeps[i].charged);
+    ledger_entry_t* entries = result == 0 ? malloc((size_t)(n_of_charged == 0 ? 1 : n_of_charged) * sizeof(ledger_entry_t)) : NULL;
+    if (entries == NULL)
+        result = 1;
+    for (uint32_t i = 0; i < n_of_charged && result == 0; i++){
+        money_t interest_value = charged[i].loan_balance - store_hot(charged[i].account_number)->loan_balance;
+        entries[i] = ledger_entry(LEDGER_INTEREST, &charged[i], ROOT_BANK_ACCOUNT.account_number, 0, interest_value);
+    }
+    if (result == 0)
+        ledger_stamp_entries(entries, n_of_charged);
+    if (result == 0 && n_of_charged != 0 && (journal_append(charged, n_of_charged, entries, n_of_charged) != 0 || journal_flush() != 0))
+        result = 1;
+    for (uint32_t i = 0; i < n_of_charged && result == 0; i++){
+        acc_t before = store_get(charged[i].account_number);
+        order_indexes_update(&before, &charged[i]);
+        store_set(charged[i].account_number, &charged[i]);
+    }
+    if (result == 0 && ledger_record(entries, n_of_charged) != 0)
+        result = 1;
+    free(entries);
+    free(charged);
+    if (result != 0 || journal_checkpoint() != 0){
+        printf("Error collecting interest\n");
+        return 1;
+    }
+    format_money(interest_total, interest_text);
+    printf("Interest collected: %s from %u accounts, %u accounts at maximum debt left unchanged\n",
+           interest_text, n_of_charged, n_of_capped);
+    return 0;
 }
 
-acc_t get_last_account_slow(){
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
-        printf("Error opening file\n");
-        return NULL_ACCOUNT;
+// zero, then amounts under one unit, then one bucket per decade of whole units
+uint32_t report_bucket(money_t value){
+    uint32_t bucket = value > 0;
+    for (money_t limit = MONEY_SCALE; value >= limit && bucket < REPORT_BUCKETS - 1; limit *= 10)
+        bucket++;
+    return bucket;
+}
+
+money_t report_bucket_floor(uint32_t bucket){
+    money_t floor = bucket == 0 ? 0 : 1;
+    for (uint32_t i = 1; i < bucket; i++)
+        floor = i == 1 ? MONEY_SCALE : floor * 10;
+    return floor;
+}
+
+// aggregates one slot range straight from the hot columns; the bank and empty slots are left out
+void* report_scan_main(void* arg){
+    report_scan_t* scan = arg;
+    for (uint32_t slot = scan->first_slot; slot < scan->end_slot; slot++){
+        if (slot == scan->first_slot || slot % STORE_BLOCK_SLOTS == 0)
+            store_check(slot);
+        const hot_t* hot = store_hot(slot);
+        money_t value = scan->column == LOAN_COLUMN ? hot->loan_balance : hot->curr_balance;
+        if (value < scan->min || value > scan->max)
+            continue;
+        // only closed and never used slots can be all zero without an identity
+        if (hot->curr_balance == 0 && hot->loan_balance == 0 && store_cold(slot)->national_id[0] == '\0')
+            continue;
+        scan->count++;
+        scan->sum += value;
+        scan->smallest = value < scan->smallest ? value : scan->smallest;
+        scan->largest = value > scan->largest ? value : scan->largest;
+        scan->histogram[report_bucket(value)]++;
     }
-    uint32_t n_of_found_accounts = 0;
-    acc_t account = NULL_ACCOUNT;
-    acc_t buffer = NULL_ACCOUNT;
-    if (fread(&buffer, sizeof(acc_t), 1, file)==0)
-        return NULL_ACCOUNT; // clearing null account at start of file
-    while (fread(&buffer, sizeof(acc_t), 1, file) != 0){
-        if (verify_account_validity(buffer)==1) {
+    return NULL;
+}
+
+// global totals come from the running aggregates in the file header
+int print_report_totals(){
+    cache_write_back(); // dirty cached accounts have not reached the totals yet
+    if (!store.totals_trusted)
+        store_recount_totals();
+    const store_totals_t* totals = &store.header->totals;
+    money_t bank_balance = store.n_of_slots > ROOT_BANK_ACCOUNT.account_number ? store_hot(ROOT_BANK_ACCOUNT.account_number)->curr_balance : 0;
+    uint32_t n_of_customers = totals->n_of_accounts - (store.n_of_slots > ROOT_BANK_ACCOUNT.account_number);
+    char balance[LENGTH_OF_MONEY_TEXT], bank[LENGTH_OF_MONEY_TEXT], loans[LENGTH_OF_MONEY_TEXT];
+    format_money(totals->balance - bank_balance, balance);
+    format_money(bank_balance, bank);
+    format_money(totals->loans, loans);
+    printf("Customer accounts: %u, %u with a loan\n", n_of_customers, totals->n_of_loans);
+    printf("Customer balances: %s\n", balance);
+    printf("Outstanding loans: %s\n", loans);
+    printf("Bank balance: %s\n", bank);
+    return 0;
+}
+
+// filtered aggregates have to look at every account, the book is split between worker threads
+int print_report(int column, money_t min, money_t max){
+    cache_write_back(); // the scan reads the record file directly
+    long n_of_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_of_threads = n_of_cpus < 1 ? 1 : n_of_cpus > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : n_of_cpus;
+    uint32_t first_customer = ROOT_BANK_ACCOUNT.account_number + 1;
+    uint32_t n_of_accounts = store.n_of_slots > first_customer ? store.n_of_slots - first_customer : 0;
+    if (n_of_threads > n_of_accounts / SWEEP_BLOCK + 1)
+        n_of_threads = n_of_accounts / SWEEP_BLOCK + 1;
+    report_scan_t scans[MAX_WORKER_THREADS];
+    uint32_t per_thread = n_of_accounts / n_of_threads + 1;
+    uint32_t n_of_started = 0;
+    int result = 0;
+    for (uint32_t i = 0; i < n_of_threads; i++){
+        uint32_t first_slot = first_customer + i * per_thread;
+        uint32_t end_slot = first_slot + per_thread > store.n_of_slots ? store.n_of_slots : first_slot + per_thread;
+        scans[i] = (report_scan_t){0, first_slot < end_slot ? first_slot : end_slot, end_slot, column, min, max, 0, 0, max, min, {0}};
+        if (i == 0)
+            continue; // the calling thread takes the first chunk itself
+        if (pthread_create(&scans[i].thread, NULL, report_scan_main, &scans[i]) != 0){
+            printf("Error starting worker thread\n");
+            result = 1;
             break;
         }
-        n_of_found_accounts++;
-        account = buffer;
+        n_of_started = i;
     }
-    fseek(file, n_of_found_accounts * sizeof(acc_t), SEEK_SET);
-    fread(&account, sizeof(acc_t), 1, file);
-    fclose(file);
-    return account;
+    report_scan_main(&scans[0]);
+    report_scan_t total = scans[0];
+    for (uint32_t i = 1; i <= n_of_started; i++){
+        pthread_join(scans[i].thread, NULL);
+        total.count += scans[i].count;
+        total.sum += scans[i].sum;
+        total.smallest = scans[i].smallest < total.smallest ? scans[i].smallest : total.smallest;
+        total.largest = scans[i].largest > total.largest ? scans[i].largest : total.largest;
+        for (uint32_t j = 0; j < REPORT_BUCKETS; j++)
+            total.histogram[j] += scans[i].histogram[j];
+    }
+    if (result != 0){
+        printf("Error computing report\n");
+        return 1;
+    }
+    const char* name = column == LOAN_COLUMN ? "loan" : "balance";
+    char from[LENGTH_OF_MONEY_TEXT], to[LENGTH_OF_MONEY_TEXT], sum[LENGTH_OF_MONEY_TEXT];
+    format_money(min, from);
+    format_money(max, to);
+    format_money(total.sum, sum);
+    printf("Customer accounts with %s from %s to %s: %u, total %s\n", name, from, to, total.count, sum);
+    if (total.count == 0)
+        return 0;
+    char smallest[LENGTH_OF_MONEY_TEXT], largest[LENGTH_OF_MONEY_TEXT], mean[LENGTH_OF_MONEY_TEXT];
+    format_money(total.smallest, smallest);
+    format_money(total.largest, largest);
+    format_money(total.sum / total.count, mean);
+    printf("Min %s, max %s, mean %s\n", smallest, largest, mean);
+    printf("| %-*s | %-*s | %-*s |\n", LENGTH_OF_BALANCE, "From", LENGTH_OF_BALANCE, "To", LENGTH_OF_ACCOUNT_NUMBER, "Accounts");
+    for (uint32_t i = 0; i < REPORT_BUCKETS; i++){
+        if (total.histogram[i] == 0)
+            continue;
+        money_t ceiling = i + 1 < REPORT_BUCKETS ? report_bucket_floor(i + 1) - 1 : MAX_ACCOUNT_VALUE;
+        format_money(report_bucket_floor(i), from);
+        format_money(i == 0 ? 0 : ceiling, to);
+        printf("| %-*s | %-*s | %-*u |\n", LENGTH_OF_BALANCE, from, LENGTH_OF_BALANCE, to, LENGTH_OF_ACCOUNT_NUMBER, total.histogram[i]);
+    }
+    return 0;
 }
 
-int add_account(acc_t new_account) {
-    acc_t last_account = get_last_account();
-    new_account.account_number = last_account.account_number + 1;
-    if (verify_account_validity(new_account) != 0){
-        printf("Error adding account - invalid data\n");
+// "report" alone prints the running totals, "report <balance|loan> [min] [max]" aggregates one column
+// over the customer accounts whose value lies in the inclusive range
+int report_command(char* arguments){
+    while (*arguments == ' ' || *arguments == '\t')
+        arguments++;
+    if (*arguments == '\0')
+        return print_report_totals();
+    int column;
+    if (strncmp(arguments, "balance", 7) == 0)
+        column = BALANCE_COLUMN;
+    else if (strncmp(arguments, "loan", 4) == 0)
+        column = LOAN_COLUMN;
+    else {
+        printf("Unknown report - use report, report balance [min] [max] or report loan [min] [max]\n");
         return 1;
     }
-    FILE *file = fopen(RECORD_FILE, "ab");
-    if (file == NULL) {
-        printf("Error opening file\n");
+    money_t bounds[2] = {0, MAX_ACCOUNT_VALUE};
+    char* cursor = arguments + strcspn(arguments, " \t");
+    for (int i = 0; i < 2; i++){
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if (*cursor == '\0')
+            break;
+        if (parse_money(cursor, &bounds[i], &cursor) != 0){
+            printf("Invalid amount - use at most %d decimals\n", MONEY_DECIMALS);
+            return 1;
+        }
+    }
+    return print_report(column, bounds[0], bounds[1]);
+}
+
+int append_ranked_match(uint64_t** matches, uint32_t* n_of_matches, uint32_t* capacity, uint64_t match){
+    if (*n_of_matches == *capacity){
+        uint64_t* grown = realloc(*matches, (size_t)(*capacity + INDEX_GROWTH) * sizeof(uint64_t));
+        if (grown == NULL){
+            printf("Error collecting search results\n");
+            return 1;
+        }
+        *matches = grown;
+        *capacity += INDEX_GROWTH;
+    }
+    (*matches)[(*n_of_matches)++] = match;
+    return 0;
+}
+
+// accounts that may lie within limit edits of a query with these distinct trigrams; an edit breaks at most
+// three trigrams, so such a field shares at least n - 3 * limit of them and is listed under one of the
+// 3 * limit + 1 shortest lists; those are read when they are short, otherwise every list is read and
+// the accounts are counted, the verification a listed account costs outweighs reading a few more entries
+int find_trigram_candidates(const trigram_index_t* index, uint32_t* trigrams, uint32_t n_of_trigrams, uint32_t limit,
+                            uint32_t** candidates, uint32_t* n_of_candidates){
+    uint32_t n_of_shortest = 3 * limit + 1, capacity = 0;
+    uint64_t shortest_entries = 0, all_entries = 0;
+    for (uint32_t i = 1; i < n_of_trigrams; i++){ // shortest lists first
+        uint32_t trigram = trigrams[i], j = i;
+        for (; j > 0 && index->lists[trigrams[j - 1]].count > index->lists[trigram].count; j--)
+            trigrams[j] = trigrams[j - 1];
+        trigrams[j] = trigram;
+    }
+    for (uint32_t i = 0; i < n_of_trigrams; i++){
+        all_entries += index->lists[trigrams[i]].count;
+        if (i < n_of_shortest)
+            shortest_entries += index->lists[trigrams[i]].count;
+    }
+    bool counting = all_entries < shortest_entries * TRIGRAM_VERIFY_COST;
+    uint32_t n_of_read = counting ? n_of_trigrams : n_of_shortest;
+    uint32_t required = counting ? n_of_trigrams - 3 * limit : 1; // lists an account must be found in
+    if (trigram_counts.capacity < store.n_of_slots){
+        free(trigram_counts.stamps);
+        free(trigram_counts.counts);
+        trigram_counts.capacity = store.n_of_slots + INDEX_GROWTH;
+        trigram_counts.stamps = calloc(trigram_counts.capacity, sizeof(uint32_t));
+        trigram_counts.counts = malloc(trigram_counts.capacity);
+        trigram_counts.stamp = 0;
+        if (trigram_counts.stamps == NULL || trigram_counts.counts == NULL){
+            free(trigram_counts.stamps);
+            free(trigram_counts.counts);
+            trigram_counts = (trigram_counts_t){NULL, NULL, 0, 0};
+            printf("Error collecting search results\n");
+            return 1;
+        }
+    }
+    if (++trigram_counts.stamp == 0){ // stamps of searches long past would match again
+        memset(trigram_counts.stamps, 0, (size_t)trigram_counts.capacity * sizeof(uint32_t));
+        trigram_counts.stamp = 1;
+    }
+    uint32_t* stamps = trigram_counts.stamps;
+    uint8_t* counts = trigram_counts.counts;
+    int error = 0;
+    for (uint32_t i = 0; i < n_of_read && error == 0; i++){
+        const trigram_list_t* list = &index->lists[trigrams[i]];
+        for (uint32_t j = 0; j < list->count && error == 0; j++){
+            uint32_t account_number = list->accounts[j];
+            if (stamps[account_number] != trigram_counts.stamp){
+                stamps[account_number] = trigram_counts.stamp;
+                counts[account_number] = 0;
+            }
+            if (counts[account_number] < required && ++counts[account_number] == required)
+                error = append_match(candidates, n_of_candidates, &capacity, account_number);
+        }
+    }
+    return error;
+}
+
+int compare_ranked_matches(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// accounts whose field, folded like the query, starts within a few edits of it, closest first and ties by
+// account number; a query of n distinct trigrams allows (n - 1) / 3 edits up to FUZZY_MAX_DISTANCE, so that
+// its candidates share at least one trigram with it
+int find_similar_accounts(const trigram_index_t* index, const char* query, uint32_t** found, uint32_t* n_of_found){
+    char normalized[LENGTH_OF_NORMALIZED + 1], field[LENGTH_OF_NORMALIZED + 1];
+    uint32_t trigrams[LENGTH_OF_NORMALIZED];
+    size_t query_length = normalize_text(query, index->field_length, normalized, LENGTH_OF_NORMALIZED);
+    uint32_t n_of_trigrams = text_trigrams(normalized, query_length, trigrams);
+    uint32_t limit = n_of_trigrams == 0 ? 0 : (n_of_trigrams - 1) / 3;
+    if (limit > FUZZY_MAX_DISTANCE)
+        limit = FUZZY_MAX_DISTANCE;
+    uint32_t* candidates = NULL;
+    uint32_t n_of_candidates = 0, capacity = 0;
+    int error = 0;
+    if (n_of_trigrams != 0)
+        error = find_trigram_candidates(index, trigrams, n_of_trigrams, limit, &candidates, &n_of_candidates);
+    for (uint32_t i = 1; n_of_trigrams == 0 && i < store.n_of_slots && error == 0; i++)
+        error = append_match(&candidates, &n_of_candidates, &capacity, i); // an empty query is a prefix of every field
+
+    uint64_t* matches = NULL; // distance in the high half, account number in the low one
+    uint32_t n_of_matches = 0;
+    capacity = 0;
+    for (uint32_t i = 0; i < n_of_candidates && error == 0; i++){
+        uint32_t account_number = candidates[i];
+        store_check(account_number);
+        if (store_cold(account_number)->national_id[0] == '\0')
+            continue; // closed, possibly since it was listed
+        // prefixes longer than the query by more than the limit are too far from it
+        size_t field_length = normalize_text(index_field(index, account_number), index->field_length, field, query_length + limit);
+        uint32_t distance = prefix_edit_distance(normalized, query_length, field, field_length, limit);
+        if (distance <= limit)
+            error = append_ranked_match(&matches, &n_of_matches, &capacity, (uint64_t)distance << 32 | account_number);
+    }
+    free(candidates);
+    uint32_t* accounts = error == 0 ? malloc((size_t)(n_of_matches == 0 ? 1 : n_of_matches) * sizeof(uint32_t)) : NULL;
+    if (accounts == NULL){
+        if (error == 0)
+            printf("Error collecting search results\n");
+        free(matches);
         return 1;
     }
-    if (fseek(file, (new_account.account_number) * sizeof(acc_t), SEEK_SET) != 0) {
-        printf("Error adding account\n");
-        fclose(file);
+    qsort(matches, n_of_matches, sizeof(uint64_t), compare_ranked_matches);
+    for (uint32_t i = 0; i < n_of_matches; i++)
+        accounts[i] = (uint32_t)matches[i];
+    free(matches);
+    *found = accounts;
+    *n_of_found = n_of_matches;
+    return 0;
+}
+
+// account numbers matching the pattern, the caller frees them: a name, surname or address pattern is looked up
+// in its trigram index and ranked by edit distance, a national ID exactly or by prefix in ascending order
+int find_matching_accounts(acc_t pattern_acc, uint32_t** found, uint32_t* n_of_found){
+    uint32_t* matches = NULL;
+    uint32_t n_of_matches = 0, capacity = 0;
+    const trigram_index_t* index = NULL;
+    const char* query = NULL;
+    if (pattern_acc.name[0] != NULL_ACCOUNT.name[0]){
+        index = &trigram_indexes[NAME_INDEX];
+        query = pattern_acc.name;
+    } else if (pattern_acc.surname[0] != NULL_ACCOUNT.surname[0]){
+        index = &trigram_indexes[SURNAME_INDEX];
+        query = pattern_acc.surname;
+    } else if (pattern_acc.address[0] != NULL_ACCOUNT.address[0]){
+        index = &trigram_indexes[ADDRESS_INDEX];
+        query = pattern_acc.address;
+    }
+    if (ensure_indexes() != 0)
+        return 1;
+    cache_write_back();
+    if (index != NULL)
+        return find_similar_accounts(index, query, found, n_of_found);
+
+    int error = 0;
+    if (is_full_national_id(pattern_acc.national_id)){
+        // exact PESEL lookup through the hash index
+        uint32_t account_number = id_index.n_of_buckets == 0 ? 0 :
+                id_index.buckets[hash_national_id(pattern_acc.national_id) & (id_index.n_of_buckets - 1)];
+        for (; account_number != 0 && error == 0; account_number = id_index.next[account_number]){
+            if (strncmp(store_cold(account_number)->national_id, pattern_acc.national_id, LENGTH_OF_NATIONAL_ID) == 0)
+                error = append_match(&matches, &n_of_matches, &capacity, account_number);
+        }
+    } else {
+        for (uint32_t i = 0; i < store.n_of_slots && error == 0; i++){
+            acc_t account = store_get(i);
+            if (!is_account_closed(&account) && account_matches_pattern(&account, &pattern_acc))
+                error = append_match(&matches, &n_of_matches, &capacity, i);
+        }
+    }
+    if (error != 0){
+        free(matches);
         return 1;
     }
-    fwrite(&new_account, sizeof(acc_t), 1, file);
-    number_of_accounts++;
-    fclose(file);
+    qsort(matches, n_of_matches, sizeof(uint32_t), compare_account_numbers);
+    *found = matches;
+    *n_of_found = n_of_matches;
     return 0;
 }
 
-int populate_file_with_preset_accounts(){
-    for (int i = 0; i < sizeof(PRESET_ACCOUNTS)/sizeof(acc_t); i++){
-        if(add_account(PRESET_ACCOUNTS[i]) != 0)
+int print_matching_accounts(acc_t pattern_acc, int view_mode){
+    uint32_t* matches = NULL;
+    uint32_t n_of_matches = 0;
+    if (find_matching_accounts(pattern_acc, &matches, &n_of_matches) != 0)
+        return 1;
+    int result = print_accounts(matches, n_of_matches, view_mode);
+    free(matches);
+    return result;
+}
+
+int search_for_account(uint32_t search_option, char* prev_search_string){
+    acc_t account = NULL_ACCOUNT;
+    char search_string[MAX_COMMAND_LENGTH];
+    bool no_same_line_arg_passed = true;
+    if (strlen(prev_search_string)>1) {
+        no_same_line_arg_passed = false;
+        while (*prev_search_string==' ' || *prev_search_string=='\t')
+            prev_search_string++;
+        strncpy(search_string, prev_search_string, MAX_COMMAND_LENGTH);
+    }
+    switch (search_option) {
+        case 1:
+            if (no_same_line_arg_passed) {
+                printf("enter account number\n");
+                get_and_clean_input(search_string, MAX_COMMAND_LENGTH);
+            }
+            account = get_account(strtol(search_string, NULL, 10));
+            if (account.account_number == NULL_ACCOUNT.account_number){
+                printf("Account not found\n");
+                return 1;
+            }
+            print_table_header(global_view_mode);
+            print_account_as_table(account, global_view_mode);
+            return 0;
+        case 2:
+            if(no_same_line_arg_passed){
+                printf("enter name\n");
+                get_and_clean_input(account.name, LENGTH_OF_NAME);
+            } else {
+                strncpy(account.name, search_string, LENGTH_OF_NAME);
+            }
+            break;
+        case 3:
+            if(no_same_line_arg_passed){
+                printf("enter surname\n");
+                get_and_clean_input(account.surname, LENGTH_OF_SURNAME);
+            } else {
+                strncpy(account.surname, search_string, LENGTH_OF_SURNAME);
+            }
+            break;
+        case 4:
+            if(no_same_line_arg_passed){
+                printf("enter address\n");
+                get_and_clean_input(account.address, LENGTH_OF_ADDRESS);
+            } else {
+                strncpy(account.address, search_string, LENGTH_OF_ADDRESS);
+            }
+            break;
+        case 5:
+            if(no_same_line_arg_passed){
+                printf("enter national ID\n");
+                get_and_clean_input(account.national_id, LENGTH_OF_NATIONAL_ID+1);
+            } else {
+                strncpy(account.national_id, search_string, LENGTH_OF_NATIONAL_ID);
+            }
+            break;
+        default:
+            printf("Invalid search option\n");
+            print_search_help();
             return 1;
     }
+    print_matching_accounts(account, global_view_mode);
     return 0;
 }
 
-int convert_newlines_to_whitespace(char* string, int length){
-    for (int i = 0; i < length; i++){
-        if (string[i] == '\n')
-            string[i] = ' ';
-        else if (string[i] == '\0')
+// "<account>,<account or amount>,..." after the operation name, all fields must be present and numeric;
+// the last of two or more fields is an amount with up to MONEY_DECIMALS decimals, read in minor units
+int parse_batch_fields(const char* cursor, int64_t* values, int n_of_values){
+    for (int i = 0; i < n_of_values; i++){
+        if (*cursor != ',')
+            return 1;
+        cursor++;
+        char* endptr;
+        if (i != 0 && i == n_of_values - 1){
+            if (parse_money(cursor, &values[i], &endptr) != 0)
+                return 1;
+        } else {
+            values[i] = strtoll(cursor, &endptr, 10);
+            if (endptr == cursor)
+                return 1;
+        }
+        cursor = endptr;
+    }
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')
+        cursor++;
+    return *cursor != '\0';
+}
+
+bool is_valid_batch_account(int64_t value){
+    return value > 0 && value <= UINT32_MAX;
+}
+
+bool is_valid_batch_amount(int64_t value){
+    return value >= -MAX_ACCOUNT_VALUE && value <= MAX_ACCOUNT_VALUE;
+}
+
+int apply_batch_line(const char* line){
+    int64_t values[3];
+    size_t name_length = strcspn(line, ",");
+    for (int cmd_id = 2; cmd_id <= 6; cmd_id++){ // deposit, withdraw, borrow, repay, transfer
+        if (strlen(COMMANDS[cmd_id]) != name_length || strncmp(line, COMMANDS[cmd_id], name_length) != 0)
+            continue;
+        int n_of_values = cmd_id == 6 ? 3 : 2;
+        if (parse_batch_fields(line + name_length, values, n_of_values) != 0 ||
+            !is_valid_batch_account(values[0]) || !is_valid_batch_amount(values[n_of_values - 1]) ||
+            (n_of_values == 3 && !is_valid_batch_account(values[1]))){
+            printf("Malformed batch line\n");
             return 1;
+        }
+        uint32_t other_account = n_of_values == 3 ? values[1] : values[0];
+        uint64_t started = stats_clock();
+        int result;
+        lock_accounts(values[0], other_account);
+        switch (cmd_id){
+            case 2:
+                result = make_deposit(values[0], values[1]);
+                break;
+            case 3:
+                result = make_withdraw(values[0], values[1]);
+                break;
+            case 4:
+                result = take_loan(values[0], values[1]);
+                break;
+            case 5:
+                result = repay_loan(values[0], values[1]);
+                break;
+            default:
+                result = make_transfer(values[0], values[1], values[2]);
+                break;
+        }
+        unlock_accounts(values[0], other_account);
+        stats_record(cmd_id, started, result);
+        return result;
+    }
+    printf("Unknown batch operation\n");
+    return 1;
+}
+
+// next line worth applying; blank lines and # comments are skipped, overlong lines are rejected here
+int read_batch_line(FILE* input, char* line, unsigned long* line_number, unsigned long* n_of_rejected){
+    while (fgets(line, MAX_BATCH_LINE_LENGTH, input) != NULL){
+        (*line_number)++;
+        size_t length = strlen(line);
+        if (length == MAX_BATCH_LINE_LENGTH - 1 && line[length - 1] != '\n'){
+            int c;
+            while ((c = fgetc(input)) != '\n' && c != EOF);
+            printf("Batch line %lu rejected: line too long\n", *line_number);
+            (*n_of_rejected)++;
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        return 1;
     }
     return 0;
 }
 
-int get_and_clean_input(char* input_buffer, int buffer_size) {
-    fgets(input_buffer, buffer_size, stdin);
-    int len = strlen(input_buffer);
-    if (len == 0){
+void batch_queue_push(batch_chunk_t* chunk){
+    pthread_mutex_lock(&batch_queue.lock);
+    while (batch_queue.count == BATCH_QUEUE_CHUNKS)
+        pthread_cond_wait(&batch_queue.not_full, &batch_queue.lock);
+    batch_queue.chunks[(batch_queue.head + batch_queue.count) % BATCH_QUEUE_CHUNKS] = chunk;
+    batch_queue.count++;
+    pthread_cond_signal(&batch_queue.not_empty);
+    pthread_mutex_unlock(&batch_queue.lock);
+}
+
+// NULL once the queue is closed and drained
+batch_chunk_t* batch_queue_pop(){
+    pthread_mutex_lock(&batch_queue.lock);
+    while (batch_queue.count == 0 && !batch_queue.closed)
+        pthread_cond_wait(&batch_queue.not_empty, &batch_queue.lock);
+    batch_chunk_t* chunk = NULL;
+    if (batch_queue.count != 0){
+        chunk = batch_queue.chunks[batch_queue.head];
+        batch_queue.head = (batch_queue.head + 1) % BATCH_QUEUE_CHUNKS;
+        batch_queue.count--;
+        pthread_cond_signal(&batch_queue.not_full);
+    }
+    pthread_mutex_unlock(&batch_queue.lock);
+    return chunk;
+}
+
+void batch_queue_close(){
+    pthread_mutex_lock(&batch_queue.lock);
+    batch_queue.closed = true;
+    pthread_cond_broadcast(&batch_queue.not_empty);
+    pthread_mutex_unlock(&batch_queue.lock);
+}
+
+void* batch_worker_main(void* arg){
+    batch_worker_t* worker = arg;
+    worker_id = worker->id;
+    batch_chunk_t* chunk;
+    while ((chunk = batch_queue_pop()) != NULL){
+        for (uint32_t i = 0; i < chunk->n_of_lines; i++){
+            if (apply_batch_line(chunk->lines[i]) == 0){
+                worker->n_of_applied++;
+            } else {
+                printf("Batch line %lu rejected: %s\n", chunk->line_numbers[i], chunk->lines[i]);
+                worker->n_of_rejected++;
+            }
+        }
+        free(chunk);
+    }
+    return NULL;
+}
+
+void engine_start(){
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_init(&account_locks[i], NULL);
+    for (int i = 0; i < BANK_SHARDS; i++)
+        pthread_mutex_init(&bank_shards[i].lock, NULL);
+    bank_opening_balance = get_account(ROOT_BANK_ACCOUNT.account_number).curr_balance;
+    bank_shards_spread(bank_opening_balance);
+    bank_sharded = true;
+    engine_running = true;
+    batch_queue.head = 0;
+    batch_queue.count = 0;
+    batch_queue.closed = false;
+}
+
+// folds the bank's sub-balances back into its record
+int engine_stop(){
+    engine_running = false;
+    acc_t bank_account = get_account(ROOT_BANK_ACCOUNT.account_number);
+    bank_sharded = false;
+    for (int i = 0; i < LOCK_STRIPES; i++)
+        pthread_mutex_destroy(&account_locks[i]);
+    for (int i = 0; i < BANK_SHARDS; i++)
+        pthread_mutex_destroy(&bank_shards[i].lock);
+    if (bank_account.curr_balance != bank_opening_balance){
+        ledger_entry_t entry = ledger_entry(LEDGER_SETTLEMENT, &bank_account, 0, bank_account.curr_balance - bank_opening_balance, 0);
+        if (ledger_record(&entry, 1) != 0)
+            return 1;
+    }
+    return working_set_put(&bank_account);
+}
+
+// lines are dealt out in chunks; lines of one chunk apply in file order,
+// different chunks may interleave, and every operation only locks the accounts it touches
+int run_batch_parallel(FILE* input, uint32_t n_of_threads, unsigned long* n_of_applied, unsigned long* n_of_rejected){
+    batch_worker_t workers[MAX_WORKER_THREADS];
+    unsigned long line_number = 0;
+    uint32_t n_of_started = 0;
+    int result = 0;
+    engine_start();
+    for (; n_of_started < n_of_threads; n_of_started++){
+        workers[n_of_started] = (batch_worker_t){0, n_of_started, 0, 0};
+        if (pthread_create(&workers[n_of_started].thread, NULL, batch_worker_main, &workers[n_of_started]) != 0){
+            printf("Error starting worker thread\n");
+            result = 1;
+            break;
+        }
+    }
+    batch_chunk_t* chunk = NULL;
+    while (result == 0 && n_of_started != 0){
+        if (chunk == NULL && (chunk = malloc(sizeof(batch_chunk_t))) == NULL){
+            printf("Error allocating batch chunk\n");
+            result = 1;
+            break;
+        }
+        chunk->n_of_lines = 0;
+        while (chunk->n_of_lines < BATCH_CHUNK_LINES &&
+               read_batch_line(input, chunk->lines[chunk->n_of_lines], &line_number, n_of_rejected))
+            chunk->line_numbers[chunk->n_of_lines++] = line_number;
+        if (chunk->n_of_lines == 0)
+            break;
+        batch_queue_push(chunk);
+        chunk = NULL;
+        stats_maybe_dump();
+    }
+    free(chunk);
+    batch_queue_close();
+    for (uint32_t i = 0; i < n_of_started; i++){
+        pthread_join(workers[i].thread, NULL);
+        *n_of_applied += workers[i].n_of_applied;
+        *n_of_rejected += workers[i].n_of_rejected;
+    }
+    if (engine_stop() != 0)
+        result = 1;
+    return result;
+}
+
+// applies a settlement file (or stdin for "-") against an in-memory working set,
+// then writes the dirty accounts back as one journaled operation
+int run_batch(const char* path, uint32_t n_of_threads){
+    FILE* input = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (input == NULL){
+        printf("Error opening batch file\n");
         return 1;
-    } else if (len >= buffer_size - 1) {
-        int c;
-        bool truncated = false;
-        while ((c = getchar()) != '\n' && c != EOF)
-            truncated = true;
-        if (truncated)
-            printf("Input too long, truncating\n");
     }
-    convert_newlines_to_whitespace(input_buffer, len);
+    REQUIRE_CONFIRMATION_ON_EDIT = false;
+    REPORT_SUCCESS = false;
+    cache_clear();
+    working_set_active = true;
+    char line[MAX_BATCH_LINE_LENGTH];
+    unsigned long line_number = 0, n_of_applied = 0, n_of_rejected = 0;
+    int result = 0;
+    if (n_of_threads > 1){
+        result = run_batch_parallel(input, n_of_threads, &n_of_applied, &n_of_rejected);
+    } else {
+        while (read_batch_line(input, line, &line_number, &n_of_rejected)){
+            if (apply_batch_line(line) == 0){
+                n_of_applied++;
+            } else {
+                printf("Batch line %lu rejected: %s\n", line_number, line);
+                n_of_rejected++;
+            }
+            stats_maybe_dump();
+        }
+    }
+    if (input != stdin)
+        fclose(input);
+    if (result != 0){
+        working_set_clear();
+        printf("Batch failed - no changes were applied\n");
+        return result;
+    }
+    uint32_t n_of_dirty = working_set_count();
+    result = working_set_write_back();
+    if (result == 0)
+        printf("Batch complete: %lu applied, %lu rejected, %u accounts written back\n", n_of_applied, n_of_rejected, n_of_dirty);
+    else
+        printf("Batch failed during write-back - no changes were applied\n");
+    return result;
+}
+
+bool is_leap_year(int year){
+    return year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+}
+
+int days_in_month(int year, int month){
+    static const int DAYS[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return month == 2 && is_leap_year(year) ? 29 : DAYS[month - 1];
+}
+
+// days since 1970-01-01 of a civil date
+int32_t day_from_date(int year, int month, int month_day){
+    year -= month <= 2; // years counted from March, so the leap day ends them
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    int32_t year_of_era = year - era * 400;
+    int32_t day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + month_day - 1;
+    int32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// civil date of a day counted from 1970-01-01
+void date_from_day(int32_t day, int* year, int* month, int* month_day){
+    int32_t days = day + 719468; // shift the epoch to 0000-03-01
+    int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int32_t day_of_era = days - era * 146097;
+    int32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int32_t shifted_month = (5 * day_of_year + 2) / 153;
+    *month_day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    *month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+int32_t today(){
+    time_t now = time(NULL);
+    struct tm time_parts;
+    localtime_r(&now, &time_parts);
+    return day_from_date(time_parts.tm_year + 1900, time_parts.tm_mon + 1, time_parts.tm_mday);
+}
+
+// "YYYY-MM-DD" or "today"
+int parse_date(const char* text, int32_t* day, char** end){
+    int year, month, month_day, length = 0;
+    if (strncmp(text, "today", 5) == 0){
+        *day = today();
+        length = 5;
+    } else {
+        if (sscanf(text, "%4d-%2d-%2d%n", &year, &month, &month_day, &length) != 3 || year < 1970 ||
+            month < 1 || month > 12 || month_day < 1 || month_day > days_in_month(year, month))
+            return 1;
+        *day = day_from_date(year, month, month_day);
+    }
+    if (end != NULL)
+        *end = (char*)text + length;
+    return 0;
+}
+
+void format_date(int32_t day, char* text){
+    int year, month, month_day;
+    date_from_day(day, &year, &month, &month_day);
+    snprintf(text, LENGTH_OF_DATE + 1, "%04d-%02d-%02d", year, month, month_day);
+}
+
+bool is_standing_order_before(const standing_order_t* a, const standing_order_t* b){
+    if (a->next_due != b->next_due)
+        return a->next_due < b->next_due;
+    return a->id < b->id;
+}
+
+void standing_orders_sift_down(uint32_t position){
+    const standing_order_t* orders = standing_orders.orders;
+    uint32_t* heap = standing_orders.heap;
+    uint32_t entry = heap[position];
+    for (uint32_t child = 2 * position + 1; child < standing_orders.n_of_heap; child = 2 * position + 1){
+        if (child + 1 < standing_orders.n_of_heap && is_standing_order_before(&orders[heap[child + 1]], &orders[heap[child]]))
+            child++;
+        if (!is_standing_order_before(&orders[heap[child]], &orders[entry]))
+            break;
+        heap[position] = heap[child];
+        position = child;
+    }
+    heap[position] = entry;
+}
+
+void standing_orders_sift_up(uint32_t position){
+    const standing_order_t* orders = standing_orders.orders;
+    uint32_t* heap = standing_orders.heap;
+    uint32_t entry = heap[position];
+    while (position > 0 && is_standing_order_before(&orders[entry], &orders[heap[(position - 1) / 2]])){
+        heap[position] = heap[(position - 1) / 2];
+        position = (position - 1) / 2;
+    }
+    heap[position] = entry;
+}
+
+int standing_orders_reserve(uint32_t capacity){
+    if (capacity <= standing_orders.capacity)
+        return 0;
+    capacity = capacity < 2 * standing_orders.capacity ? 2 * standing_orders.capacity : capacity;
+    standing_order_t* orders = realloc(standing_orders.orders, (size_t)capacity * sizeof(standing_order_t));
+    if (orders != NULL)
+        standing_orders.orders = orders;
+    uint32_t* heap = orders == NULL ? NULL : realloc(standing_orders.heap, (size_t)capacity * sizeof(uint32_t));
+    if (heap == NULL){
+        printf("Error growing standing orders\n");
+        return 1;
+    }
+    standing_orders.heap = heap;
+    standing_orders.capacity = capacity;
     return 0;
 }
 
-int add_account_from_input(){
-    acc_t new_account = {0};
-    char temp_balance[LENGTH_OF_BALANCE], temp_loan_balance[LENGTH_OF_LOAN_BALANCE], temp_interest_rate[LENGTH_OF_INTEREST_RATE];
-    printf("Enter name: ");
-    get_and_clean_input(new_account.name, LENGTH_OF_NAME);
-    printf("Enter surname: ");
-    get_and_clean_input(new_account.surname, LENGTH_OF_SURNAME);
-    printf("Enter address: ");
-    get_and_clean_input(new_account.address, LENGTH_OF_ADDRESS);
-    printf("Enter national ID: ");
-    get_and_clean_input(new_account.national_id, LENGTH_OF_NATIONAL_ID+1);
-    printf("Enter current balance: ");
-    get_and_clean_input(temp_balance, LENGTH_OF_BALANCE);
-    new_account.curr_balance = strtol(temp_balance, NULL, 10);
-    printf("Enter loan balance: ");
-    get_and_clean_input(temp_loan_balance, LENGTH_OF_LOAN_BALANCE);
-    new_account.loan_balance = strtol(temp_loan_balance, NULL, 10);
-    printf("Enter interest rate: ");
-    get_and_clean_input(temp_interest_rate, LENGTH_OF_INTEREST_RATE);
-    new_account.interest_rate = strtod(temp_interest_rate, NULL);
-    printf("Account to be added:\n");
-    print_table_header(global_view_mode);
-    print_account_as_table(new_account, global_view_mode);
-    if (get_confirmation() == false || add_account(new_account)==1){
+// drops the loaded orders, the file is read again on next use
+void standing_orders_discard(){
+    if (standing_orders.fd >= 0)
+        close(standing_orders.fd);
+    free(standing_orders.orders);
+    free(standing_orders.heap);
+    standing_orders = (standing_orders_t){-1, {{0}, 0, 0, 0, 0, 0, 0}, NULL, NULL, 0, 0};
+}
+
+void standing_orders_close(){
+    if (standing_orders.fd >= 0 && fdatasync(standing_orders.fd) != 0)
+        printf("Error flushing standing orders\n");
+    standing_orders_discard();
+}
+
+// a new file left by a run that stopped before replacing the orders is put in place if the ledger holds
+// the first entry of the run's write-back, and dropped if it does not, so no order is paid twice or skipped.
+// Runs once the journal is replayed, which restores the entries of a journaled write-back
+int standing_orders_settle_run(){
+    int fd = open(STANDING_ORDERS_FILE ".new", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    standing_orders_header_t header;
+    ledger_entry_t entry;
+    bool committed = pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                     memcmp(header.magic, STANDING_ORDERS_MAGIC, sizeof(header.magic)) == 0 &&
+                     (header.ledger_timestamp == 0 ||
+                      (header.ledger_position < ledger.n_of_entries + ledger.n_of_chunk &&
+                       ledger_read(header.ledger_position, &entry) == 0 && entry.timestamp == header.ledger_timestamp &&
+                       entry.account_number == header.ledger_account && entry.counterparty == header.ledger_counterparty));
+    close(fd);
+    if (committed ? rename(STANDING_ORDERS_FILE ".new", STANDING_ORDERS_FILE) != 0 : unlink(STANDING_ORDERS_FILE ".new") != 0){
+        printf("Error settling the last standing orders run\n");
         return 1;
     }
-    printf("Account added successfully\n");
-
     return 0;
 }
 
-int paste_account_at_number(uint32_t account_number, acc_t new_account, bool preauthorized) {
-    if(!preauthorized && REQUIRE_CONFIRMATION_ON_EDIT && get_confirmation()==false){
-        printf("Operation aborted\n");
+int standing_orders_load(){
+    if (standing_orders.fd >= 0)
+        return 0;
+    if (standing_orders_settle_run() != 0)
+        return 1;
+    int fd = open(STANDING_ORDERS_FILE, O_RDWR | O_CREAT, 0644);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0){
+        printf("Error opening standing orders\n");
+        if (fd >= 0)
+            close(fd);
         return 1;
     }
-    if(verify_account_validity(new_account) != 0){
-        printf("Error updating account - invalid data\n");
+    standing_orders.fd = fd;
+    standing_orders_header_t* header = &standing_orders.header;
+    if (file_stat.st_size == 0){
+        memcpy(header->magic, STANDING_ORDERS_MAGIC, sizeof(header->magic));
+        header->n_of_orders = 0;
+        header->next_id = 1;
+        header->ledger_position = 0;
+        header->ledger_timestamp = 0;
+        header->ledger_account = 0;
+        header->ledger_counterparty = 0;
+        if (pwrite(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header)){
+            printf("Error writing standing orders\n");
+            standing_orders_discard();
+            return 1;
+        }
+    } else if (pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+               memcmp(header->magic, STANDING_ORDERS_MAGIC, sizeof(header->magic)) != 0 ||
+               (uint64_t)file_stat.st_size < sizeof(*header) + (uint64_t)header->n_of_orders * sizeof(standing_order_t)){
+        printf("Standing orders file is damaged\n");
+        standing_orders_discard();
         return 1;
     }
-    FILE *file = fopen(RECORD_FILE, "rb+");
-    if (file == NULL) {
-        printf("Error opening file\n");
+    uint32_t n_of_orders = header->n_of_orders;
+    if (standing_orders_reserve(n_of_orders < INDEX_GROWTH ? INDEX_GROWTH : n_of_orders) != 0){
+        standing_orders_discard();
         return 1;
     }
-    if (fseek(file, account_number * sizeof(acc_t), SEEK_SET) != 0) {
-        printf("Error finding account - id possibly out of range\n");
-        fclose(file);
+    size_t size = (size_t)n_of_orders * sizeof(standing_order_t);
+    if (pread(fd, standing_orders.orders, size, sizeof(*header)) != (ssize_t)size){
+        printf("Error reading standing orders\n");
+        standing_orders_discard();
         return 1;
     }
-    new_account.account_number = account_number;
-    fwrite(&new_account, sizeof(acc_t), 1, file);
-    fclose(file);
+    for (uint32_t i = 0; i < n_of_orders; i++)
+        standing_orders.heap[i] = i;
+    standing_orders.n_of_heap = n_of_orders;
+    for (uint32_t i = n_of_orders / 2; i-- > 0;)
+        standing_orders_sift_down(i);
     return 0;
 }
 
-int make_deposit(uint32_t account_number, int32_t deposit_value){
-    if (deposit_value <= 0){
-        printf("Deposit value must be positive\n");
+int standing_orders_write(uint32_t position){
+    off_t offset = sizeof(standing_orders_header_t) + (off_t)position * sizeof(standing_order_t);
+    if (pwrite(standing_orders.fd, &standing_orders.orders[position], sizeof(standing_order_t), offset) != (ssize_t)sizeof(standing_order_t) ||
+        pwrite(standing_orders.fd, &standing_orders.header, sizeof(standing_orders_header_t), 0) != (ssize_t)sizeof(standing_orders_header_t)){
+        printf("Error writing standing orders\n");
         return 1;
     }
-    if (deposit_value > MAX_DEPOSIT){
-        printf("Deposit value exceeds maximum deposit value (%d)\n", MAX_DEPOSIT);
+    return 0;
+}
+
+// position of the order in the id-ordered table, or the number of orders when there is none
+uint32_t standing_order_position(uint32_t id){
+    uint32_t low = 0, high = standing_orders.header.n_of_orders;
+    while (low < high){
+        uint32_t mid = low + (high - low) / 2;
+        if (standing_orders.orders[mid].id < id)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low < standing_orders.header.n_of_orders && standing_orders.orders[low].id != id)
+        return standing_orders.header.n_of_orders;
+    return low;
+}
+
+void standing_order_advance(standing_order_t* order){
+    if (order->period_unit == 'd'){
+        order->next_due += order->period;
+        return;
+    }
+    int year, month, month_day;
+    date_from_day(order->next_due, &year, &month, &month_day);
+    month += order->period - 1;
+    year += month / 12;
+    month = month % 12 + 1;
+    month_day = order->day_of_month < days_in_month(year, month) ? order->day_of_month : days_in_month(year, month);
+    order->next_due = day_from_date(year, month, month_day);
+}
+
+// the accounts are checked when the order is set up, the payment itself is checked like any transfer when due
+int add_standing_order(uint32_t source, uint32_t destination, money_t amount, uint16_t period, char period_unit, int32_t first_due){
+    if (source == destination){
+        printf("Cannot transfer to the same account\n");
         return 1;
     }
-    acc_t account = get_account(account_number);
-    if (account.account_number == NULL_ACCOUNT.account_number){
+    acc_t source_account = get_account(source), destination_account = get_account(destination);
+    if (source_account.account_number == NULL_ACCOUNT.account_number ||
+        destination_account.account_number == NULL_ACCOUNT.account_number){
         printf("Account not found\n");
         return 1;
     }
-    if(account.curr_balance + deposit_value > MAX_ACCOUNT_VALUE){
-        printf("Deposit exceeds maximum account value (%d)\n", MAX_ACCOUNT_VALUE);
+    if (amount <= 0 || amount > MAX_TRANSFER){
+        char limit[LENGTH_OF_MONEY_TEXT];
+        format_money(MAX_TRANSFER, limit);
+        printf("Standing order amount must be positive and at most %s\n", limit);
         return 1;
     }
-    account.curr_balance += deposit_value;
-    if (paste_account_at_number(account_number, account, false)==1)
+    if (standing_orders_load() != 0 || standing_orders_reserve(standing_orders.header.n_of_orders + 1) != 0)
         return 1;
-    else
-        return 0;
-}
-
-int make_withdraw(uint32_t account_number, int32_t withdraw_value){
-    if (withdraw_value <= 0){
-        printf("Withdraw value must be positive\n");
+    int year, month, month_day;
+    date_from_day(first_due, &year, &month, &month_day);
+    uint32_t position = standing_orders.header.n_of_orders;
+    standing_orders.orders[position] = (standing_order_t){standing_orders.header.next_id, source, destination, first_due,
+                                                          amount, period, period_unit, (uint8_t)month_day, 0, {0}, {0}, {0}};
+    memcpy(standing_orders.orders[position].source_id, source_account.national_id, LENGTH_OF_NATIONAL_ID);
+    memcpy(standing_orders.orders[position].destination_id, destination_account.national_id, LENGTH_OF_NATIONAL_ID);
+    standing_orders.header.n_of_orders++;
+    standing_orders.header.next_id++;
+    if (standing_orders_write(position) != 0){
+        standing_orders_discard();
         return 1;
     }
-    if (withdraw_value > MAX_WITHDRAW){
-        printf("Withdraw value exceeds maximum withdraw value (%d)\n", MAX_WITHDRAW);
+    standing_orders.heap[standing_orders.n_of_heap++] = position;
+    standing_orders_sift_up(standing_orders.n_of_heap - 1);
+    printf("Standing order %u added\n", standing_orders.orders[position].id);
+    return 0;
+}
+
+// the order stays in the heap until it comes up, a run drops it then
+int cancel_standing_order(uint32_t id){
+    if (standing_orders_load() != 0)
         return 1;
-    }
-    acc_t account = get_account(account_number);
-    if (account.account_number == NULL_ACCOUNT.account_number){
-        printf("Account not found\n");
+    uint32_t position = standing_order_position(id);
+    if (position == standing_orders.header.n_of_orders || standing_orders.orders[position].cancelled){
+        printf("Standing order not found\n");
         return 1;
     }
-    if(account.curr_balance - withdraw_value < 0){
-        printf("Withdraw exceeds account balance\n");
+    standing_orders.orders[position].cancelled = 1;
+    if (standing_orders_write(position) != 0){
+        standing_orders_discard();
         return 1;
     }
-    account.curr_balance -= withdraw_value;
-    if (paste_account_at_number(account_number, account, false)==1)
-        return 1;
-    else
-        return 0;
+    printf("Standing order %u cancelled\n", id);
+    return 0;
 }
 
-int take_loan(uint32_t account_number, int32_t loan_value){
-    if (loan_value <= 0){
-        printf("Loan value must be positive\n");
+// both accounts still belong to the customers the order was made for
+bool standing_order_holders_kept(const standing_order_t* order){
+    if (order->source >= store.n_of_slots || order->destination >= store.n_of_slots)
+        return false;
+    store_check(order->source);
+    store_check(order->destination);
+    return memcmp(store_cold(order->source)->national_id, order->source_id, LENGTH_OF_NATIONAL_ID) == 0 &&
+           memcmp(store_cold(order->destination)->national_id, order->destination_id, LENGTH_OF_NATIONAL_ID) == 0;
+}
+
+// the account's number goes to the next customer, so the orders from or to it end with it
+int standing_orders_close_account(uint32_t account_number){
+    if (standing_orders_load() != 0)
         return 1;
+    for (uint32_t i = 0; i < standing_orders.header.n_of_orders; i++){
+        standing_order_t* order = &standing_orders.orders[i];
+        if (order->cancelled || (order->source != account_number && order->destination != account_number))
+            continue;
+        order->cancelled = 1;
+        if (standing_orders_write(i) != 0){
+            standing_orders_discard();
+            return 1;
+        }
+        printf("Standing order %u cancelled\n", order->id);
     }
-    if (loan_value > MAX_BORROW){
-        printf("Loan value exceeds maximum loan value (%d)\n", MAX_BORROW);
+    return 0;
+}
+
+// only an empty account can be closed; its slot goes on the free list for the next add
+int close_account(uint32_t account_number){
+    if (account_number == ROOT_BANK_ACCOUNT.account_number){
+        printf("The bank account cannot be closed\n");
         return 1;
     }
     acc_t account = get_account(account_number);
@@ -499,228 +6180,722 @@ int take_loan(uint32_t account_number, int32_t loan_value){
         printf("Account not found\n");
         return 1;
     }
-    if (account.curr_balance + loan_value > MAX_ACCOUNT_VALUE){
-        printf("New account value exceeds max account value (%d)\n", MAX_ACCOUNT_VALUE);
+    if (account.curr_balance != 0 || account.loan_balance != 0){
+        printf("Account still holds a balance or a loan - withdraw and repay before closing\n");
         return 1;
     }
-    if(account.loan_balance + loan_value > MAX_LOAN_VALUE){
-        printf("Loan exceeds maximum loan value (%d)\n", MAX_LOAN_VALUE);
-        return 1;
-    }
-    acc_t bank_account = get_account(ROOT_BANK_ACCOUNT.account_number);
-    if (loan_value > bank_account.curr_balance){
-        printf("Bank does not have enough funds to provide loan\n");
-        return 1;
-    }
-    bank_account.curr_balance -= loan_value;
-    account.loan_balance += loan_value;
-    account.curr_balance += loan_value;
-    if (!get_confirmation()){
+    if (REQUIRE_CONFIRMATION_ON_EDIT && get_confirmation() == false){
         printf("Operation aborted\n");
         return 1;
     }
-    if (paste_account_at_number(account_number, account, true)==1 ||
-        paste_account_at_number(ROOT_BANK_ACCOUNT.account_number, bank_account, true)==1)
+    acc_t tombstone = NULL_ACCOUNT;
+    tombstone.account_number = account_number;
+    ledger_entry_t entry = ledger_entry(LEDGER_CLOSE, &tombstone, 0, 0, 0);
+    if (commit_accounts(&tombstone, 1, &entry, 1) != 0)
         return 1;
-    else
-        return 0;
+    if (store.free_list_trusted)
+        store_free_push(account_number);
+    if (standing_orders_close_account(account_number) != 0)
+        return 1;
+    if (REPORT_SUCCESS)
+        printf("Account %u closed\n", account_number);
+    return 0;
 }
 
-int repay_loan(uint32_t account_number, int32_t payment_value){
-    if (payment_value <= 0){
-        printf("Payment value must be positive\n");
+// orders from or to the account, every order for account 0
+int print_standing_orders(uint32_t account_number){
+    if (standing_orders_load() != 0)
         return 1;
+    uint32_t n_of_printed = 0;
+    for (uint32_t i = 0; i < standing_orders.header.n_of_orders; i++){
+        const standing_order_t* order = &standing_orders.orders[i];
+        if (order->cancelled || (account_number != 0 && order->source != account_number && order->destination != account_number))
+            continue;
+        if (n_of_printed++ == 0)
+            printf("| %-*s | %-*s | %-*s | %-*s | %-*s | %-*s |\n", LENGTH_OF_ACCOUNT_NUMBER, "Order", LENGTH_OF_ACCOUNT_NUMBER, "From",
+                   LENGTH_OF_ACCOUNT_NUMBER, "To", LENGTH_OF_BALANCE, "Amount", 6, "Every", LENGTH_OF_DATE, "Next due");
+        char amount[LENGTH_OF_MONEY_TEXT], due[LENGTH_OF_DATE + 1], period[8];
+        format_money(order->amount, amount);
+        format_date(order->next_due, due);
+        snprintf(period, sizeof(period), "%u%c", order->period, order->period_unit);
+        printf("| %0*u | %0*u | %0*u | %-*s | %-*s | %-*s |\n", LENGTH_OF_ACCOUNT_NUMBER, order->id, LENGTH_OF_ACCOUNT_NUMBER, order->source,
+               LENGTH_OF_ACCOUNT_NUMBER, order->destination, LENGTH_OF_BALANCE, amount, 6, period, LENGTH_OF_DATE, due);
     }
-    acc_t account = get_account(account_number);
-    if (account.account_number == NULL_ACCOUNT.account_number){
-        printf("Account not found\n");
-        return 1;
+    if (n_of_printed == 0)
+        printf("No standing orders\n");
+    return 0;
+}
+
+// "add <from> <to> <amount> <period> <first date>", "cancel <order>" or "list [account]";
+// a period is a count of days (d), weeks (w) or months (m)
+int standing_order_command(char* arguments){
+    arguments = command_argument(arguments);
+    char* cursor;
+    if (strncmp(arguments, "add", 3) == 0){
+        uint32_t source = strtoul(arguments + 3, &cursor, 10);
+        uint32_t destination = strtoul(cursor, &cursor, 10);
+        money_t amount;
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        if (parse_money(cursor, &amount, &cursor) != 0){
+            printf("Invalid amount - use at most %d decimals\n", MONEY_DECIMALS);
+            return 1;
+        }
+        long period = strtol(cursor, &cursor, 10);
+        char period_unit = *cursor == 'w' ? 'd' : *cursor;
+        if (*cursor == 'w')
+            period *= 7;
+        if ((period_unit != 'd' && period_unit != 'm') || period < 1 || period > STANDING_ORDER_MAX_PERIOD){
+            printf("Invalid period - use a count of days, weeks or months up to %d, like 7d, 2w or 1m\n", STANDING_ORDER_MAX_PERIOD);
+            return 1;
+        }
+        cursor++;
+        while (*cursor == ' ' || *cursor == '\t')
+            cursor++;
+        int32_t first_due;
+        if (parse_date(cursor, &first_due, NULL) != 0){
+            printf("Invalid date - use YYYY-MM-DD or today\n");
+            return 1;
+        }
+        return add_standing_order(source, destination, amount, (uint16_t)period, period_unit, first_due);
     }
-    if(account.loan_balance == 0){
-        printf("No loans to repay\n");
+    if (strncmp(arguments, "cancel", 6) == 0)
+        return cancel_standing_order(strtoul(arguments + 6, NULL, 10));
+    if (strncmp(arguments, "list", 4) == 0)
+        return print_standing_orders(strtoul(arguments + 4, NULL, 10));
+    printf("Unknown standing order command - use standing_order add, cancel or list\n");
+    return 1;
+}
+
+// Pays every order due by the given day as one batch: each payment goes through make_transfer against the
+// working set, earliest due first, an order several periods behind is paid once per period and a rejected
+// payment is skipped, and an order whose account was closed or handed on since it was made is cancelled. The advanced
+// orders are written to a new file stamped with the first ledger entry of the write-back, and replace the old
+// one after it; if a crash comes between the two, standing_orders_settle_run finishes or drops the rename.
+int run_due_orders(int32_t day){
+    if (standing_orders_load() != 0)
         return 1;
+    bool require_confirmation = REQUIRE_CONFIRMATION_ON_EDIT, report_success = REPORT_SUCCESS;
+    REQUIRE_CONFIRMATION_ON_EDIT = false;
+    REPORT_SUCCESS = false;
+    cache_clear();
+    working_set_active = true;
+    uint32_t n_of_paid = 0, n_of_rejected = 0;
+    while (standing_orders.n_of_heap != 0 && standing_orders.orders[standing_orders.heap[0]].next_due <= day){
+        standing_order_t* order = &standing_orders.orders[standing_orders.heap[0]];
+        if (order->cancelled){
+            standing_orders.heap[0] = standing_orders.heap[--standing_orders.n_of_heap];
+            if (standing_orders.n_of_heap != 0)
+                standing_orders_sift_down(0);
+            continue;
+        }
+        if (!standing_order_holders_kept(order)){
+            printf("Standing order %u cancelled - one of its accounts was closed since it was made\n", order->id);
+            order->cancelled = 1;
+            continue;
+        }
+        if (make_transfer(order->source, order->destination, order->amount) == 0){
+            n_of_paid++;
+        } else {
+            char due[LENGTH_OF_DATE + 1];
+            format_date(order->next_due, due);
+            printf("Standing order %u due %s rejected\n", order->id, due);
+            n_of_rejected++;
+        }
+        standing_order_advance(order);
+        standing_orders_sift_down(0);
+        stats_maybe_dump();
     }
-    if (payment_value > account.curr_balance){
-        printf("Payment exceeds account balance (%d)\n", account.curr_balance);
-        return 1;
+    REQUIRE_CONFIRMATION_ON_EDIT = require_confirmation;
+    REPORT_SUCCESS = report_success;
+
+    // the table is compacted in place, it is read again from the new file on next use either way
+    standing_orders_header_t header = standing_orders.header;
+    header.n_of_orders = 0;
+    header.ledger_position = ledger.n_of_entries + ledger.n_of_chunk;
+    header.ledger_timestamp = ledger.n_of_pending == 0 ? 0 : ledger.pending[0].timestamp;
+    header.ledger_account = ledger.n_of_pending == 0 ? 0 : ledger.pending[0].account_number;
+    header.ledger_counterparty = ledger.n_of_pending == 0 ? 0 : ledger.pending[0].counterparty;
+    for (uint32_t i = 0; i < standing_orders.header.n_of_orders; i++){
+        if (!standing_orders.orders[i].cancelled)
+            standing_orders.orders[header.n_of_orders++] = standing_orders.orders[i];
     }
-    if (payment_value > account.loan_balance){
-        printf("Payment too high, exceeds loan balance (%d)\n", account.loan_balance);
+    size_t size = (size_t)header.n_of_orders * sizeof(standing_order_t);
+    int fd = open(STANDING_ORDERS_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = fd < 0 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+                 write(fd, standing_orders.orders, size) != (ssize_t)size || fdatasync(fd) != 0;
+    if (fd >= 0)
+        close(fd);
+    standing_orders_discard();
+    if (result != 0){
+        working_set_clear();
+        unlink(STANDING_ORDERS_FILE ".new");
+        printf("Error writing standing orders - no changes were applied\n");
         return 1;
     }
-    acc_t bank_account = get_account(ROOT_BANK_ACCOUNT.account_number);
-    if (bank_account.curr_balance + payment_value > MAX_ACCOUNT_VALUE){
-        printf("Bank has too much money, sorry\n");
+    uint32_t n_of_dirty = working_set_count();
+    if (working_set_write_back() != 0){
+        unlink(STANDING_ORDERS_FILE ".new");
+        printf("Standing orders run failed during write-back - no changes were applied\n");
         return 1;
     }
-    account.loan_balance -= payment_value;
-    account.curr_balance -= payment_value;
-    bank_account.curr_balance += payment_value;
-    if (!get_confirmation()){
-        printf("Operation aborted\n");
+    if (rename(STANDING_ORDERS_FILE ".new", STANDING_ORDERS_FILE) != 0){
+        printf("Error replacing standing orders - the payments were made, the orders are advanced on next use\n");
         return 1;
     }
-    if (paste_account_at_number(account_number, account, true)==1 ||
-        paste_account_at_number(ROOT_BANK_ACCOUNT.account_number, bank_account, false)==1)
-        return 1;
-    else
-        return 0;
+    char date[LENGTH_OF_DATE + 1];
+    format_date(day, date);
+    printf("Standing orders due by %s: %u paid, %u rejected, %u accounts written back\n", date, n_of_paid, n_of_rejected, n_of_dirty);
+    return 0;
 }
 
-int make_transfer(uint32_t origin_account_number, uint32_t dest_account_number, int32_t transfer_value) {
-    acc_t origin_account = get_account(origin_account_number);
-    acc_t dest_account = get_account(dest_account_number);
-    if (origin_account.account_number == NULL_ACCOUNT.account_number ||
-        dest_account.account_number == NULL_ACCOUNT.account_number) {
-        printf("Account not found\n");
+int run_due_command(char* arguments){
+    arguments = command_argument(arguments);
+    int32_t day = today();
+    if (*arguments != '\0' && parse_date(arguments, &day, NULL) != 0){
+        printf("Invalid date - use YYYY-MM-DD or today\n");
         return 1;
     }
-    if (transfer_value <= 0) {
-        printf("Transfer value must be positive\n");
+    if (REQUIRE_CONFIRMATION_ON_EDIT && !get_confirmation()){
+        printf("Operation aborted\n");
         return 1;
     }
-    if (transfer_value > MAX_TRANSFER) {
-        printf("Transfer exceeds maximum allowed transfer value\n");
-        return 1;
+    return run_due_orders(day);
+}
+
+// daemon mode: one process owns the store and serves the socket protocol to many clients
+
+void server_handle_signal(int signal_number){
+    (void)signal_number;
+    server_stopping = 1;
+}
+
+int server_append(server_client_t* client, const void* data, size_t length){
+    if (client->output_length + length > client->output_capacity){
+        size_t capacity = client->output_capacity == 0 ? SERVER_INPUT_SIZE : client->output_capacity;
+        while (capacity < client->output_length + length)
+            capacity *= 2;
+        char* output = realloc(client->output, capacity);
+        if (output == NULL){
+            printf("Error growing client buffer\n");
+            return 1;
+        }
+        client->output = output;
+        client->output_capacity = capacity;
     }
-    if (transfer_value > origin_account.curr_balance) {
-        printf("Transfer value exceeds account balance\n");
-        return 1;
+    memcpy(client->output + client->output_length, data, length);
+    client->output_length += length;
+    return 0;
+}
+
+// accounts go out as acc_t with the padding zeroed
+int server_append_account(server_client_t* client, const acc_t* account){
+    acc_t wire;
+    memset(&wire, 0, sizeof(wire));
+    wire.account_number = account->account_number;
+    memcpy(wire.name, account->name, sizeof(wire.name));
+    memcpy(wire.surname, account->surname, sizeof(wire.surname));
+    memcpy(wire.address, account->address, sizeof(wire.address));
+    memcpy(wire.national_id, account->national_id, sizeof(wire.national_id));
+    wire.curr_balance = account->curr_balance;
+    wire.loan_balance = account->loan_balance;
+    wire.interest_rate = account->interest_rate;
+    return server_append(client, &wire, sizeof(wire));
+}
+
+int server_reply(server_client_t* client, uint32_t id, uint8_t status, uint32_t n_of_accounts){
+    server_response_t response = {id, n_of_accounts, status, {0}};
+    return server_append(client, &response, sizeof(response));
+}
+
+int server_search(server_client_t* client, const server_request_t* request, const char* query){
+    acc_t pattern = NULL_ACCOUNT;
+    char* field;
+    size_t field_size;
+    switch (request->search_option){
+        case 2:
+            field = pattern.name;
+            field_size = sizeof(pattern.name);
+            break;
+        case 3:
+            field = pattern.surname;
+            field_size = sizeof(pattern.surname);
+            break;
+        case 4:
+            field = pattern.address;
+            field_size = sizeof(pattern.address);
+            break;
+        case 5:
+            field = pattern.national_id;
+            field_size = sizeof(pattern.national_id);
+            break;
+        default:
+            return server_reply(client, request->id, SERVER_MALFORMED, 0);
     }
-    if (dest_account.curr_balance + transfer_value > MAX_ACCOUNT_VALUE) {
-        printf("Transfer exceeds maximum destination account value\n");
-        return 1;
+    // the matcher ignores the last character of a pattern, which the REPL's input cleaning leaves as whitespace
+    size_t length = request->query_length < field_size - 1 ? request->query_length : field_size - 1;
+    memcpy(field, query, length);
+    if (length + 1 < field_size)
+        field[length++] = ' ';
+    field[length] = '\0';
+    uint32_t* matches = NULL;
+    uint32_t n_of_matches = 0;
+    if (find_matching_accounts(pattern, &matches, &n_of_matches) != 0)
+        return server_reply(client, request->id, SERVER_REJECTED, 0);
+    int result = server_reply(client, request->id, SERVER_OK, n_of_matches);
+    for (uint32_t i = 0; i < n_of_matches && result == 0; i++){
+        acc_t account = store_get(matches[i]);
+        result = server_append_account(client, &account);
     }
-    origin_account.curr_balance -= transfer_value;
-    dest_account.curr_balance += transfer_value;
-    if (!get_confirmation()){
-        printf("Operation aborted\n");
-        return 1;
+    free(matches);
+    return result;
+}
+
+int server_execute(server_client_t* client, const server_request_t* request, const char* query){
+    if (request->op == SERVER_OP_SEARCH && request->search_option != 1){
+        uint64_t started = stats_clock();
+        int result = server_search(client, request, query);
+        stats_record(SERVER_OP_COMMANDS[SERVER_OP_SEARCH], started, result);
+        return result;
     }
-    if (paste_account_at_number(origin_account_number, origin_account, true) == 1 ||
-        paste_account_at_number(dest_account_number, dest_account, true) == 1){
-        printf("Transfer failed\n");
+    // search by number is a get
+    uint32_t account_number = request->op == SERVER_OP_SEARCH ? strtoul(query, NULL, 10) : request->account;
+    if (account_number == 0 || account_number > number_of_accounts ||
+        (request->op == SERVER_OP_TRANSFER && (request->other_account == 0 || request->other_account > number_of_accounts)) ||
+        store_slot_closed(account_number) || (request->op == SERVER_OP_TRANSFER && store_slot_closed(request->other_account)))
+        return server_reply(client, request->id, SERVER_NOT_FOUND, 0);
+    uint64_t started = stats_clock();
+    int result;
+    switch (request->op){
+        case SERVER_OP_GET:
+        case SERVER_OP_SEARCH:
+            result = 0;
+            break;
+        case SERVER_OP_DEPOSIT:
+            result = make_deposit(account_number, request->value);
+            break;
+        case SERVER_OP_WITHDRAW:
+            result = make_withdraw(account_number, request->value);
+            break;
+        case SERVER_OP_TRANSFER:
+            result = make_transfer(account_number, request->other_account, request->value);
+            break;
+        case SERVER_OP_BORROW:
+            result = take_loan(account_number, request->value);
+            break;
+        case SERVER_OP_REPAY:
+            result = repay_loan(account_number, request->value);
+            break;
+        default:
+            return server_reply(client, request->id, SERVER_MALFORMED, 0);
+    }
+    stats_record(SERVER_OP_COMMANDS[request->op], started, result);
+    // replies carry the accounts as they are after the operation
+    uint32_t n_of_accounts = request->op == SERVER_OP_TRANSFER ? 2 : 1;
+    acc_t account = get_account(account_number);
+    if (server_reply(client, request->id, result == 0 ? SERVER_OK : SERVER_REJECTED, n_of_accounts) != 0 ||
+        server_append_account(client, &account) != 0)
         return 1;
-    } else {
-        printf("Transfer successful\n");
+    if (n_of_accounts == 1)
         return 0;
+    account = get_account(request->other_account);
+    return server_append_account(client, &account);
+}
+
+// reads and executes every complete request that has arrived, unless the client's replies are backing up
+void server_read(server_client_t* client){
+    while (!client->closing && client->output_length - client->output_sent < SERVER_OUTPUT_HIGH_WATER){
+        ssize_t n = read(client->fd, client->input + client->input_length, SERVER_INPUT_SIZE - client->input_length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0){
+            client->closing = true; // replies already queued are still sent
+            break;
+        }
+        stats_count(STATS_SOCKET_READS, 1);
+        stats_count(STATS_SOCKET_BYTES_IN, n);
+        client->input_length += n;
+        size_t offset = 0;
+        while (client->input_length - offset >= sizeof(server_request_t)){
+            server_request_t request;
+            memcpy(&request, client->input + offset, sizeof(request));
+            if (request.query_length > SERVER_MAX_QUERY){
+                // the stream cannot be resynchronised after a bad length
+                server_reply(client, request.id, SERVER_MALFORMED, 0);
+                client->closing = true;
+                offset = client->input_length;
+                break;
+            }
+            size_t size = sizeof(request) + request.query_length;
+            if (client->input_length - offset < size)
+                break;
+            char query[SERVER_MAX_QUERY + 1];
+            memcpy(query, client->input + offset + sizeof(request), request.query_length);
+            query[request.query_length] = '\0';
+            if (server_execute(client, &request, query) != 0)
+                client->closing = true;
+            offset += size;
+        }
+        memmove(client->input, client->input + offset, client->input_length - offset);
+        client->input_length -= offset;
     }
 }
 
-int collect_interest(uint32_t account_number){
-    acc_t account = get_account(account_number);
-    if (account.account_number == NULL_ACCOUNT.account_number){
-        printf("Account not found\n");
-        return 1;
+void server_write(server_client_t* client){
+    while (client->output_sent < client->output_length){
+        ssize_t n = send(client->fd, client->output + client->output_sent, client->output_length - client->output_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n < 0){
+            client->closing = true;
+            client->output_sent = client->output_length;
+            break;
+        }
+        stats_count(STATS_SOCKET_SENDS, 1);
+        stats_count(STATS_SOCKET_BYTES_OUT, n);
+        client->output_sent += n;
     }
-    if (account.loan_balance == 0){
-        return 0;
+    if (client->output_sent == client->output_length)
+        client->output_sent = client->output_length = 0;
+}
+
+void server_close(server_client_t* client){
+    close(client->fd);
+    server_clients[client->slot] = NULL;
+    free(client->input);
+    free(client->output);
+    free(client);
+}
+
+// registers the events the client now needs, or closes it once a closing client has no output left
+void server_update(int epoll_fd, server_client_t* client){
+    size_t pending = client->output_length - client->output_sent;
+    if (client->closing && pending == 0){
+        server_close(client);
+        return;
     }
-    int32_t interest_value = account.loan_balance * account.interest_rate;
-    if (account.loan_balance + interest_value > MAX_LOAN_VALUE){
-        printf("Interest achieved maximum debt in account %ud\n", account_number);
-        return 1;
+    uint32_t events = (client->closing || pending >= SERVER_OUTPUT_HIGH_WATER ? 0 : EPOLLIN) | (pending != 0 ? EPOLLOUT : 0);
+    if (events == client->events)
+        return;
+    struct epoll_event event = {events, {.ptr = client}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->events = events;
+}
+
+void server_accept(int epoll_fd, int listen_fd){
+    while (true){
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        uint32_t slot = 0;
+        while (slot < SERVER_MAX_CLIENTS && server_clients[slot] != NULL)
+            slot++;
+        server_client_t* client = slot == SERVER_MAX_CLIENTS ? NULL : calloc(1, sizeof(server_client_t));
+        char* input = client == NULL ? NULL : malloc(SERVER_INPUT_SIZE);
+        if (input == NULL){
+            printf("Refusing client - too many connections\n");
+            free(client);
+            close(fd);
+            continue;
+        }
+        *client = (server_client_t){fd, slot, EPOLLIN, false, input, 0, NULL, 0, 0, 0};
+        struct epoll_event event = {EPOLLIN, {.ptr = client}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0){
+            free(input);
+            free(client);
+            close(fd);
+            continue;
+        }
+        server_clients[slot] = client;
     }
-    account.loan_balance += interest_value;
-    printf("Interest collected: %d\n", interest_value);
-    if (paste_account_at_number(account_number, account, false)==1)
-        return 1;
-    else
-        return 0;
 }
 
-int print_matching_accounts(acc_t pattern_acc, int view_mode){
-    FILE *file = fopen(RECORD_FILE, "rb");
-    if (file == NULL){
-        printf("Error opening file\n");
+int run_server(const char* path){
+    struct sockaddr_un address = {AF_UNIX, {0}};
+    if (strlen(path) >= sizeof(address.sun_path)){
+        printf("Socket path too long\n");
         return 1;
     }
-    acc_t retrieved_account;
-    bool found_match = false;
-    while (fread(&retrieved_account, sizeof(acc_t), 1, file)){
-        if ((pattern_acc.name[0] == NULL_ACCOUNT.name[0] || strncmp(pattern_acc.name, retrieved_account.name, strlen(pattern_acc.name) - 1) == 0 ) &&
-            (pattern_acc.surname[0] == NULL_ACCOUNT.surname[0] || strncmp(pattern_acc.surname, retrieved_account.surname, strlen(pattern_acc.surname) - 1) == 0 ) &&
-            (pattern_acc.address[0] == NULL_ACCOUNT.address[0] || strncmp(pattern_acc.address, retrieved_account.address, strlen(pattern_acc.address) - 1) == 0 ) &&
-            (pattern_acc.national_id[0] == NULL_ACCOUNT.national_id[0] || strncmp(pattern_acc.national_id, retrieved_account.national_id, strlen(pattern_acc.national_id) - 1) == 0))
-        {
-            if(!found_match){
-                print_table_header(view_mode);
-                found_match = true;
-            }
-            print_account_as_table(retrieved_account, view_mode);
-        }
+    strcpy(address.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0){
+        printf("Error opening socket %s\n", path);
+        return 1;
     }
-    if (!found_match)
-        printf("No matching accounts found\n");
-    fclose(file);
-    return 0;
-}
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {EPOLLIN, {.ptr = NULL}};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0){
+        printf("Error setting up event loop\n");
+        close(listen_fd);
+        return 1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = server_handle_signal; // no SA_RESTART, so epoll_wait returns on a signal
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    REQUIRE_CONFIRMATION_ON_EDIT = false;
+    REPORT_SUCCESS = false;
+    journal_group_commit = true;
+    printf("Serving %u accounts on %s\n", number_of_accounts, path);
+    fflush(stdout);
 
-int search_for_account(uint32_t search_option, char* prev_search_string){
-    acc_t account = NULL_ACCOUNT;
-    char search_string[MAX_COMMAND_LENGTH];
-    bool no_same_line_arg_passed = true;
-    if (strlen(prev_search_string)>1) {
-        no_same_line_arg_passed = false;
-        while (*prev_search_string==' ' || *prev_search_string=='\t')
-            prev_search_string++;
-        strncpy(search_string, prev_search_string, MAX_COMMAND_LENGTH);
+    struct epoll_event events[SERVER_EVENTS];
+    int result = 0;
+    while (!server_stopping){
+        // wake up often enough to keep the statistics file current on an idle server
+        int n_of_events = epoll_wait(epoll_fd, events, SERVER_EVENTS, stats_dump_interval != 0 ? (int)stats_dump_interval * 1000 : -1);
+        stats_maybe_dump();
+        if (n_of_events < 0){
+            if (errno == EINTR)
+                continue;
+            printf("Error waiting for clients\n");
+            result = 1;
+            break;
+        }
+        for (int i = 0; i < n_of_events; i++){
+            server_client_t* client = events[i].data.ptr;
+            if (client == NULL)
+                server_accept(epoll_fd, listen_fd);
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                server_read(client);
+        }
+        // group commit: one fsync covers every update of this round before any of its replies leaves
+        if (journal_flush() != 0){
+            result = 1;
+            break;
+        }
+        for (int i = 0; i < n_of_events; i++){
+            server_client_t* client = events[i].data.ptr;
+            if (client == NULL)
+                continue;
+            server_write(client);
+            server_update(epoll_fd, client);
+        }
+        fflush(stdout);
     }
-    switch (search_option) {
-        case 1:
-            if (no_same_line_arg_passed) {
-                printf("enter account number\n");
-                get_and_clean_input(search_string, MAX_COMMAND_LENGTH);
-            }
-            account = get_account(strtol(search_string, NULL, 10));
-            if (account.account_number == NULL_ACCOUNT.account_number){
-                printf("Account not found\n");
-                return 1;
-            }
-            print_table_header(global_view_mode);
-            print_account_as_table(account, global_view_mode);
-            return 0;
-        case 2:
-            if(no_same_line_arg_passed){
-                printf("enter name\n");
-                get_and_clean_input(account.name, LENGTH_OF_NAME);
-            } else {
-                strncpy(account.name, search_string, LENGTH_OF_NAME);
+    for (uint32_t i = 0; i < SERVER_MAX_CLIENTS; i++){
+        if (server_clients[i] != NULL)
+            server_close(server_clients[i]);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(path);
+    printf("Server stopped\n");
+    return result;
+}
+
+// teller side of the protocol: batch-style lines ("get,<account>", "transfer,<from>,<to>,<amount>",
+// "search,<option>,<query>", ...) are read from stdin, sent pipelined, and the replies printed in order
+int run_client(const char* path){
+    static const char* OPERATIONS[] = {NULL, "get", "deposit", "withdraw", "transfer", "borrow", "repay", "search"};
+    static const char* STATUSES[] = {"ok", "rejected", "not found", "malformed"};
+    char* requests = NULL;
+    size_t length = 0, capacity = 0;
+    uint32_t n_of_requests = 0;
+    char line[MAX_BATCH_LINE_LENGTH];
+    unsigned long line_number = 0, n_of_rejected = 0;
+    while (read_batch_line(stdin, line, &line_number, &n_of_rejected)){
+        size_t name_length = strcspn(line, ",");
+        server_request_t request = {line_number, 0, 0, 0, 0, 0, 0};
+        for (uint8_t op = SERVER_OP_GET; op <= SERVER_OP_SEARCH; op++){
+            if (strlen(OPERATIONS[op]) == name_length && strncmp(line, OPERATIONS[op], name_length) == 0)
+                request.op = op;
+        }
+        int64_t values[3];
+        int n_of_values = request.op == SERVER_OP_GET ? 1 : request.op == SERVER_OP_TRANSFER ? 3 : 2;
+        const char* query = "";
+        if (request.op == SERVER_OP_SEARCH){
+            char* endptr;
+            request.search_option = strtol(line + name_length + 1, &endptr, 10);
+            query = *endptr == ',' ? endptr + 1 : "";
+            request.query_length = strlen(query) > SERVER_MAX_QUERY ? SERVER_MAX_QUERY : strlen(query);
+        } else if (request.op == 0 || parse_batch_fields(line + name_length, values, n_of_values) != 0 ||
+                   !is_valid_batch_account(values[0]) || !is_valid_batch_amount(values[n_of_values - 1]) ||
+                   (n_of_values == 3 && !is_valid_batch_account(values[1]))){
+            printf("Line %lu rejected: %s\n", line_number, line);
+            continue;
+        } else {
+            request.account = values[0];
+            request.other_account = n_of_values == 3 ? values[1] : 0;
+            request.value = n_of_values == 1 ? 0 : values[n_of_values - 1];
+        }
+        if (length + sizeof(request) + request.query_length > capacity){
+            capacity = capacity == 0 ? SERVER_INPUT_SIZE : capacity * 2;
+            char* grown = realloc(requests, capacity);
+            if (grown == NULL){
+                printf("Error reading requests\n");
+                free(requests);
+                return 1;
             }
+            requests = grown;
+        }
+        memcpy(requests + length, &request, sizeof(request));
+        memcpy(requests + length + sizeof(request), query, request.query_length);
+        length += sizeof(request) + request.query_length;
+        n_of_requests++;
+    }
+
+    struct sockaddr_un address = {AF_UNIX, {0}};
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (strlen(path) >= sizeof(address.sun_path) || fd < 0 ||
+        (strcpy(address.sun_path, path), connect(fd, (struct sockaddr*)&address, sizeof(address))) != 0){
+        printf("Error connecting to %s\n", path);
+        free(requests);
+        return 1;
+    }
+    char* replies = malloc(SERVER_INPUT_SIZE);
+    size_t replies_length = 0, replies_capacity = SERVER_INPUT_SIZE, sent = 0;
+    uint32_t n_of_replies = 0;
+    int result = replies == NULL;
+    // requests keep going out while replies come back, so neither side's buffers fill up and stall
+    while (result == 0 && n_of_replies < n_of_requests){
+        struct pollfd poll_fd = {fd, POLLIN | (sent < length ? POLLOUT : 0), 0};
+        if (poll(&poll_fd, 1, -1) < 0 && errno != EINTR){
+            result = 1;
             break;
-        case 3:
-            if(no_same_line_arg_passed){
-                printf("enter surname\n");
-                get_and_clean_input(account.surname, LENGTH_OF_SURNAME);
-            } else {
-                strncpy(account.surname, search_string, LENGTH_OF_SURNAME);
+        }
+        if (poll_fd.revents & POLLOUT){
+            ssize_t n = send(fd, requests + sent, length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0)
+                sent += n;
+        }
+        if (!(poll_fd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        if (replies_length == replies_capacity){
+            char* grown = realloc(replies, replies_capacity * 2);
+            if (grown == NULL){
+                result = 1;
+                break;
             }
+            replies = grown;
+            replies_capacity *= 2;
+        }
+        ssize_t n = recv(fd, replies + replies_length, replies_capacity - replies_length, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)){
+            printf("Server closed the connection\n");
+            result = 1;
             break;
-        case 4:
-            if(no_same_line_arg_passed){
-                printf("enter address\n");
-                get_and_clean_input(account.address, LENGTH_OF_ADDRESS);
-            } else {
-                strncpy(account.address, search_string, LENGTH_OF_ADDRESS);
+        }
+        replies_length += n > 0 ? n : 0;
+        size_t offset = 0;
+        while (replies_length - offset >= sizeof(server_response_t)){
+            server_response_t response;
+            memcpy(&response, replies + offset, sizeof(response));
+            size_t size = sizeof(response) + (size_t)response.n_of_accounts * sizeof(acc_t);
+            if (replies_length - offset < size)
+                break;
+            printf("#%u %s\n", response.id, response.status < 4 ? STATUSES[response.status] : "unknown");
+            fflush(stdout);
+            for (uint32_t i = 0; i < response.n_of_accounts; i++){
+                acc_t account;
+                memcpy(&account, replies + offset + sizeof(response) + i * sizeof(acc_t), sizeof(acc_t));
+                render_account(&account, FULL_VIEW, global_output_format);
             }
-            break;
-        case 5:
-            if(no_same_line_arg_passed){
-                printf("enter national ID\n");
-                get_and_clean_input(account.national_id, LENGTH_OF_NATIONAL_ID);
-            } else {
-                strncpy(account.national_id, search_string, LENGTH_OF_NATIONAL_ID);
+            output_flush();
+            offset += size;
+            n_of_replies++;
+        }
+        memmove(replies, replies + offset, replies_length - offset);
+        replies_length -= offset;
+    }
+    close(fd);
+    free(requests);
+    free(replies);
+    return result;
+}
+
+// entries of the account between the two timestamps, oldest first
+int print_account_history(uint32_t account_number, uint64_t from, uint64_t to){
+    if (account_number == 0 || account_number > number_of_accounts){
+        printf("Invalid account number\n");
+        return 1;
+    }
+    ledger_entry_t entry;
+    uint64_t link = ledger_find(account_number, to, &entry);
+    ledger_entry_t* entries = NULL;
+    uint32_t n_of_entries = 0, capacity = 0;
+    while (link != 0 && entry.timestamp >= from){
+        if (n_of_entries == capacity){
+            ledger_entry_t* grown = realloc(entries, (size_t)(capacity + INDEX_GROWTH) * sizeof(ledger_entry_t));
+            if (grown == NULL){
+                printf("Error collecting history\n");
+                free(entries);
+                return 1;
             }
-            break;
-        default:
-            printf("Invalid search option\n");
-            print_search_help();
+            entries = grown;
+            capacity += INDEX_GROWTH;
+        }
+        entries[n_of_entries++] = entry;
+        link = entry.previous;
+        if (link != 0 && ledger_read(link - 1, &entry) != 0){
+            free(entries);
             return 1;
+        }
     }
-    print_matching_accounts(account, global_view_mode);
+    render_ledger_header(global_output_format);
+    for (uint32_t i = n_of_entries; i > 0; i--)
+        render_ledger_entry(&entries[i - 1], global_output_format);
+    output_flush();
+    free(entries);
+    return 0;
+}
+
+// balances as of the timestamp; before its first entry an account held what that entry started from,
+// and an account without entries has not changed since the ledger began
+int print_balance_at(uint32_t account_number, uint64_t timestamp){
+    if (account_number == 0 || account_number > number_of_accounts){
+        printf("Invalid account number\n");
+        return 1;
+    }
+    ledger_entry_t entry;
+    money_t curr_balance, loan_balance;
+    uint64_t head = ledger_head(account_number);
+    if (ledger_find(account_number, timestamp, &entry) != 0){
+        curr_balance = entry.curr_balance;
+        loan_balance = entry.loan_balance;
+    } else if (head != 0){
+        uint64_t first = ledger_ancestor(head, 0);
+        if (first == 0 || ledger_read(first - 1, &entry) != 0)
+            return 1;
+        curr_balance = entry.curr_balance - entry.balance_change;
+        loan_balance = entry.loan_balance - entry.loan_change;
+    } else {
+        acc_t account = get_account(account_number);
+        curr_balance = account.curr_balance;
+        loan_balance = account.loan_balance;
+    }
+    char time_text[LENGTH_OF_LEDGER_TIME + 1], balance_text[LENGTH_OF_MONEY_TEXT], loan_text[LENGTH_OF_MONEY_TEXT];
+    format_ledger_time(timestamp, time_text);
+    format_money(curr_balance, balance_text);
+    format_money(loan_balance, loan_text);
+    printf("Account %u at %.19s: balance %s, loan %s\n", account_number, time_text, balance_text, loan_text);
     return 0;
 }
 
+// "[from] [to]" after the account number, both open-ended when left out
+int print_history_command(uint32_t account_number, char* arguments){
+    uint64_t bounds[2] = {0, UINT64_MAX};
+    for (int i = 0; i < 2; i++){
+        while (*arguments == ' ' || *arguments == '\t')
+            arguments++;
+        if (*arguments == '\0')
+            break;
+        if (parse_timestamp(arguments, i == 1, &bounds[i]) != 0){
+            printf("Invalid time - use YYYY-MM-DD[THH:MM:SS] or seconds since the epoch\n");
+            return 1;
+        }
+        arguments += strcspn(arguments, " \t");
+    }
+    return print_account_history(account_number, bounds[0], bounds[1]);
+}
+
 int check_string_for_command(char* string, const char* command){
     if (strncmp(string, command, strlen(command)) == 0){
         return 1;
@@ -728,13 +6903,46 @@ int check_string_for_command(char* string, const char* command){
     return 0;
 }
 
+int set_output_format(char* format){
+    while (*format == ' ' || *format == '\t')
+        format++;
+    if (check_string_for_command(format, "table"))
+        global_output_format = TABLE_OUTPUT;
+    else if (check_string_for_command(format, "csv"))
+        global_output_format = CSV_OUTPUT;
+    else if (check_string_for_command(format, "json"))
+        global_output_format = JSON_OUTPUT;
+    else {
+        printf("Unknown output format - use table, csv or json\n");
+        return 1;
+    }
+    return 0;
+}
+
+// amount argument of a command; an empty one reads as zero and is turned down by the operation itself
+int read_amount_argument(const char* text, money_t* amount){
+    while (*text == ' ' || *text == '\t')
+        text++;
+    if (*text == '\0'){
+        *amount = 0;
+        return 0;
+    }
+    if (parse_money(text, amount, NULL) != 0){
+        printf("Invalid amount - use at most %d decimals\n", MONEY_DECIMALS);
+        return 1;
+    }
+    return 0;
+}
+
 int read_command() {
     char command[MAX_COMMAND_LENGTH];
     int cmd_id;
-    // predeclared memory space for arguments (different types for different values, f.eg. uint32_t for account number, int32_t for money)
+    // predeclared memory space for arguments (different types for different values, f.eg. uint32_t for account number, money_t for money)
     uint32_t arg1;
     int32_t arg2;
     uint32_t arg3;
+    money_t amount;
+    uint64_t timestamp;
     char* endptr;
     printf("BankOS:root> ");
     get_and_clean_input(command, MAX_COMMAND_LENGTH);
@@ -742,43 +6950,42 @@ int read_command() {
         if (check_string_for_command(command, COMMANDS[cmd_id]))
             break;
     }
+    uint64_t started = stats_clock();
+    int result = 0;
     switch(cmd_id){
         case 0: // list
-            arg2 = strtol(command+strlen(COMMANDS[cmd_id]), NULL, 10)+1;
-            read_all_records(arg2);
+            result = list_command(command+strlen(COMMANDS[cmd_id]));
             break;
         case 1: // add
             add_account_from_input();
             break;
         case 2: // deposit
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
-            arg2 = strtol(endptr, NULL, 10);
-            make_deposit(arg1, arg2);
+            result = read_amount_argument(endptr, &amount) != 0 || make_deposit(arg1, amount);
             break;
         case 3: // withdraw
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
-            arg2 = strtol(endptr, NULL, 10);
-            make_withdraw(arg1, arg2);
+            result = read_amount_argument(endptr, &amount) != 0 || make_withdraw(arg1, amount);
             break;
         case 4: // borrow
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
-            arg2 = strtol(endptr, NULL, 10);
-            take_loan(arg1, arg2);
+            result = read_amount_argument(endptr, &amount) != 0 || take_loan(arg1, amount);
             break;
         case 5: // repay
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
-            arg2 = strtol(endptr,NULL, 10);
-            repay_loan(arg1, arg2);
+            result = read_amount_argument(endptr, &amount) != 0 || repay_loan(arg1, amount);
             break;
         case 6: // transfer
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
             arg3 = strtol(endptr, &endptr, 10);
-            arg2 = strtol(endptr, NULL, 10);
-            make_transfer(arg1, arg3, arg2);
+            result = read_amount_argument(endptr, &amount) != 0 || make_transfer(arg1, arg3, amount);
             break;
         case 7: // search
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
-            search_for_account(arg1, endptr);
+            if (endptr == command+strlen(COMMANDS[cmd_id]) && parse_order_column(endptr, &arg2, &endptr) == 0)
+                result = search_order_range(arg2, endptr);
+            else
+                result = search_for_account(arg1, endptr);
             break;
         case 8: // get
             arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
@@ -790,14 +6997,25 @@ int read_command() {
                 print_account_as_table(get_account(arg1), arg2);
             break;
         case 9: // quit
+            stats_dump();
+            standing_orders_close();
+            journal_close();
+            store_close();
             return 1;
         case 10: // reset_file
             reset_file();
             populate_file_with_preset_accounts();
             break;
         case 11: // collect_interest
-            arg1 = strtol(command+strlen(COMMANDS[cmd_id]), NULL, 10);
-            collect_interest(arg1);
+            endptr = command+strlen(COMMANDS[cmd_id]);
+            while (*endptr == ' ' || *endptr == '\t')
+                endptr++;
+            if (check_string_for_command(endptr, "all")) {
+                result = collect_interest_all();
+                break;
+            }
+            arg1 = strtol(endptr, NULL, 10);
+            result = collect_interest(arg1);
             break;
         case 12: // help
             print_help();
@@ -808,26 +7026,725 @@ int read_command() {
             printf("account to be pasted to position %d:\n", arg1);
             print_table_header(global_view_mode);
             print_account_as_table(get_account(arg3), global_view_mode);
-            paste_account_at_number(arg1, get_account(arg3), false);
+            paste_account_at_number(arg1, get_account(arg3), false, NULL);
             break;
         case 14:
             populate_file_with_preset_accounts();
             break;
+        case 15: // format
+            set_output_format(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 16:
+            verify_file_integrity();
+            break;
+        case 17: // cache
+            arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
+            if (endptr == command+strlen(COMMANDS[cmd_id]))
+                print_cache_stats();
+            else
+                cache_resize(arg1);
+            break;
+        case 18: // history
+            arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
+            print_history_command(arg1, endptr);
+            break;
+        case 19: // balance_at
+            arg1 = strtol(command+strlen(COMMANDS[cmd_id]), &endptr, 10);
+            while (*endptr == ' ' || *endptr == '\t')
+                endptr++;
+            if (parse_timestamp(endptr, false, &timestamp) != 0)
+                printf("Invalid time - use YYYY-MM-DD[THH:MM:SS] or seconds since the epoch\n");
+            else
+                print_balance_at(arg1, timestamp);
+            break;
+        case 20: // snapshot
+            result = snapshot_start();
+            if (result == 0)
+                printf("Snapshot started\n");
+            break;
+        case 21: // stats
+            endptr = command+strlen(COMMANDS[cmd_id]);
+            while (*endptr == ' ' || *endptr == '\t')
+                endptr++;
+            if (check_string_for_command(endptr, "reset"))
+                stats_reset();
+            else
+                print_stats();
+            break;
+        case 22: // close
+            arg1 = strtol(command+strlen(COMMANDS[cmd_id]), NULL, 10);
+            result = close_account(arg1);
+            break;
+        case 23: // compact
+            result = compact_file();
+            break;
+        case 24: // report
+            result = report_command(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 25: // top
+            result = top_command(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 26: // import
+            result = import_accounts(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 27: // export
+            result = export_accounts(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 28: // dedupe_report
+            result = dedupe_report();
+            break;
+        case 29: // standing_order
+            result = standing_order_command(command+strlen(COMMANDS[cmd_id]));
+            break;
+        case 30: // run_due
+            result = run_due_command(command+strlen(COMMANDS[cmd_id]));
+            break;
         default:
             printf("Command not recognized\n");
             break;
     }
+    if (cmd_id < N_OF_COMMANDS)
+        stats_record(cmd_id, started, result);
+    stats_maybe_dump();
+    return 0;
+}
+
+#ifdef BENCHMARK_BUILD
+// synthetic book generator and timed workloads, built as the banking_benchmark target
+
+const char* BENCHMARK_MALE_NAMES[] = {
+        "Piotr", "Krzysztof", "Andrzej", "Tomasz", "Jan", "Paweł", "Michał", "Marcin", "Stanisław", "Jakub",
+        "Adam", "Marek", "Łukasz", "Grzegorz", "Mateusz", "Wojciech", "Mariusz", "Dariusz", "Zbigniew", "Jerzy",
+        "Maciej", "Rafał", "Robert", "Kamil", "Józef", "Szymon", "Ryszard", "Kacper", "Bartosz", "Tadeusz"
+};
+const char* BENCHMARK_FEMALE_NAMES[] = {
+        "Anna", "Maria", "Katarzyna", "Małgorzata", "Agnieszka", "Barbara", "Ewa", "Krystyna", "Magdalena", "Elżbieta",
+        "Joanna", "Aleksandra", "Monika", "Zofia", "Teresa", "Danuta", "Natalia", "Julia", "Karolina", "Marta",
+        "Beata", "Dorota", "Halina", "Jadwiga", "Janina", "Alicja", "Irena", "Iwona", "Paulina", "Justyna"
+};
+// masculine forms, "-ski"-type names get their feminine ending for women
+const char* BENCHMARK_SURNAMES[] = {
+        "Nowak", "Kowalski", "Wiśniewski", "Wójcik", "Kowalczyk", "Kamiński", "Lewandowski", "Zieliński",
+        "Szymański", "Woźniak", "Dąbrowski", "Kozłowski", "Jankowski", "Mazur", "Wojciechowski", "Kwiatkowski",
+        "Krawczyk", "Kaczmarek", "Piotrowski", "Grabowski", "Zając", "Pawłowski", "Michalski", "Król",
+        "Wieczorek", "Jabłoński", "Wróbel", "Nowakowski", "Majewski", "Olszewski", "Stępień", "Malinowski",
+        "Jaworski", "Adamczyk", "Dudek", "Nowicki", "Pawlak", "Górski", "Witkowski", "Walczak"
+};
+// "ul. <street> <nn> <postcode> <city>" drops "ul. " when too long for the address field, and the longest
+// streets and cities are then cut on a character boundary
+const char* BENCHMARK_STREETS[] = {
+        "Polna", "Leśna", "Słoneczna", "Krótka", "Szkolna", "Ogrodowa", "Lipowa", "Łąkowa", "Brzozowa", "Kwiatowa",
+        "Długa", "Kolejowa", "Parkowa", "Wąska", "Zielona", "Sienkiewicza", "Mickiewicza", "Kościuszki",
+        "Różana", "Spacerowa", "Topolowa", "Wiejska", "Słowackiego", "Akacjowa"
+};
+const char* BENCHMARK_CITIES[] = {
+        "Warszawa", "Kraków", "Łódź", "Wrocław", "Poznań", "Gdańsk", "Szczecin", "Bydgoszcz", "Lublin", "Białystok",
+        "Katowice", "Gdynia", "Radom", "Toruń", "Kielce", "Rzeszów", "Olsztyn", "Opole"
+};
+const char* BENCHMARK_POSTCODE_PREFIXES[] = {
+        "00", "30", "90", "50", "60", "80", "70", "85", "20", "15", "40", "81", "26", "87", "25", "35", "10", "45"
+};
+
+typedef struct BenchmarkResult{
+    const char* name;
+    uint64_t* latencies; // nanoseconds per operation
+    uint64_t n_of_ops;
+    uint64_t n_of_failed;
+    uint64_t total_ns;
+} benchmark_result_t;
+
+uint64_t benchmark_rng_state = 0x9E3779B97F4A7C15ull;
+int benchmark_stdout = -1; // the real stdout while operation output is discarded
+
+uint64_t benchmark_random(){
+    uint64_t x = benchmark_rng_state; // xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    benchmark_rng_state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+uint32_t benchmark_uniform(uint32_t n){
+    return (uint32_t)(((benchmark_random() >> 32) * n) >> 32);
+}
+
+// skewed towards the start of a table, like real name frequencies
+uint32_t benchmark_skewed(uint32_t n){
+    uint64_t u = benchmark_random() >> 48;
+    return (uint32_t)((u * u * n) >> 32);
+}
+
+uint64_t benchmark_now_ns(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void benchmark_mute(){
+    fflush(stdout);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0){
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+}
+
+void benchmark_unmute(){
+    fflush(stdout);
+    dup2(benchmark_stdout, STDOUT_FILENO);
+}
+
+// days since 1932-01-01 to a civil date
+void benchmark_date(uint32_t day, int* year, int* month, int* month_day){
+    date_from_day((int32_t)day - 13878, year, month, month_day); // 1932-01-01 is 13878 days before 1970-01-01
+}
+
+// valid and unique per account: the account number is scattered over BENCHMARK_ID_SPACE
+// by an odd multiplier, which is a permutation of that range
+void benchmark_national_id(uint32_t account_number, bool female, char* national_id){
+    static const int weights[] = {1, 3, 7, 9, 1, 3, 7, 9, 1, 3};
+    uint32_t id_slot = (account_number * 2654435761u) & (BENCHMARK_ID_SPACE - 1);
+    uint32_t serial = id_slot % 5000;
+    int year, month, month_day;
+    benchmark_date(id_slot / 5000, &year, &month, &month_day);
+    snprintf(national_id, LENGTH_OF_NATIONAL_ID + 1, "%02d%02d%02d%03u%u", year % 100, year >= 2000 ? month + 20 : month,
+             month_day, serial / 5, (serial % 5) * 2 + (female ? 0 : 1));
+    int sum = 0;
+    for (int i = 0; i < LENGTH_OF_NATIONAL_ID - 1; i++)
+        sum += (national_id[i] - '0') * weights[i];
+    national_id[LENGTH_OF_NATIONAL_ID - 1] = (char)('0' + (10 - sum % 10) % 10);
+}
+
+acc_t benchmark_account(uint32_t account_number){
+    acc_t account = NULL_ACCOUNT;
+    bool female = benchmark_uniform(2) == 0;
+    account.account_number = account_number;
+    if (female)
+        snprintf(account.name, sizeof(account.name), "%s", BENCHMARK_FEMALE_NAMES[benchmark_skewed(sizeof(BENCHMARK_FEMALE_NAMES)/sizeof(char*))]);
+    else
+        snprintf(account.name, sizeof(account.name), "%s", BENCHMARK_MALE_NAMES[benchmark_skewed(sizeof(BENCHMARK_MALE_NAMES)/sizeof(char*))]);
+    snprintf(account.surname, sizeof(account.surname), "%s", BENCHMARK_SURNAMES[benchmark_skewed(sizeof(BENCHMARK_SURNAMES)/sizeof(char*))]);
+    size_t surname_length = strlen(account.surname);
+    if (female && account.surname[surname_length - 1] == 'i')
+        account.surname[surname_length - 1] = 'a';
+    uint32_t city = benchmark_skewed(sizeof(BENCHMARK_CITIES)/sizeof(char*));
+    const char* street = BENCHMARK_STREETS[benchmark_uniform(sizeof(BENCHMARK_STREETS)/sizeof(char*))];
+    char address[64];
+    int length = snprintf(address, sizeof(address), "ul. %s %u %s-%03u %s", street, 1 + benchmark_skewed(99),
+                          BENCHMARK_POSTCODE_PREFIXES[city], benchmark_uniform(1000), BENCHMARK_CITIES[city]);
+    const char* shown = length > LENGTH_OF_ADDRESS ? address + 4 : address;
+    int shown_length = (int)strlen(shown);
+    if (shown_length > LENGTH_OF_ADDRESS){
+        shown_length = LENGTH_OF_ADDRESS;
+        while (shown_length > 0 && ((uint8_t)shown[shown_length] & 0xC0) == 0x80)
+            shown_length--; // never keep half of a letter
+    }
+    snprintf(account.address, sizeof(account.address), "%.*s", shown_length, shown);
+    benchmark_national_id(account_number, female, account.national_id);
+    // balances spread over several orders of magnitude, about a quarter of accounts carry a loan
+    uint32_t magnitude = 10;
+    for (uint32_t i = benchmark_uniform(6); i > 0; i--)
+        magnitude *= 10;
+    account.curr_balance = (money_t)benchmark_uniform(magnitude) * MONEY_SCALE;
+    account.loan_balance = benchmark_uniform(4) == 0 ? (money_t)benchmark_uniform(200000) * MONEY_SCALE : 0;
+    account.interest_rate = (rate_t)(100 + benchmark_uniform(1400)) * (RATE_SCALE / 10000);
+    return account;
+}
+
+// writes the book straight into the store: the generator is not a workload and does not go through the journal
+int benchmark_generate(uint32_t n_of_accounts){
+    if (store_reserve(n_of_accounts + 1) != 0 || store_truncate(1) != 0 || store_append(&ROOT_BANK_ACCOUNT) != 0)
+        return 1;
+    for (uint32_t i = 2; i <= n_of_accounts; i++){
+        acc_t account = benchmark_account(i);
+        if (store_append(&account) != 0)
+            return 1;
+    }
+    number_of_accounts = n_of_accounts;
+    return store_sync();
+}
+
+int compare_latencies(const void* a, const void* b){
+    uint64_t latency_a = *(const uint64_t*)a, latency_b = *(const uint64_t*)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+void benchmark_report(benchmark_result_t* result){
+    qsort(result->latencies, result->n_of_ops, sizeof(uint64_t), compare_latencies);
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("%-20s %10llu %12.0f", result->name, (unsigned long long)result->n_of_ops,
+           result->n_of_ops / (result->total_ns / 1e9));
+    for (int i = 0; i < 4; i++)
+        printf(" %10.1f", result->latencies[(uint64_t)(percentiles[i] * (result->n_of_ops - 1))] / 1e3);
+    printf(" %10.1f", result->latencies[result->n_of_ops - 1] / 1e3);
+    if (result->n_of_failed != 0)
+        printf("  (%llu rejected)", (unsigned long long)result->n_of_failed);
+    printf("\n");
+    fflush(stdout);
+}
+
+// operation is called with the operation's sequence number and returns nonzero when the bank rejected it
+int benchmark_run(const char* name, uint64_t n_of_ops, uint64_t* latencies, int (*operation)(uint64_t)){
+    benchmark_result_t result = {name, latencies, n_of_ops, 0, 0};
+    benchmark_mute();
+    uint64_t start = benchmark_now_ns();
+    for (uint64_t i = 0; i < n_of_ops; i++){
+        uint64_t op_start = benchmark_now_ns();
+        result.n_of_failed += operation(i) != 0;
+        latencies[i] = benchmark_now_ns() - op_start;
+    }
+    result.total_ns = benchmark_now_ns() - start;
+    benchmark_unmute();
+    benchmark_report(&result);
+    return 0;
+}
+
+uint32_t benchmark_random_customer(){
+    return 2 + benchmark_uniform(number_of_accounts - 1);
+}
+
+int benchmark_get(uint64_t i){
+    (void)i;
+    return get_account(benchmark_random_customer()).account_number == NULL_ACCOUNT.account_number;
+}
+
+// mostly customer to customer, with payouts from the bank hot spot and some overdrafts that get rejected
+int benchmark_transfer(uint64_t i){
+    (void)i;
+    uint32_t kind = benchmark_uniform(10);
+    uint32_t origin = kind == 0 ? ROOT_BANK_ACCOUNT.account_number : benchmark_random_customer();
+    uint32_t destination = benchmark_random_customer();
+    money_t value = kind == 1 ? MAX_TRANSFER : (1 + (money_t)benchmark_uniform(500)) * MONEY_SCALE;
+    return make_transfer(origin, destination, value);
+}
+
+// payroll-like traffic: a few business accounts paying and being paid by a skewed set of customers
+int benchmark_hot_transfer(uint64_t i){
+    uint32_t business = 2 + benchmark_uniform(BENCHMARK_HOT_ACCOUNTS);
+    uint32_t customer = 2 + benchmark_skewed(number_of_accounts - 1);
+    if (business == customer)
+        customer = ROOT_BANK_ACCOUNT.account_number;
+    money_t value = (1 + (money_t)benchmark_uniform(10)) * MONEY_SCALE;
+    return i % 2 == 0 ? make_transfer(business, customer, value) : make_transfer(customer, business, value);
+}
+
+int benchmark_search_option = 1;
+
+// queries are taken from a random existing account, so they always have matches
+int benchmark_search(uint64_t i){
+    (void)i;
+    acc_t account = get_account(benchmark_random_customer());
+    char query[MAX_COMMAND_LENGTH];
+    switch (benchmark_search_option){
+        case 1:
+            snprintf(query, sizeof(query), "%u ", account.account_number);
+            break;
+        case 2:
+            snprintf(query, sizeof(query), "%.3s ", account.name);
+            break;
+        case 3:
+            snprintf(query, sizeof(query), "%.4s ", account.surname);
+            break;
+        case 4:
+            snprintf(query, sizeof(query), "%.7s ", account.address);
+            break;
+        default:
+            snprintf(query, sizeof(query), "%.*s ", LENGTH_OF_NATIONAL_ID, account.national_id);
+            break;
+    }
+    return search_for_account(benchmark_search_option, query);
+}
+
+// a surname as an agent might type it: lower case, without Polish letters and with its fourth letter mistyped
+int benchmark_fuzzy_search(uint64_t i){
+    (void)i;
+    acc_t account = get_account(benchmark_random_customer());
+    char query[LENGTH_OF_NORMALIZED + 2];
+    size_t length = normalize_text(account.surname, LENGTH_OF_SURNAME, query, LENGTH_OF_NORMALIZED);
+    if (length > 3)
+        query[3] = query[3] == 'x' ? 'q' : 'x';
+    query[length] = ' ';
+    query[length + 1] = '\0';
+    return search_for_account(3, query);
+}
+
+int benchmark_list(uint64_t i){
+    (void)i;
+    return read_all_records(FULL_VIEW);
+}
+
+int benchmark_report_totals(uint64_t i){
+    (void)i;
+    return print_report_totals();
+}
+
+int benchmark_report_scan(uint64_t i){
+    (void)i;
+    return print_report(LOAN_COLUMN, 1000 * (money_t)MONEY_SCALE, MAX_LOAN_VALUE);
+}
+
+int benchmark_top_loans(uint64_t i){
+    (void)i;
+    return print_order_top(LOAN_COLUMN, DEFAULT_TOP_COUNT);
+}
+
+// one-unit ranges sliding over the low balances, where the generated book is densest
+int benchmark_balance_range(uint64_t i){
+    money_t min = (money_t)(i % 1000) * MONEY_SCALE;
+    return print_order_range(BALANCE_COLUMN, min, min + MONEY_SCALE);
+}
+
+int benchmark_interest(uint64_t i){
+    (void)i;
+    return collect_interest_all();
+}
+
+// monthly orders between random customers, due on the first 28 days of January 2030
+int benchmark_standing_orders(uint64_t n_of_orders){
+    unlink(STANDING_ORDERS_FILE);
+    benchmark_mute();
+    int result = 0;
+    for (uint64_t i = 0; i < n_of_orders && result == 0; i++){
+        uint32_t source = benchmark_random_customer(), destination = benchmark_random_customer();
+        if (source == destination)
+            destination = ROOT_BANK_ACCOUNT.account_number;
+        money_t amount = (1 + (money_t)benchmark_uniform(500)) * MONEY_SCALE;
+        result = add_standing_order(source, destination, amount, 1, 'm', day_from_date(2030, 1, 1 + benchmark_uniform(28)));
+    }
+    benchmark_unmute();
+    return result;
+}
+
+// each run pays every order once, for the next month
+int benchmark_run_due(uint64_t i){
+    return run_due_orders(day_from_date(2030, 1 + (int)i, 28));
+}
+
+int benchmark_main(int argc, char* argv[]){
+    long long n_of_accounts = BENCHMARK_DEFAULT_ACCOUNTS, n_of_ops = BENCHMARK_DEFAULT_OPS;
+    long long cache_capacity = ACCOUNT_CACHE_DEFAULT_CAPACITY;
+    const char* directory = NULL;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--accounts") == 0 && i + 1 < argc){
+            n_of_accounts = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc){
+            n_of_ops = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+            benchmark_rng_state = strtoull(argv[++i], NULL, 10) | 1;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc){
+            cache_capacity = strtoll(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc){
+            directory = argv[++i];
+        } else {
+            printf("Usage: %s [--accounts <n>] [--ops <n>] [--seed <n>] [--cache <accounts>] [--dir <directory to keep the book in>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_of_accounts < BENCHMARK_MIN_ACCOUNTS || n_of_accounts > BENCHMARK_MAX_ACCOUNTS){
+        printf("Account count must be between %d and %d\n", BENCHMARK_MIN_ACCOUNTS, BENCHMARK_MAX_ACCOUNTS);
+        return 1;
+    }
+    if (n_of_ops < BENCHMARK_SEARCH_SHARE){
+        printf("Operation count must be at least %d\n", BENCHMARK_SEARCH_SHARE);
+        return 1;
+    }
+    // the book and its journal live in their own directory, a temporary one unless --dir is given
+    char temporary_directory[] = "/tmp/banking_benchmark.XXXXXX";
+    if (directory == NULL && (directory = mkdtemp(temporary_directory)) == NULL){
+        printf("Error creating benchmark directory\n");
+        return 1;
+    }
+    if (chdir(directory) != 0){
+        printf("Error entering benchmark directory\n");
+        return 1;
+    }
+    uint64_t* latencies = malloc((size_t)n_of_ops * sizeof(uint64_t));
+    benchmark_stdout = dup(STDOUT_FILENO);
+    if (latencies == NULL || benchmark_stdout < 0 || store_open() != 0 || journal_open() != 0 || journal_checkpoint() != 0){
+        printf("Error preparing benchmark\n");
+        return 1;
+    }
+    REQUIRE_CONFIRMATION_ON_EDIT = false;
+    REPORT_SUCCESS = false;
+    journal_group_commit = true; // the workloads stand for server traffic, whose commits share fsyncs
+
+    uint64_t start = benchmark_now_ns();
+    if (benchmark_generate(n_of_accounts) != 0)
+        return 1;
+    uint64_t generated = benchmark_now_ns();
+    if (build_indexes() != 0)
+        return 1;
+    uint64_t indexed = benchmark_now_ns();
+    store_close();
+    if (store_open() != 0 || cache_resize(cache_capacity < 0 ? UINT32_MAX : (uint32_t)cache_capacity) != 0)
+        return 1;
+    uint64_t reopened = benchmark_now_ns();
+    printf("book: %lld accounts in %s, generated in %.2f s, indexed in %.2f s, reopened in %.3f ms\n",
+           n_of_accounts, directory, (generated - start) / 1e9, (indexed - generated) / 1e9, (reopened - indexed) / 1e6);
+    printf("%-20s %10s %12s %10s %10s %10s %10s %10s\n", "workload", "ops", "ops/sec", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    static const char* search_names[] = {"search number", "search name", "search surname", "search address", "search national id"};
+    benchmark_run("get_account", n_of_ops, latencies, benchmark_get);
+    benchmark_run("transfer mix", n_of_ops, latencies, benchmark_transfer);
+    benchmark_run("transfer hot set", n_of_ops, latencies, benchmark_hot_transfer);
+    for (benchmark_search_option = 1; benchmark_search_option <= 5; benchmark_search_option++)
+        benchmark_run(search_names[benchmark_search_option - 1], n_of_ops / BENCHMARK_SEARCH_SHARE, latencies, benchmark_search);
+    benchmark_run("search surname typo", n_of_ops / BENCHMARK_SEARCH_SHARE, latencies, benchmark_fuzzy_search);
+    benchmark_run("list", BENCHMARK_SWEEPS, latencies, benchmark_list);
+    benchmark_run("report totals", n_of_ops / BENCHMARK_SEARCH_SHARE, latencies, benchmark_report_totals);
+    benchmark_run("report loan scan", BENCHMARK_SWEEPS, latencies, benchmark_report_scan);
+    benchmark_run("top loans", n_of_ops / BENCHMARK_SEARCH_SHARE, latencies, benchmark_top_loans);
+    benchmark_run("balance range", n_of_ops / BENCHMARK_SEARCH_SHARE, latencies, benchmark_balance_range);
+    benchmark_run("collect_interest all", BENCHMARK_SWEEPS, latencies, benchmark_interest);
+    if (benchmark_standing_orders(n_of_ops) != 0)
+        return 1;
+    benchmark_run("run_due", BENCHMARK_SWEEPS, latencies, benchmark_run_due);
+    print_cache_stats();
+
+    free(latencies);
+    journal_close();
+    store_close();
+    if (directory == temporary_directory){
+        store_remove(RECORD_FILE);
+        unlink(JOURNAL_FILE);
+        unlink(STANDING_ORDERS_FILE);
+        chdir("/");
+        rmdir(temporary_directory);
+    }
     return 0;
 }
+#endif
+
+#ifdef TEST_BUILD
+int n_of_failed_checks = 0;
+
+void test_check(bool condition, const char* test, const char* what){
+    if (condition)
+        return;
+    printf("%s: %s\n", test, what);
+    n_of_failed_checks++;
+}
+
+acc_t test_account(const char* name, const char* national_id){
+    acc_t account = NULL_ACCOUNT;
+    snprintf(account.name, sizeof(account.name), "%s", name);
+    snprintf(account.surname, sizeof(account.surname), "Testowy");
+    snprintf(account.address, sizeof(account.address), "ul. Polna 1 00-001 Warszawa");
+    memcpy(account.national_id, national_id, LENGTH_OF_NATIONAL_ID);
+    return account;
+}
+
+// a closed account's number given to a new customer shows none of the previous customer's entries
+void test_reused_number_history(){
+    const char* test = "reused number history";
+    test_check(add_account(test_account("Adam", "90010112345")) == 0, test, "first customer not added");
+    uint32_t number = store.n_of_slots - 1;
+    test_check(make_deposit(number, 250 * MONEY_SCALE) == 0 && make_withdraw(number, 250 * MONEY_SCALE) == 0 &&
+               close_account(number) == 0, test, "first customer not closed");
+    test_check(add_account(test_account("Beata", "91020254321")) == 0 && store.n_of_slots - 1 == number &&
+               strcmp(get_account(number).name, "Beata") == 0, test, "number not reused");
+    ledger_entry_t entry;
+    uint64_t head = ledger_head(number);
+    test_check(head != 0 && ledger_read(head - 1, &entry) == 0 && entry.operation == LEDGER_OPEN &&
+               entry.previous == 0 && entry.height == 0, test, "history reaches past the new opening");
+    test_check(head != 0 && ledger_find(number, entry.timestamp - 1, &entry) == 0, test,
+               "balance before the opening comes from the previous customer");
+}
+
+// orders of a closed account are cancelled, and one that outlived a close is not paid to the number's next holder
+void test_closed_account_orders(){
+    const char* test = "closed account orders";
+    acc_t payer = test_account("Cezary", "92030311111");
+    payer.curr_balance = 1000 * MONEY_SCALE;
+    test_check(add_account(payer) == 0, test, "payer not added");
+    uint32_t source = store.n_of_slots - 1;
+    test_check(add_account(test_account("Dorota", "93040422222")) == 0, test, "payee not added");
+    uint32_t destination = store.n_of_slots - 1;
+    test_check(add_standing_order(source, destination, 10 * MONEY_SCALE, 1, 'm', today()) == 0, test, "order not added");
+    uint32_t position = standing_orders.header.n_of_orders - 1;
+    test_check(close_account(destination) == 0 && standing_orders.orders[position].cancelled, test, "order outlived the close");
+    // as if the order had been made before closes cancelled orders
+    standing_orders.orders[position].cancelled = 0;
+    test_check(standing_orders_write(position) == 0, test, "order not restored");
+    test_check(add_account(test_account("Edyta", "94050533333")) == 0 && store.n_of_slots - 1 == destination, test, "number not reused");
+    test_check(run_due_orders(today()) == 0 && get_account(destination).curr_balance == 0 &&
+               get_account(source).curr_balance == 1000 * MONEY_SCALE, test, "new holder of the number was paid");
+    test_check(standing_orders_load() == 0 && standing_orders.header.n_of_orders == 0, test, "order kept after the run");
+}
+
+// writes the new orders file of a run whose write-back appends the given entry at the given position
+int test_write_run(uint64_t position, const ledger_entry_t* first, uint32_t next_id){
+    standing_orders_header_t header = standing_orders.header;
+    header.n_of_orders = 0;
+    header.next_id = next_id;
+    header.ledger_position = position;
+    header.ledger_timestamp = first->timestamp;
+    header.ledger_account = first->account_number;
+    header.ledger_counterparty = first->counterparty;
+    int fd = open(STANDING_ORDERS_FILE ".new", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = fd < 0 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header);
+    if (fd >= 0)
+        close(fd);
+    return result;
+}
+
+// a run that stopped before its write-back is dropped even once later operations have taken its place in
+// the ledger, and one that stopped after it is put in place
+void test_orders_run_settle(){
+    const char* test = "orders run settle";
+    acc_t account = test_account("Filip", "95060644444");
+    account.curr_balance = 100 * MONEY_SCALE;
+    test_check(add_account(account) == 0 && standing_orders_load() == 0, test, "account not added");
+    uint32_t number = store.n_of_slots - 1, next_id = standing_orders.header.next_id;
+    ledger_entry_t lost = ledger_entry(LEDGER_TRANSFER_OUT, &account, ROOT_BANK_ACCOUNT.account_number, -MONEY_SCALE, 0);
+    lost.timestamp = ledger_stamp();
+    test_check(test_write_run(ledger.n_of_entries + ledger.n_of_chunk, &lost, next_id + 100) == 0, test, "run not written");
+    standing_orders_discard();
+    test_check(make_deposit(number, MONEY_SCALE) == 0 && standing_orders_settle_run() == 0 &&
+               access(STANDING_ORDERS_FILE ".new", F_OK) != 0 && standing_orders_load() == 0 &&
+               standing_orders.header.next_id == next_id, test, "run that never wrote back was put in place");
+
+    ledger_entry_t written;
+    uint64_t head = ledger_head(number);
+    test_check(head != 0 && ledger_read(head - 1, &written) == 0 && test_write_run(head - 1, &written, next_id + 100) == 0,
+               test, "run not written");
+    standing_orders_discard();
+    test_check(standing_orders_settle_run() == 0 && standing_orders_load() == 0 && standing_orders.header.next_id == next_id + 100,
+               test, "run that wrote back was dropped");
+}
+
+// runs every test against a new book in a temporary directory
+int test_main(){
+    char directory[] = "/tmp/banking_test.XXXXXX";
+    if (mkdtemp(directory) == NULL || chdir(directory) != 0){
+        printf("Error creating test directory\n");
+        return 1;
+    }
+    if (store_open() != 0 || journal_open() != 0 || journal_checkpoint() != 0 || store_append(&ROOT_BANK_ACCOUNT) != 0){
+        printf("Error preparing tests\n");
+        return 1;
+    }
+    number_of_accounts = 1;
+    REQUIRE_CONFIRMATION_ON_EDIT = false;
+    REPORT_SUCCESS = false;
+
+    test_reused_number_history();
+    test_closed_account_orders();
+    test_orders_run_settle();
+
+    standing_orders_discard();
+    journal_close();
+    store_close();
+    store_remove(RECORD_FILE);
+    unlink(JOURNAL_FILE);
+    unlink(LEDGER_FILE);
+    unlink(LEDGER_INDEX_FILE);
+    unlink(STANDING_ORDERS_FILE);
+    unlink(STATS_FILE);
+    if (chdir("/") == 0)
+        rmdir(directory);
+    printf("%d checks failed\n", n_of_failed_checks);
+    return n_of_failed_checks != 0;
+}
+#endif
 
-int main() {
+int main(int argc, char* argv[]) {
+#ifdef BENCHMARK_BUILD
+    return benchmark_main(argc, argv);
+#endif
+#ifdef TEST_BUILD
+    return test_main();
+#endif
+    const char* batch_file = NULL;
+    const char* serve_path = NULL;
+    char* run_due_date = NULL;
+    char* list_format = NULL;
+    long n_of_threads = 1;
+    long cache_capacity = ACCOUNT_CACHE_DEFAULT_CAPACITY;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--migrate") == 0){
+            return store_migrate();
+        } else if (strcmp(argv[i], "--recover") == 0){
+            if (snapshot_restore() != 0)
+                return 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc){
+            batch_file = argv[++i];
+        } else if (strcmp(argv[i], "--run-due") == 0 && i + 1 < argc){
+            run_due_date = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc){
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc){
+            return run_client(argv[++i]);
+        } else if (strcmp(argv[i], "--list") == 0 && i + 1 < argc){
+            list_format = argv[++i];
+            if (set_output_format(list_format) != 0)
+                return 1;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc){
+            cache_capacity = strtol(argv[++i], NULL, 10);
+            if (cache_capacity < 0 || cache_capacity > ACCOUNT_CACHE_MAX_CAPACITY){
+                printf("Cache capacity must be between 0 and %u accounts\n", ACCOUNT_CACHE_MAX_CAPACITY);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            n_of_threads = strtol(argv[++i], NULL, 10);
+            if (n_of_threads < 1 || n_of_threads > MAX_WORKER_THREADS){
+                printf("Thread count must be between 1 and %d\n", MAX_WORKER_THREADS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc){
+            long interval = strtol(argv[++i], NULL, 10);
+            if (interval < 0 || interval > 86400){
+                printf("Statistics interval must be between 0 and 86400 seconds\n");
+                return 1;
+            }
+            stats_dump_interval = interval;
+        } else {
+            printf("Usage: %s [--migrate | --recover | --list <table|csv|json> | --batch <file|-> [--threads <n>] | --run-due <date|today> | --serve <socket> | --connect <socket>] [--cache <accounts>] [--stats-interval <seconds>]\n", argv[0]);
+            return 1;
+        }
+    }
     //reset_file();
-    print_welcome_screen();
-    verify_file_integrity();
+    if (batch_file == NULL && run_due_date == NULL && list_format == NULL && serve_path == NULL)
+        print_welcome_screen();
+    if (store_open() != 0 || journal_open() != 0 || journal_replay() != 0 || standing_orders_settle_run() != 0 ||
+        cache_resize(cache_capacity) != 0)
+        return 1;
+    stats_reset(); // recovery is not part of the steady state
+    stats_dumped_ns = stats_started_ns;
     acc_t last_account = get_last_account();
     number_of_accounts = last_account.account_number;
     REQUIRE_CONFIRMATION_ON_EDIT = true;
-    
+
+    if (list_format != NULL){
+        int result = read_all_records(FULL_VIEW);
+        journal_close();
+        store_close();
+        return result;
+    }
+    if (serve_path != NULL){
+        int result = run_server(serve_path);
+        stats_dump();
+        journal_close();
+        store_close();
+        return result;
+    }
+    if (batch_file != NULL){
+        int result = run_batch(batch_file, n_of_threads);
+        stats_dump();
+        journal_close();
+        store_close();
+        return result;
+    }
+    if (run_due_date != NULL){
+        // for a scheduler to start after the close of business
+        REQUIRE_CONFIRMATION_ON_EDIT = false;
+        int result = run_due_command(run_due_date);
+        stats_dump();
+        journal_close();
+        store_close();
+        return result;
+    }
     while(1) {
         if(read_command()==1){
             break;